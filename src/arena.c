@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Arena.
+ * A list of blocks, the newest first, that allocations are bumped off the end
+ * of. Blocks start small, so that an arena with only a few things in it doesn't
+ * waste much, and double up to a limit. Anything bigger than a block gets one
+ * of its own.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+
+#include "arena.h"
+#include "ref_count.h"
+
+
+#define BLOCK_SIZE_MIN (2 * 1024)
+#define BLOCK_SIZE_MAX (256 * 1024)
+
+
+/* The strictest alignment of anything we'd put in one */
+typedef union
+{
+    long double ld;
+    long long ll;
+    void *p;
+    void (*fp)(void);
+} align_t;
+
+#define ALIGN(n) (((n) + sizeof(align_t) - 1) & ~(sizeof(align_t) - 1))
+
+
+typedef struct _block_t
+{
+    struct _block_t *next;
+    size_t size;
+    size_t used;
+} block_t;
+
+#define BLOCK_HEADER_SIZE ALIGN(sizeof(block_t))
+
+struct _arena_t
+{
+    ref_count_t ref_count;
+    block_t *blocks;
+    size_t next_size;
+};
+
+
+arena_t *arena_new( void )
+{
+    arena_t *arena = malloc( sizeof(*arena) );
+
+
+    ref_count_init( &arena->ref_count );
+    arena->blocks = NULL;
+    arena->next_size = BLOCK_SIZE_MIN;
+
+
+    return arena;
+}
+
+static void arena_delete( arena_t *arena )
+{
+    block_t *block, *next;
+
+
+    for( block = arena->blocks; block; block = next )
+    {
+        next = block->next;
+        free( block );
+    }
+
+    free( arena );
+}
+
+void *arena_alloc( arena_t *arena, size_t size )
+{
+    block_t *block = arena->blocks;
+    void *p;
+
+
+    size = ALIGN( size );
+
+    if( !block || block->used + size > block->size )
+    {
+        block = malloc( BLOCK_HEADER_SIZE + MAX( arena->next_size, size ) );
+        block->size = MAX( arena->next_size, size );
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+
+        arena->next_size = MIN( arena->next_size * 2, BLOCK_SIZE_MAX );
+    }
+
+    p = (char *)block + BLOCK_HEADER_SIZE + block->used;
+    block->used += size;
+
+
+    return p;
+}
+
+void arena_hold( arena_t *arena )
+{
+    ref_count_inc( &arena->ref_count );
+}
+
+void arena_release( arena_t *arena )
+{
+    if( !ref_count_dec( &arena->ref_count ) ) arena_delete( arena );
+}
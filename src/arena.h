@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Arena. Hands out memory from a few big blocks rather than a malloc() each,
+ * and frees it all at once. It's reference-counted so that things allocated in
+ * it can each hold it: it goes when the last of them lets go.
+ * Allocating isn't thread-safe; holding and releasing are.
+ */
+
+#ifndef _INCLUDED_ARENA_H
+#define _INCLUDED_ARENA_H
+
+#include "common.h"
+
+#include <stddef.h>
+
+
+typedef struct _arena_t arena_t;
+
+
+/* The caller holds the new arena */
+extern arena_t *arena_new( void );
+
+/* Aligned for anything */
+extern void *arena_alloc( arena_t *arena, size_t size );
+
+extern void arena_hold( arena_t *arena );
+extern void arena_release( arena_t *arena );
+
+#endif /* _INCLUDED_ARENA_H */
@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Block cache implementation.
+ * The cache is split into stripes, each with its own lock, hash table, LRU list
+ * and share of the budget, so that lookups on different threads rarely
+ * contend. A block always lives in the stripe its key hashes to.
+ * Blocks are written through to the disk cache, if there is one, and blocks
+ * we don't have are looked for there before we give up.
+ * Blocks that are being read from in place are held; if they're thrown out
+ * meanwhile they stop counting against the budget, and are freed when the last
+ * hold on them goes.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block_cache.h"
+
+#include "config_manager.h"
+#include "config_reader.h"
+#include "disk_cache.h"
+#include "queue.h"
+
+
+TRACE_DEFINE(block_cache)
+
+
+#define STRIPE_COUNT  16
+#define BUCKET_COUNT 256
+
+typedef struct _block_t
+{
+    const char *hash;
+    off_t index;
+    unsigned long key;
+    char *data;
+    size_t len;
+    unsigned holds;
+    int evicted;
+
+    LIST_ENTRY(_block_t) bucket;
+    TAILQ_ENTRY(_block_t) lru;
+} block_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    LIST_HEAD(_block_bucket_t,_block_t) buckets[ BUCKET_COUNT ];
+    TAILQ_HEAD(_block_lru_t,_block_t) lru; /* oldest at the head */
+    size_t bytes;
+
+    unsigned long hits;
+    unsigned long misses;
+} stripe_t;
+
+
+static stripe_t s_stripes[ STRIPE_COUNT ];
+static size_t s_stripe_budget = 0;
+
+
+static void memory_insert( const char *hash, off_t index, const char *data, size_t len );
+static size_t disk_read( const char *hash, off_t index, size_t block_off, size_t len, char *buf );
+
+
+int block_cache_init( void )
+{
+    config_reader_t *config = config_get_reader( );
+    unsigned i, j;
+
+
+    s_stripe_budget = config_block_cache_size( config ) / STRIPE_COUNT;
+    config_reader_delete( config );
+
+    for( i = 0; i < STRIPE_COUNT; i++ )
+    {
+        pthread_mutex_init( &s_stripes[ i ].lock, NULL );
+        for( j = 0; j < BUCKET_COUNT; j++ ) LIST_INIT( &s_stripes[ i ].buckets[ j ] );
+        TAILQ_INIT( &s_stripes[ i ].lru );
+        s_stripes[ i ].bytes = 0;
+        s_stripes[ i ].hits = s_stripes[ i ].misses = 0;
+    }
+
+
+    return 0;
+}
+
+static void block_free( block_t *block )
+{
+    free_const( block->hash );
+    free( block->data );
+    free( block );
+}
+
+/* Call with the stripe's lock held */
+static void block_evict( stripe_t *stripe, block_t *block )
+{
+    LIST_REMOVE( block, bucket );
+    TAILQ_REMOVE( &stripe->lru, block, lru );
+    stripe->bytes -= block->len;
+
+    if( block->holds ) block->evicted = 1;
+    else               block_free( block );
+}
+
+void block_cache_finalise( void )
+{
+    unsigned long hits, misses;
+    unsigned i;
+
+
+    block_cache_get_stats( &hits, &misses );
+    block_cache_trace( "block cache: %lu hits, %lu misses\n", hits, misses );
+
+    for( i = 0; i < STRIPE_COUNT; i++ )
+    {
+        while( !TAILQ_EMPTY( &s_stripes[ i ].lru ) )
+        {
+            block_evict( &s_stripes[ i ], TAILQ_FIRST( &s_stripes[ i ].lru ) );
+        }
+        pthread_mutex_destroy( &s_stripes[ i ].lock );
+    }
+}
+
+static int memory_is_enabled( void )
+{
+    return s_stripe_budget >= BLOCK_CACHE_BLOCK_SIZE;
+}
+
+int block_cache_is_enabled( void )
+{
+    return memory_is_enabled( ) || disk_cache_is_enabled( );
+}
+
+static unsigned long key_make( const char *hash, off_t index )
+{
+    unsigned long key = 5381;
+
+
+    while( *hash ) key = (key * 33) ^ (unsigned char)*hash++;
+    key ^= (unsigned long)index * 2654435761UL;
+
+
+    return key;
+}
+
+static stripe_t *stripe_get( unsigned long key )
+{
+    return &s_stripes[ key % STRIPE_COUNT ];
+}
+
+/* Call with the stripe's lock held */
+static block_t *block_find( stripe_t *stripe, unsigned long key, const char *hash, off_t index )
+{
+    block_t *block;
+
+
+    LIST_FOREACH( block, &stripe->buckets[ (key / STRIPE_COUNT) % BUCKET_COUNT ], bucket )
+    {
+        if( block->key == key && block->index == index && !strcmp( block->hash, hash ) )
+        {
+            break;
+        }
+    }
+
+
+    return block;
+}
+
+size_t block_cache_read( const char *hash, off_t off, size_t len, char *buf )
+{
+    size_t done = 0, block_off, copy_len = 0;
+    off_t index;
+    unsigned long key;
+    stripe_t *stripe;
+    block_t *block;
+
+
+    if( !block_cache_is_enabled( ) ) return 0;
+
+    while( done < len )
+    {
+        index = (off + done) / BLOCK_CACHE_BLOCK_SIZE;
+        block_off = (off + done) % BLOCK_CACHE_BLOCK_SIZE;
+        key = key_make( hash, index );
+        stripe = stripe_get( key );
+
+        pthread_mutex_lock( &stripe->lock );
+
+        block = block_find( stripe, key, hash, index );
+        if( block && block_off < block->len )
+        {
+            stripe->hits++;
+
+            TAILQ_REMOVE( &stripe->lru, block, lru );
+            TAILQ_INSERT_TAIL( &stripe->lru, block, lru );
+
+            copy_len = MIN( len - done, block->len - block_off );
+            memcpy( buf + done, block->data + block_off, copy_len );
+        }
+        else
+        {
+            stripe->misses++;
+            copy_len = 0;
+        }
+
+        pthread_mutex_unlock( &stripe->lock );
+
+        if( !copy_len ) copy_len = disk_read( hash, index, block_off, len - done, buf + done );
+        if( !copy_len ) break;
+        done += copy_len;
+    }
+
+
+    return done;
+}
+
+unsigned block_cache_get(
+    const char *hash,
+    off_t off,
+    size_t len,
+    block_cache_span_t *spans,
+    unsigned spans_count
+)
+{
+    size_t done = 0, block_off;
+    unsigned count = 0;
+    off_t index;
+    unsigned long key;
+    stripe_t *stripe;
+    block_t *block;
+
+
+    if( !memory_is_enabled( ) ) return 0;
+
+    while( done < len && count < spans_count )
+    {
+        index = (off + done) / BLOCK_CACHE_BLOCK_SIZE;
+        block_off = (off + done) % BLOCK_CACHE_BLOCK_SIZE;
+        key = key_make( hash, index );
+        stripe = stripe_get( key );
+
+        pthread_mutex_lock( &stripe->lock );
+
+        block = block_find( stripe, key, hash, index );
+        if( block && block_off < block->len )
+        {
+            stripe->hits++;
+
+            TAILQ_REMOVE( &stripe->lru, block, lru );
+            TAILQ_INSERT_TAIL( &stripe->lru, block, lru );
+
+            block->holds++;
+            spans[ count ].data = block->data + block_off;
+            spans[ count ].len = MIN( len - done, block->len - block_off );
+            spans[ count ].block = block;
+        }
+        else
+        {
+            /* Leave the miss to the block_cache_read() that follows */
+            block = NULL;
+        }
+
+        pthread_mutex_unlock( &stripe->lock );
+
+        if( !block ) break;
+        done += spans[ count++ ].len;
+    }
+
+
+    return count;
+}
+
+void block_cache_release( block_cache_span_t *spans, unsigned spans_count )
+{
+    block_t *block;
+    stripe_t *stripe;
+    unsigned i;
+
+
+    for( i = 0; i < spans_count; i++ )
+    {
+        block = (block_t *)spans[ i ].block;
+        stripe = stripe_get( block->key );
+
+        pthread_mutex_lock( &stripe->lock );
+        if( !--block->holds && block->evicted ) block_free( block );
+        pthread_mutex_unlock( &stripe->lock );
+    }
+}
+
+static void memory_insert( const char *hash, off_t index, const char *data, size_t len )
+{
+    unsigned long key;
+    stripe_t *stripe;
+    block_t *block;
+
+
+    if( !memory_is_enabled( ) || !len ) return;
+
+    key = key_make( hash, index );
+    stripe = stripe_get( key );
+
+    pthread_mutex_lock( &stripe->lock );
+
+    if( !block_find( stripe, key, hash, index ) )
+    {
+        block_cache_trace( "caching block %s:%jd (%zu bytes)\n", hash, (intmax_t)index, len );
+
+        while( stripe->bytes + len > s_stripe_budget )
+        {
+            block_evict( stripe, TAILQ_FIRST( &stripe->lru ) );
+        }
+
+        block = malloc( sizeof(*block) );
+        block->hash = strdup( hash );
+        block->index = index;
+        block->key = key;
+        block->data = malloc( len );
+        memcpy( block->data, data, len );
+        block->len = len;
+        block->holds = 0;
+        block->evicted = 0;
+
+        LIST_INSERT_HEAD( &stripe->buckets[ (key / STRIPE_COUNT) % BUCKET_COUNT ], block, bucket );
+        TAILQ_INSERT_TAIL( &stripe->lru, block, lru );
+        stripe->bytes += len;
+    }
+
+    pthread_mutex_unlock( &stripe->lock );
+}
+
+void block_cache_insert( const char *hash, off_t index, const char *data, size_t len )
+{
+    memory_insert( hash, index, data, len );
+    disk_cache_insert_block( hash, index, data, len );
+}
+
+/* Looks on the disk for a block that isn't in memory, and brings it back into
+ * memory if it's there. Returns the number of bytes copied into <buf>. */
+static size_t disk_read( const char *hash, off_t index, size_t block_off, size_t len, char *buf )
+{
+    char *block;
+    size_t block_len, copy_len = 0;
+
+
+    if( !disk_cache_is_enabled( ) ) return 0;
+
+    block = malloc( BLOCK_CACHE_BLOCK_SIZE );
+
+    if( disk_cache_tryget_block( hash, index, block, &block_len ) && block_off < block_len )
+    {
+        memory_insert( hash, index, block, block_len );
+
+        copy_len = MIN( len, block_len - block_off );
+        memcpy( buf, block + block_off, copy_len );
+    }
+
+    free( block );
+
+
+    return copy_len;
+}
+
+void block_cache_get_stats( unsigned long *hits, unsigned long *misses )
+{
+    unsigned i;
+
+
+    *hits = *misses = 0;
+
+    for( i = 0; i < STRIPE_COUNT; i++ )
+    {
+        pthread_mutex_lock( &s_stripes[ i ].lock );
+        *hits   += s_stripes[ i ].hits;
+        *misses += s_stripes[ i ].misses;
+        pthread_mutex_unlock( &s_stripes[ i ].lock );
+    }
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Block cache API.
+ * A process-wide cache of file data, in fixed-size blocks keyed on the file's
+ * hash and the block's index within it. Keying on the hash means that the
+ * same file seen at two paths (or from two peers) shares its blocks.
+ * The least-recently-used blocks are thrown away to keep under the memory
+ * budget. If there's a disk cache, it backs this one. Thread-safe.
+ */
+
+#ifndef _INCLUDED_BLOCK_CACHE_H
+#define _INCLUDED_BLOCK_CACHE_H
+
+#include "common.h"
+
+#include <sys/types.h>
+
+#include "trace.h"
+
+
+TRACE_DECLARE(block_cache)
+#define block_cache_trace(...) TRACE(block_cache,__VA_ARGS__)
+#define block_cache_trace_indent() TRACE_INDENT(block_cache)
+#define block_cache_trace_dedent() TRACE_DEDENT(block_cache)
+
+
+#define BLOCK_CACHE_BLOCK_SIZE (256 * 1024)
+
+
+/* Part of a cached block, held so that it stays put while it's being used,
+ * even if it's thrown out of the cache meanwhile */
+typedef struct
+{
+    const char *data;
+    size_t len;
+    void *block;
+} block_cache_span_t;
+
+
+extern int block_cache_init( void );
+extern void block_cache_finalise( void );
+
+/* Zero if it's been configured off, and so has the disk cache */
+extern int block_cache_is_enabled( void );
+
+/* Copies as much of [off, off + len) into <buf> as is cached, starting at
+ * <off>. Returns the number of bytes copied, which stops short at the first
+ * block that isn't cached. */
+extern size_t block_cache_read( const char *hash, off_t off, size_t len, char *buf );
+/* Like block_cache_read(), but rather than copying the data, points <spans> at
+ * it, one per block, up to <spans_count> of them. Only looks in memory. Returns
+ * the number of spans filled in, which must be given back with
+ * block_cache_release(). */
+extern unsigned block_cache_get(
+    const char *hash,
+    off_t off,
+    size_t len,
+    block_cache_span_t *spans,
+    unsigned spans_count
+);
+extern void block_cache_release( block_cache_span_t *spans, unsigned spans_count );
+/* Copies <data> into the cache. <len> is BLOCK_CACHE_BLOCK_SIZE except for the
+ * file's last block. */
+extern void block_cache_insert( const char *hash, off_t index, const char *data, size_t len );
+
+extern void block_cache_get_stats( unsigned long *hits, unsigned long *misses );
+
+#endif /* _INCLUDED_BLOCK_CACHE_H */
@@ -36,8 +36,10 @@ extern direntry_t *direntry_get_parent       (direntry_t *de);
 extern direntry_t *direntry_get_first_child  (direntry_t *de);
 extern direntry_t *direntry_get_next_sibling (direntry_t *de);
 
-extern char *          direntry_get_name                (direntry_t *de);
-extern char *          direntry_get_hash                (direntry_t *de);
+extern ino_t           direntry_get_inode               (direntry_t *de);
+/* Pooled (see string_pool.h) */
+extern const char *    direntry_get_name                (direntry_t *de);
+extern const char *    direntry_get_hash                (direntry_t *de);
 extern listing_type_t  direntry_get_type                (direntry_t *de);
 extern off_t           direntry_get_size                (direntry_t *de);
 extern unsigned long   direntry_get_link_count          (direntry_t *de);
@@ -50,11 +52,37 @@ extern void            direntry_still_exists            (direntry_t *de);
 extern void            direntry_no_longer_exists        (direntry_t *de);
 
 
+typedef void (*direntry_children_cb_t)(void *ctxt, int rc);
+
+/* Fetches the children of <de> if we haven't already. The async version calls
+ * back straight away if there's nothing to do, or on a fetcher thread when the
+ * fetch is done. Concurrent callers share the one fetch. */
+extern void direntry_ensure_children_async (
+    direntry_t *de,
+    direntry_children_cb_t cb,
+    void *cb_ctxt
+);
 extern int direntry_ensure_children (
     direntry_t *de
 );
 
 
+/* The kernel's been told about <de>'s inode by a lookup(), and so can ask
+ * for it by inode until it forget()s it as many times */
+extern void direntry_looked_up (direntry_t *de);
+/* Whether they're at the same path, if not the same direntry */
+extern int direntry_same_path (direntry_t *de, direntry_t *other);
+extern void direntry_forget (ino_t ino, unsigned long nlookup);
+/* The kernel's opening <de>. Returns whether it can keep what it's cached of
+ * <de>'s inode, which it can if that was opened last with the same content
+ * (and options/keep_cache is on) */
+extern int direntry_opened (direntry_t *de);
+
+typedef void (*direntry_changed_cb_t)(ino_t ino);
+/* <cb> is called, on a fetcher thread, with the inode of any file the kernel
+ * knows about whose content a fetch of its parent shows has changed */
+extern void direntry_set_changed_cb (direntry_changed_cb_t cb);
+
 /* FIXME: stubs */
 extern int direntry_get_by_inode (ino_t ino, direntry_t **de);
 extern int direntry_get_child_by_name (
@@ -62,5 +90,11 @@ extern int direntry_get_child_by_name (
     const char *name,
     direntry_t **de_out
 );
+/* How long the kernel can assume a name that get_child_by_name() said isn't
+ * there still isn't; 0 if it shouldn't */
+extern double direntry_get_negative_timeout (void);
+/* How long the kernel can trust <de>'s attributes, and its name, for */
+extern double direntry_get_attr_timeout (direntry_t *de);
+extern double direntry_get_entry_timeout (direntry_t *de);
 
 #endif /* _INCLUDED_DIRENTRY_H */
@@ -0,0 +1,708 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Disk cache implementation.
+ * Each cached file has two files in the cache directory:
+ *   <hash>.data - a sparse file holding whichever blocks we've got, at their
+ *                 proper offsets.
+ *   <hash>.meta - which blocks those are (a bitmap), where the file ends if we
+ *                 know, and when it was last read.
+ * A block's data is written and synced before the metadata that says it's
+ * there, and the metadata is only ever replaced whole (written to a temporary
+ * file which is then renamed over it), so a crash can lose blocks but can't
+ * leave us believing in ones we haven't got.
+ *
+ * All the metadata is kept in memory too. Writes are queued and done by a
+ * writer thread, so that the fetcher threads never wait on the disk; reads are
+ * done by whoever asks.
+ */
+
+#include "common.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk_cache.h"
+
+#include "block_cache.h"
+#include "config_manager.h"
+#include "config_reader.h"
+#include "queue.h"
+#include "string_buffer.h"
+#include "utils.h"
+
+
+TRACE_DEFINE(disk_cache)
+
+
+#define META_MAGIC     "fsfuse-disk-cache 1"
+#define BUCKET_COUNT   1024
+#define QUEUE_MAX      64   /* writes; 16MiB of blocks */
+
+typedef struct _entry_t
+{
+    const char *hash;
+    int fd;                 /* the data file; -1 until we need it */
+    unsigned char *bitmap;
+    size_t bitmap_len;      /* bytes */
+    off_t eof;              /* -1 until we've seen the last block */
+    off_t bytes;
+    time_t last_used;
+    int dirty;              /* last_used has changed since the meta was written */
+    unsigned refs;          /* reads and writes in progress; can't be evicted */
+
+    LIST_ENTRY(_entry_t) bucket;
+    TAILQ_ENTRY(_entry_t) lru; /* least recently used at the head */
+} entry_t;
+
+typedef struct _write_job_t
+{
+    const char *hash;
+    off_t index;
+    char *data;
+    size_t len;
+    TAILQ_ENTRY(_write_job_t) queue;
+} write_job_t;
+
+
+static const char *s_dir = NULL;
+static off_t s_budget;
+
+/* Protects the entries and stats */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(_entry_bucket_t,_entry_t) s_buckets[ BUCKET_COUNT ];
+static TAILQ_HEAD(_entry_lru_t,_entry_t) s_lru = TAILQ_HEAD_INITIALIZER(s_lru);
+static off_t s_bytes = 0;
+static unsigned long s_hits = 0, s_misses = 0, s_evictions = 0, s_dropped = 0;
+
+/* Protects the write queue and writer thread */
+static pthread_mutex_t s_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_queue_cond = PTHREAD_COND_INITIALIZER;
+static TAILQ_HEAD(_write_job_list_t,_write_job_t) s_queue = TAILQ_HEAD_INITIALIZER(s_queue);
+static unsigned s_queue_len = 0;
+static pthread_t s_writer;
+static int s_writer_started = 0;
+static int s_writer_quit = 0;
+
+
+static void cache_load( void );
+static void *writer_main( void *arg );
+
+
+/* ========================================================================== */
+/*      Entries                                                               */
+/* ========================================================================== */
+
+/* Hashes become file names, so don't let anything odd through */
+static int hash_is_safe( const char *hash )
+{
+    return *hash && !strpbrk( hash, "./" );
+}
+
+static char *path_make( const char *hash, const char *suffix )
+{
+    string_buffer_t *sb = string_buffer_new( );
+
+
+    string_buffer_printf( sb, "%s%s", hash, suffix );
+
+
+    return path_combine( strdup( s_dir ), string_buffer_commit( sb ) );
+}
+
+static unsigned bucket_get( const char *hash )
+{
+    unsigned long h = 5381;
+
+
+    while( *hash ) h = (h * 33) ^ (unsigned char)*hash++;
+
+
+    return h % BUCKET_COUNT;
+}
+
+/* Call with the lock held */
+static entry_t *entry_find( const char *hash )
+{
+    entry_t *e;
+
+
+    LIST_FOREACH( e, &s_buckets[ bucket_get( hash ) ], bucket )
+    {
+        if( hash_equal( e->hash, hash ) ) break;
+    }
+
+
+    return e;
+}
+
+/* Call with the lock held */
+static entry_t *entry_new( const char *hash )
+{
+    entry_t *e = calloc( 1, sizeof(*e) );
+
+
+    e->hash = strdup( hash );
+    e->fd = -1;
+    e->eof = -1;
+    e->last_used = time( NULL );
+
+    LIST_INSERT_HEAD( &s_buckets[ bucket_get( hash ) ], e, bucket );
+    TAILQ_INSERT_TAIL( &s_lru, e, lru );
+
+
+    return e;
+}
+
+/* Call with the lock held, or when there's only one thread */
+static void entry_delete( entry_t *e )
+{
+    LIST_REMOVE( e, bucket );
+    TAILQ_REMOVE( &s_lru, e, lru );
+    s_bytes -= e->bytes;
+
+    if( e->fd != -1 ) close( e->fd );
+    free_const( e->hash );
+    free( e->bitmap );
+    free( e );
+}
+
+static int entry_has_block( entry_t *e, off_t index )
+{
+    return (size_t)(index / 8) < e->bitmap_len &&
+           (e->bitmap[ index / 8 ] & (1 << (index % 8)));
+}
+
+static size_t entry_get_block_len( entry_t *e, off_t index )
+{
+    off_t start = index * BLOCK_CACHE_BLOCK_SIZE;
+
+
+    if( e->eof != -1 && start + BLOCK_CACHE_BLOCK_SIZE > e->eof )
+    {
+        return e->eof - start;
+    }
+
+
+    return BLOCK_CACHE_BLOCK_SIZE;
+}
+
+/* Call with the lock held */
+static int entry_get_fd( entry_t *e )
+{
+    char *path;
+
+
+    if( e->fd == -1 )
+    {
+        path = path_make( e->hash, ".data" );
+        e->fd = open( path, O_RDWR | O_CREAT, 0600 );
+        free( path );
+    }
+
+
+    return e->fd;
+}
+
+/* Call with the lock held */
+static void entry_touch( entry_t *e )
+{
+    e->last_used = time( NULL );
+    e->dirty = 1;
+
+    TAILQ_REMOVE( &s_lru, e, lru );
+    TAILQ_INSERT_TAIL( &s_lru, e, lru );
+}
+
+/* Throws away whole files, least recently used first, until we're under
+ * budget. Call with the lock held. */
+static void evict_to_budget( void )
+{
+    entry_t *e, *next;
+    char *path;
+
+
+    for( e = TAILQ_FIRST( &s_lru ); e && s_bytes > s_budget; e = next )
+    {
+        next = TAILQ_NEXT( e, lru );
+        if( e->refs ) continue;
+
+        disk_cache_trace( "evicting %s (%jd bytes)\n", e->hash, (intmax_t)e->bytes );
+
+        path = path_make( e->hash, ".meta" );
+        unlink( path );
+        free( path );
+        path = path_make( e->hash, ".data" );
+        unlink( path );
+        free( path );
+
+        entry_delete( e );
+        s_evictions++;
+    }
+}
+
+
+/* ========================================================================== */
+/*      Metadata files                                                        */
+/* ========================================================================== */
+
+/* Call with the lock held */
+static char *meta_format( entry_t *e )
+{
+    string_buffer_t *sb = string_buffer_new( );
+    char *hex = malloc( e->bitmap_len * 2 + 1 );
+    size_t i;
+
+
+    hex[ 0 ] = '\0';
+    for( i = 0; i < e->bitmap_len; i++ )
+    {
+        sprintf( hex + i * 2, "%02x", e->bitmap[ i ] );
+    }
+
+    string_buffer_printf( sb, "%s\neof %jd\nused %jd\nbitmap %zu\n%s\n",
+                          META_MAGIC, (intmax_t)e->eof, (intmax_t)e->last_used, e->bitmap_len, hex );
+    free( hex );
+
+    e->dirty = 0;
+
+
+    return string_buffer_commit( sb );
+}
+
+/* Replaces the meta file atomically. Usurps <text>. */
+static void meta_write( const char *hash, char *text )
+{
+    char *path = path_make( hash, ".meta" ),
+         *tmp_path = path_make( hash, ".meta.tmp" );
+    FILE *f = fopen( tmp_path, "w" );
+    int ok = 0;
+
+
+    if( f )
+    {
+        ok = fputs( text, f ) >= 0 && !fflush( f ) && !fsync( fileno( f ) );
+        ok = !fclose( f ) && ok;
+    }
+
+    if( !ok || rename( tmp_path, path ) )
+    {
+        disk_cache_trace( "failed to write %s\n", path );
+        unlink( tmp_path );
+    }
+
+    free( text );
+    free( tmp_path );
+    free( path );
+}
+
+/* Returns NULL if the file's missing or doesn't make sense */
+static entry_t *meta_read( const char *hash )
+{
+    char *path = path_make( hash, ".meta" ), magic[ sizeof(META_MAGIC) ];
+    FILE *f = fopen( path, "r" );
+    entry_t *e = NULL;
+    intmax_t eof, used;
+    size_t bitmap_len, i;
+    unsigned byte;
+    int ok = 0;
+
+
+    if( f &&
+        fgets( magic, sizeof(magic), f ) && !strcmp( magic, META_MAGIC ) &&
+        fscanf( f, "\neof %jd\nused %jd\nbitmap %zu\n", &eof, &used, &bitmap_len ) == 3 )
+    {
+        e = entry_new( hash );
+        e->eof = eof;
+        e->last_used = used;
+        e->bitmap_len = bitmap_len;
+        e->bitmap = calloc( bitmap_len, 1 );
+
+        for( ok = 1, i = 0; ok && i < bitmap_len; i++ )
+        {
+            ok = fscanf( f, "%2x", &byte ) == 1;
+            e->bitmap[ i ] = byte;
+        }
+
+        for( i = 0; ok && i < bitmap_len * 8; i++ )
+        {
+            if( entry_has_block( e, i ) ) e->bytes += entry_get_block_len( e, i );
+        }
+        s_bytes += e->bytes;
+    }
+
+    if( e && !ok )
+    {
+        entry_delete( e );
+        e = NULL;
+    }
+
+    if( f ) fclose( f );
+    free( path );
+
+
+    return e;
+}
+
+
+/* ========================================================================== */
+/*      Init & Teardown                                                       */
+/* ========================================================================== */
+
+int disk_cache_init( void )
+{
+    config_reader_t *config = config_get_reader( );
+    char *dir = config_disk_cache_dir( config );
+    unsigned i;
+
+
+    s_budget = (off_t)config_disk_cache_size_mb( config ) * 1024 * 1024;
+    config_reader_delete( config );
+
+    for( i = 0; i < BUCKET_COUNT; i++ ) LIST_INIT( &s_buckets[ i ] );
+
+    if( !*dir || !s_budget )
+    {
+        free( dir );
+        return 0;
+    }
+
+    if( mkdir( dir, 0700 ) && errno != EEXIST )
+    {
+        trace_error( "can't create disk cache directory %s: %s\n", dir, strerror( errno ) );
+        free( dir );
+        return 1;
+    }
+
+    s_dir = dir;
+    cache_load( );
+
+
+    return 0;
+}
+
+/* Reads in all the meta files, and tidies up after any crash */
+static void cache_load( void )
+{
+    DIR *d = opendir( s_dir );
+    struct dirent *ent;
+    entry_t *e, *pos;
+    char *hash, *dot, *path;
+
+
+    if( !d ) return;
+
+    /* Metadata first, so that we know which data files are wanted */
+    while( (ent = readdir( d )) )
+    {
+        dot = strrchr( ent->d_name, '.' );
+        if( !dot || strcmp( dot, ".meta" ) ) continue;
+
+        hash = strndup( ent->d_name, dot - ent->d_name );
+        if( hash_is_safe( hash ) && !entry_find( hash ) && (e = meta_read( hash )) )
+        {
+            /* Keep the LRU list in order of last use */
+            TAILQ_REMOVE( &s_lru, e, lru );
+            TAILQ_FOREACH( pos, &s_lru, lru )
+            {
+                if( pos->last_used > e->last_used ) break;
+            }
+            if( pos ) TAILQ_INSERT_BEFORE( pos, e, lru );
+            else      TAILQ_INSERT_TAIL( &s_lru, e, lru );
+        }
+        free( hash );
+    }
+
+    /* Then anything that's not accounted for: half-written meta files, and
+     * data files whose meta never got written (or didn't make sense) */
+    rewinddir( d );
+    while( (ent = readdir( d )) )
+    {
+        if( ent->d_name[ 0 ] == '.' ) continue;
+
+        dot = strchr( ent->d_name, '.' );
+        hash = dot ? strndup( ent->d_name, dot - ent->d_name ) : strdup( ent->d_name );
+        if( !dot || (strcmp( dot, ".meta" ) && strcmp( dot, ".data" )) || !entry_find( hash ) )
+        {
+            disk_cache_trace( "removing stray file %s\n", ent->d_name );
+
+            path = path_combine( strdup( s_dir ), strdup( ent->d_name ) );
+            unlink( path );
+            free( path );
+        }
+        free( hash );
+    }
+
+    closedir( d );
+
+    evict_to_budget( );
+
+    disk_cache_trace( "disk cache: %jd bytes in %s\n", (intmax_t)s_bytes, s_dir );
+}
+
+void disk_cache_finalise( void )
+{
+    entry_t *e;
+    unsigned long hits, misses, evictions;
+    off_t bytes;
+
+
+    if( !s_dir ) return;
+
+    pthread_mutex_lock( &s_queue_lock );
+    s_writer_quit = 1;
+    pthread_cond_signal( &s_queue_cond );
+    pthread_mutex_unlock( &s_queue_lock );
+
+    if( s_writer_started ) pthread_join( s_writer, NULL );
+
+    disk_cache_get_stats( &hits, &misses, &evictions, &bytes );
+    disk_cache_trace( "disk cache: %lu hits, %lu misses, %lu evictions, %lu writes dropped, %jd bytes\n",
+                      hits, misses, evictions, s_dropped, (intmax_t)bytes );
+
+    /* Nothing else is running now; save when things were last used */
+    while( (e = TAILQ_FIRST( &s_lru )) )
+    {
+        if( e->dirty ) meta_write( e->hash, meta_format( e ) );
+        entry_delete( e );
+    }
+
+    free_const( s_dir );
+    s_dir = NULL;
+    s_writer_started = 0;
+    s_writer_quit = 0;
+    s_hits = s_misses = s_evictions = s_dropped = 0;
+}
+
+int disk_cache_is_enabled( void )
+{
+    return s_dir != NULL;
+}
+
+
+/* ========================================================================== */
+/*      Reading                                                               */
+/* ========================================================================== */
+
+int disk_cache_tryget_block( const char *hash, off_t index, char *buf, size_t *len )
+{
+    entry_t *e;
+    int fd = -1, held = 0, rc = 0;
+    size_t block_len = 0;
+
+
+    if( !s_dir ) return 0;
+
+    pthread_mutex_lock( &s_lock );
+
+    e = entry_find( hash );
+    if( e && entry_has_block( e, index ) )
+    {
+        held = 1;
+        e->refs++;
+        entry_touch( e );
+        fd = entry_get_fd( e );
+        block_len = entry_get_block_len( e, index );
+    }
+
+    pthread_mutex_unlock( &s_lock );
+
+
+    if( fd != -1 )
+    {
+        rc = pread( fd, buf, block_len, index * BLOCK_CACHE_BLOCK_SIZE ) == (ssize_t)block_len;
+    }
+
+    pthread_mutex_lock( &s_lock );
+    if( held ) e->refs--;
+    if( rc ) s_hits++;
+    else     s_misses++;
+    pthread_mutex_unlock( &s_lock );
+
+    if( rc ) *len = block_len;
+
+
+    return rc;
+}
+
+
+/* ========================================================================== */
+/*      Writing                                                               */
+/* ========================================================================== */
+
+void disk_cache_insert_block( const char *hash, off_t index, const char *data, size_t len )
+{
+    write_job_t *job;
+
+
+    if( !s_dir || !hash_is_safe( hash ) ) return;
+
+    pthread_mutex_lock( &s_queue_lock );
+
+    if( s_queue_len >= QUEUE_MAX )
+    {
+        disk_cache_trace( "write queue full; dropping block %s:%jd\n", hash, (intmax_t)index );
+        s_dropped++;
+    }
+    else
+    {
+        job = malloc( sizeof(*job) );
+        job->hash = strdup( hash );
+        job->index = index;
+        job->data = malloc( len );
+        memcpy( job->data, data, len );
+        job->len = len;
+
+        TAILQ_INSERT_TAIL( &s_queue, job, queue );
+        s_queue_len++;
+
+        /* Started here rather than in init so that it survives
+         * fuse_daemonize() */
+        if( !s_writer_started )
+        {
+            assert( !pthread_create( &s_writer, NULL, &writer_main, NULL ) );
+            s_writer_started = 1;
+        }
+        pthread_cond_signal( &s_queue_cond );
+    }
+
+    pthread_mutex_unlock( &s_queue_lock );
+}
+
+/* EXECUTES IN THREAD: disk cache writer */
+static void job_do( write_job_t *job )
+{
+    entry_t *e;
+    int fd, ok;
+    char *meta = NULL;
+
+
+    pthread_mutex_lock( &s_lock );
+
+    e = entry_find( job->hash );
+    if( !e ) e = entry_new( job->hash );
+    if( entry_has_block( e, job->index ) )
+    {
+        pthread_mutex_unlock( &s_lock );
+        return;
+    }
+    e->refs++;
+    fd = entry_get_fd( e );
+
+    pthread_mutex_unlock( &s_lock );
+
+
+    /* The data has to be on the disk before the meta says it is */
+    ok = fd != -1 &&
+         pwrite( fd, job->data, job->len, job->index * BLOCK_CACHE_BLOCK_SIZE ) == (ssize_t)job->len &&
+         !fdatasync( fd );
+
+
+    pthread_mutex_lock( &s_lock );
+
+    if( ok )
+    {
+        if( (size_t)(job->index / 8) >= e->bitmap_len )
+        {
+            e->bitmap = realloc( e->bitmap, job->index / 8 + 1 );
+            memset( e->bitmap + e->bitmap_len, 0, job->index / 8 + 1 - e->bitmap_len );
+            e->bitmap_len = job->index / 8 + 1;
+        }
+        e->bitmap[ job->index / 8 ] |= 1 << (job->index % 8);
+
+        if( job->len < BLOCK_CACHE_BLOCK_SIZE )
+        {
+            e->eof = job->index * BLOCK_CACHE_BLOCK_SIZE + job->len;
+        }
+        e->bytes += job->len;
+        s_bytes += job->len;
+        entry_touch( e );
+
+        meta = meta_format( e );
+    }
+    else
+    {
+        disk_cache_trace( "failed to write block %s:%jd\n", job->hash, (intmax_t)job->index );
+    }
+
+    /* Don't throw this one away */
+    evict_to_budget( );
+    e->refs--;
+
+    pthread_mutex_unlock( &s_lock );
+
+
+    if( meta ) meta_write( job->hash, meta );
+}
+
+/* This is the entry point for the disk cache writer thread. */
+static void *writer_main( void *arg )
+{
+    write_job_t *job;
+
+
+    NOT_USED(arg);
+
+    pthread_mutex_lock( &s_queue_lock );
+
+    for( ;; )
+    {
+        while( TAILQ_EMPTY( &s_queue ) && !s_writer_quit )
+        {
+            pthread_cond_wait( &s_queue_cond, &s_queue_lock );
+        }
+        if( TAILQ_EMPTY( &s_queue ) ) break;
+
+        job = TAILQ_FIRST( &s_queue );
+        TAILQ_REMOVE( &s_queue, job, queue );
+        s_queue_len--;
+
+        pthread_mutex_unlock( &s_queue_lock );
+
+        job_do( job );
+
+        free_const( job->hash );
+        free( job->data );
+        free( job );
+
+        pthread_mutex_lock( &s_queue_lock );
+    }
+
+    pthread_mutex_unlock( &s_queue_lock );
+
+
+    return NULL;
+}
+
+void disk_cache_get_stats(
+    unsigned long *hits,
+    unsigned long *misses,
+    unsigned long *evictions,
+    off_t *bytes
+)
+{
+    pthread_mutex_lock( &s_lock );
+
+    *hits      = s_hits;
+    *misses    = s_misses;
+    *evictions = s_evictions;
+    *bytes     = s_bytes;
+
+    pthread_mutex_unlock( &s_lock );
+}
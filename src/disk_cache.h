@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Disk cache API.
+ * An optional on-disk cache of file blocks (the same blocks as the in-memory
+ * block cache), keyed on the file's hash. It survives remounts, so content
+ * that's read over and over isn't fetched from peers every time. Files that
+ * haven't been read for longest are thrown away to keep under the size budget.
+ * Thread-safe.
+ */
+
+#ifndef _INCLUDED_DISK_CACHE_H
+#define _INCLUDED_DISK_CACHE_H
+
+#include "common.h"
+
+#include <sys/types.h>
+
+#include "trace.h"
+
+
+TRACE_DECLARE(disk_cache)
+#define disk_cache_trace(...) TRACE(disk_cache,__VA_ARGS__)
+#define disk_cache_trace_indent() TRACE_INDENT(disk_cache)
+#define disk_cache_trace_dedent() TRACE_DEDENT(disk_cache)
+
+
+extern int disk_cache_init( void );
+/* Waits for queued writes to finish */
+extern void disk_cache_finalise( void );
+
+/* Zero if no cache directory has been configured */
+extern int disk_cache_is_enabled( void );
+
+/* Returns 1 and the block (BLOCK_CACHE_BLOCK_SIZE bytes, less for the file's
+ * last block) if it's cached. <buf> must be big enough for a whole block. */
+extern int disk_cache_tryget_block( const char *hash, off_t index, char *buf, size_t *len );
+/* Queues the block to be written. Doesn't take ownership of <data>. If too many
+ * writes are already queued, it's dropped. */
+extern void disk_cache_insert_block( const char *hash, off_t index, const char *data, size_t len );
+
+extern void disk_cache_get_stats(
+    unsigned long *hits,
+    unsigned long *misses,
+    unsigned long *evictions,
+    off_t *bytes
+);
+
+#endif /* _INCLUDED_DISK_CACHE_H */
@@ -1,7 +1,7 @@
 /*
  * Copyright (C) 2008-2012 Matthew Turner. Distributed under the GPL v3.
  *
- * Download Thread "Class" - a thread for downloading a file.
+ * Downloader class - downloads a file for an open file handle.
  */
 
 #ifndef _INCLUDED_DOWNLOADER_H
@@ -25,11 +25,16 @@ typedef void (*chunk_done_cb_t)(void *ctxt, int rc, size_t size);
 
 
 extern downloader_t *downloader_new (direntry_t *de);
-extern void downloader_chunk_add (downloader_t *thread,
-                                       off_t start,
-                                       off_t end,
-                                       char *buf,
-                                       chunk_done_cb_t cb,
-                                       void *ctxt          );
+/* Any chunks still outstanding are failed */
+extern void downloader_delete (downloader_t *dl);
+/* <cb> is called when the chunk's been filled, on a scheduler worker thread */
+extern void downloader_chunk_add (downloader_t *dl,
+                                  off_t start,
+                                  off_t end,
+                                  char *buf,
+                                  chunk_done_cb_t cb,
+                                  void *ctxt          );
+/* For reads served without it, so it can tell they were sequential */
+extern void downloader_note_read (downloader_t *dl, off_t start, off_t end);
 
 #endif /* _INCLUDED_DOWNLOADER_H */
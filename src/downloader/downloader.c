@@ -9,9 +9,7 @@
  *
  * Downloader class.
  * Downloaders download files.
- * A downloader currently has a thread for doing the downloading (though it's
- * proposed that the thread comes from fetcher in future).
- * These is one thread per open()ed file handle. The idea is that if you've
+ * There is one downloader per open()ed file handle. The idea is that if you've
  * open()ed the file twice you're probably going to read() from different points
  * so all the streaming optimisations go out of the window. It also makes the
  * usage pattern more transparent to the indexndoe, for whatever that's worth.
@@ -19,10 +17,41 @@
  * it or fork(), so we could still get parallel requests to the downloader hence
  * it still needs to be threadsafe.
  *
- * TODO: I should be an actor!
- * TODO: Currently the thread finishes at some random point (maybe when the
- * file's been read to the end?). It should live for the open duration of the
- * file; release should call downloader_delete()
+ * A downloader doesn't have a thread of its own. It streams the file with an
+ * async fetch, which runs on a fetcher thread. When that runs out of chunks to
+ * fill it pauses the transfer (keeping the connection), and adding a chunk
+ * resumes it.
+ * The waiting chunks are kept in an interval tree, and each part of the stream
+ * is copied into every chunk that wants it, so overlapping and repeated reads
+ * (several readers of the same region, say) share the one transfer. The stream
+ * carries on through small gaps between chunks rather than reconnecting. Only
+ * when nothing's waiting at or just ahead of the stream, but some chunks are
+ * waiting further on or behind it, do we abort the transfer and start a new one
+ * from the first of them.
+ * Everything else - starting, resuming and stopping transfers, and answering
+ * the read()s - is done by a scheduler task, so the callbacks just update our
+ * state and wake it. A transfer needs a slot from the scheduler before it can
+ * start, and a paused one gives its slot up if someone else is waiting.
+ *
+ * If a transfer fails, or stalls (gets too little data for too long), we carry
+ * on from the same place with the next alternative, after a pause that doubles
+ * each time. Only once that's happened too many times in a row do the read()s
+ * get an error.
+ *
+ * While the reads are sequential the stream carries on past the last chunk,
+ * into a read-ahead ring buffer, and later chunks are served from that. The
+ * read-ahead window starts small and doubles with each sequential read, up to a
+ * limit. A seek drops it back to nothing.
+ *
+ * Whole blocks that pass through the stream are also put in the block cache,
+ * for whoever reads them next.
+ *
+ * A big enough file with more than one alternative is swarmed instead: pieces
+ * of it come from several peers at once (see swarm.c), and the task fills the
+ * chunks from those, in order, as they arrive. If the swarm gives up we go back
+ * to streaming from one peer.
+ *
+ * It lives for as long as the file's open; release() deletes it.
  */
 
 #include "common.h"
@@ -33,24 +62,35 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "downloader.h"
 
-#include "binary_heap.h"
-#include "config_manager.h"
-#include "config_reader.h"
+#include "block_cache.h"
 #include "direntry.h"
 #include "fetcher.h"
-#include "locks.h"
+#include "config_manager.h"
+#include "config_reader.h"
+#include "interval_tree.h"
+#include "listing.h"
+#include "listing_list.h"
 #include "queue.h"
+#include "ring_buffer.h"
+#include "scheduler.h"
 #include "string_buffer.h"
+#include "string_pool.h"
+#include "swarm.h"
+#include "utils.h"
 
 
 TRACE_DEFINE(downloader)
 
 
-typedef struct
+/* The stream skips over this much that nobody wants, to get to the next chunk,
+ * rather than reconnecting */
+#define GAP_MAX (256 * 1024)
+
+
+typedef struct _chunk_t
 {
     off_t start; /* inclusive */
     off_t end;   /* exclusive */
@@ -58,32 +98,62 @@ typedef struct
     char *buf;
     chunk_done_cb_t cb;
     void *ctxt;
+
+    interval_node_t *node; /* in the chunks tree, while it's waiting */
+    int rc; /* once it's done */
+    TAILQ_ENTRY(_chunk_t) done_list;
 } chunk_t;
 
-typedef struct
-{
-    off_t start; /* inclusive */
-    off_t end;   /* exclusive */
-    char *buf;
-} buf_t;
+typedef TAILQ_HEAD(_chunk_list_t,_chunk_t) chunk_list_t;
 
 struct _downloader_t
 {
     direntry_t *de; /* TODO: should this be a listing_t */
-    binary_heap_t *chunks;
-    pthread_cond_t chunks_cond;
-    pthread_mutex_t chunks_mutex;
-    off_t download_offset;
-    pthread_t pthread_id;
-    chunk_t *current_chunk; /* needs to be kept separate because it may not be
-                               at the head of the list at any time */
-    int seek;               /* flags indicating why we bailed */
-    int timed_out;
+    scheduler_task_t *task;
+
+    pthread_mutex_t lock; /* protects everything below */
+    interval_tree_t *chunks;  /* waiting for data, by the range they still
+                                 want */
+    chunk_list_t done_chunks; /* finished, waiting for their read()s to be
+                                 answered */
+    listing_list_t *alternatives; /* where we could download from, best first */
+    unsigned alternative_next;    /* the one to try next */
+    listing_t *alternative; /* where we're downloading from */
+    int finding_alternative;
+    swarm_t *swarm;         /* or where we're downloading from, if it's several */
+    int swarm_tried;
+    unsigned failures;      /* transfers that have failed in a row */
+    double retry_at;        /* when we can try again after the last one */
+    fetcher_t *fetcher;     /* the current transfer, if there is one */
+    off_t download_offset;  /* file offset of the next byte the stream gives us */
+    int paused;             /* the body callback paused the transfer... */
+    off_t paused_buf_start; /* ...part way through a buffer that started here */
+    int deleting;
+
+    ring_buffer_t *readahead; /* what the stream's given us past the last
+                                 chunk, if read-ahead is on */
+    off_t readahead_start;    /* file offset of the first byte in it */
+    size_t readahead_window;  /* how far ahead we'll read; 0 when not sequential */
+    size_t readahead_min;
+    size_t readahead_max;
+    off_t next_read_offset;   /* where the next chunk starts if it's sequential */
+
+    off_t swarm_min_size;
+    unsigned swarm_max_peers;
+    unsigned retries_max;
+    unsigned retry_backoff_ms;
+    unsigned long stall_speed;
+    unsigned stall_time;
+
+    const char *hash; /* pooled */
+    char *block;              /* the cache block the stream's filling, if the
+                                 cache is on */
+    off_t block_index;
+    size_t block_len;         /* bytes of it filled so far */
+    int block_filling;        /* 0 until the stream reaches a block boundary */
 };
 
 
-static void thread_delete (downloader_t *t);
-
 static chunk_t *chunk_new (
     off_t start,
     off_t end,
@@ -91,94 +161,178 @@ static chunk_t *chunk_new (
     chunk_done_cb_t rc,
     void *ctxt
 );
-static chunk_t *chunk_get_next (downloader_t *thread);
-
-static void *downloaderead_main (void *arg);
-static void chunks_empty (downloader_t *thread, int rc);
+static void chunk_delete (chunk_t *chunk);
+static void chunk_queue (downloader_t *dl, chunk_t *chunk);
+static void chunk_unqueue (downloader_t *dl, chunk_t *chunk);
+
+static void downloader_run (void *ctxt);
+static void transfer_start (downloader_t *dl);
+static void alternatives_found (void *ctxt, int rc, listing_list_t *lis);
+static void transfer_failed (downloader_t *dl, int rc);
+static void chunks_serve (downloader_t *dl);
+static void transfer_done (void *ctxt, int rc);
 static int buf_consumer (void *ctxt, void *data, size_t len);
+static void chunk_done (downloader_t *dl, chunk_t *chunk, int rc);
+static int chunks_feed (downloader_t *dl, const char *data, size_t len, size_t *used);
+static chunk_t *chunk_get_ahead (downloader_t *dl);
+static int readahead_follows_on (downloader_t *dl, off_t start);
+static void readahead_update (downloader_t *dl, chunk_t *chunk);
+static size_t readahead_get_room (downloader_t *dl);
+static off_t readahead_get_end (downloader_t *dl);
+static size_t readahead_fill (downloader_t *dl, const char *data, size_t len);
+static void readahead_reset (downloader_t *dl);
+static void block_fill (downloader_t *dl, const char *data, size_t len);
+static void chunks_fail (downloader_t *dl, int rc);
 static void signal_read_thread (chunk_t *chunk, int rc, size_t size);
 
 
-/* Create a new thread to download <hash> (and start the download process). */
 downloader_t *downloader_new (direntry_t *de)
 {
-    downloader_t *t = (downloader_t *)calloc(1, sizeof(downloader_t));
-    pthread_attr_t attr;
-
-
-    /* thread attributes */
-    pthread_attr_init(&attr);
-    /* setting the thread's detached state means that as soon as it exits it's
-     * completely cleaned up. Otherwise some resources would hang around until
-     * pthread_join() is used to read its return code - which we don't
-     * (currently) want to do. */
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
+    downloader_t *dl = (downloader_t *)calloc(1, sizeof(downloader_t));
+    config_reader_t *config = config_get_reader();
 
-    /* fill in the thread's details */
-    t->de = direntry_copy(CALLER_INFO de);
-    t->chunks = binary_heap_new();
-    pthread_cond_init(&(t->chunks_cond), NULL);
-    pthread_mutex_init(&(t->chunks_mutex), NULL);
 
+    dl->readahead_max = config_downloader_readahead_max(config);
+    dl->readahead_min = MIN((size_t)config_downloader_readahead_min(config), dl->readahead_max);
+    if (dl->readahead_min) dl->readahead = ring_buffer_new(dl->readahead_max);
+    dl->swarm_min_size = config_downloader_swarm_min_size(config);
+    dl->swarm_max_peers = MAX(config_downloader_swarm_max_peers(config), 0);
+    dl->retries_max = MAX(config_downloader_retries(config), 0);
+    dl->retry_backoff_ms = MAX(config_downloader_retry_backoff_ms(config), 0);
+    dl->stall_speed = MAX(config_downloader_stall_speed(config), 0);
+    dl->stall_time = MAX(config_downloader_stall_time(config), 0);
+    config_reader_delete(config);
 
-    /* make the thread */
-    /* is this safe? presumably the new thread could read pthread_id before
-     * it's been written by this thread. Do we, in fact, care what it's id is
-     * at all? */
-    assert(!pthread_create(&(t->pthread_id), &attr, &downloaderead_main, (void *)t));
+    dl->de = direntry_copy(CALLER_INFO de);
+    dl->hash = direntry_get_hash(de);
+    if (block_cache_is_enabled()) dl->block = malloc(BLOCK_CACHE_BLOCK_SIZE);
+    dl->chunks = interval_tree_new();
+    TAILQ_INIT(&dl->done_chunks);
+    pthread_mutex_init(&dl->lock, NULL);
+    dl->task = scheduler_task_new(&downloader_run, dl);
 
-    pthread_attr_destroy(&attr);
 
+    return dl;
+}
 
-    return t;
+/* Only called from the task, once nothing's in flight and we're deleting, and
+ * any chunks have been answered */
+static void downloader_free (downloader_t *dl)
+{
+    assert(!dl->fetcher);
+    assert(!dl->swarm);
+    assert(!dl->finding_alternative);
+    assert(!interval_tree_get_count(dl->chunks));
+    assert(TAILQ_EMPTY(&dl->done_chunks));
+
+    scheduler_task_delete(dl->task);
+
+    if (dl->alternative) listing_delete(CALLER_INFO dl->alternative);
+    if (dl->alternatives) listing_list_delete(CALLER_INFO dl->alternatives);
+    if (dl->readahead) ring_buffer_delete(dl->readahead);
+    free(dl->block);
+    string_pool_release(dl->hash);
+    direntry_delete(CALLER_INFO dl->de);
+    pthread_mutex_destroy(&dl->lock);
+    interval_tree_delete(dl->chunks);
+
+    free(dl);
 }
 
-static void thread_delete (downloader_t *t)
+/* The downloader goes away once whatever it has in flight has finished */
+void downloader_delete (downloader_t *dl)
 {
-    assert(!t->current_chunk);
+    pthread_mutex_lock(&dl->lock);
 
-    direntry_delete(CALLER_INFO t->de);
-    pthread_cond_destroy(&t->chunks_cond);
-    pthread_mutex_destroy(&t->chunks_mutex);
-    binary_heap_delete(t->chunks);
+    dl->deleting = 1;
+    scheduler_task_wake(dl->task);
 
-    free(t);
+    pthread_mutex_unlock(&dl->lock);
 }
 
-/* Add a chunk to the chunk list for an individual thread.
+/* Add a chunk to the chunk list for an individual downloader.
  * These go in in order - start of file to end of file */
 /* Note that start and end can be the same value indicating a 0 byte range */
-void downloader_chunk_add (downloader_t *thread,
-                                off_t start, /* inclusive */
-                                off_t end,   /* exclusive */
-                                char *buf,
-                                chunk_done_cb_t cb,
-                                void *ctxt          )
+void downloader_chunk_add (downloader_t *dl,
+                           off_t start, /* inclusive */
+                           off_t end,   /* exclusive */
+                           char *buf,
+                           chunk_done_cb_t cb,
+                           void *ctxt          )
 {
     chunk_t *c;
 
 
     assert(start <= end);
-    assert(start <= direntry_get_size(thread->de));
-    assert(end   <= direntry_get_size(thread->de));
+    assert(start <= direntry_get_size(dl->de));
+    assert(end   <= direntry_get_size(dl->de));
 
     c = chunk_new(start, end, buf, cb, ctxt);
 
 
-    pthread_mutex_lock(&(thread->chunks_mutex));
+    pthread_mutex_lock(&dl->lock);
 
-    /* Add chunk to the priq, keyed on its start so that they come out in that
-     * order. Overlapping or even co-incident chunks are a bit of an odd
-     * request, but should just cause a seek and work OK. */
-    /* Chunks cannot be aggregated because they all get passed off to separate
-     * buffers, but having them in order optimises the sequential read case. */
-    binary_heap_add(thread->chunks, c->start, c);
+    /* Some or all of it might have been read ahead */
+    readahead_update(dl, c);
 
-    /* Signal that there is a new chunk, should anything be waiting. */
-    pthread_cond_signal(&thread->chunks_cond);
+    if (c->start == c->end && c->bytes_used)
+    {
+        downloader_trace("chunk served from read-ahead\n");
+        chunk_done(dl, c, 0);
+    }
+    else
+    {
+        /* Chunks cannot be aggregated because they all get passed off to
+         * separate buffers, but overlapping or even co-incident ones are all
+         * filled from the same stream. */
+        chunk_queue(dl, c);
+    }
+
+    /* The task gets the stream going again, if it's stopped */
+    scheduler_task_wake(dl->task);
 
-    pthread_mutex_unlock(&(thread->chunks_mutex));
+    pthread_mutex_unlock(&dl->lock);
+}
+
+/* Tells the downloader that [start, end) has been read without it (from the
+ * cache), so that it's not taken for a seek when the reads that follow on from
+ * it come here */
+void downloader_note_read (downloader_t *dl,
+                           off_t start, /* inclusive */
+                           off_t end    /* exclusive */)
+{
+    size_t len;
+
+
+    pthread_mutex_lock(&dl->lock);
+
+    if (dl->readahead)
+    {
+        len = ring_buffer_get_len(dl->readahead);
+
+        /* Following on keeps the window, but it doesn't grow it: nothing was
+         * read ahead for this */
+        if (!readahead_follows_on(dl, start))
+        {
+            downloader_trace("seek (from the cache) - resetting read-ahead\n");
+            readahead_reset(dl);
+        }
+        else if (end >= dl->readahead_start + (off_t)len)
+        {
+            ring_buffer_clear(dl->readahead);
+        }
+        else if (end > dl->readahead_start)
+        {
+            ring_buffer_drop(dl->readahead, end - dl->readahead_start);
+            dl->readahead_start = end;
+        }
+        dl->next_read_offset = end;
+
+        /* There might be room to read further ahead now */
+        scheduler_task_wake(dl->task);
+    }
+
+    pthread_mutex_unlock(&dl->lock);
 }
 
 static chunk_t *chunk_new (
@@ -210,351 +364,692 @@ static void chunk_delete (chunk_t *chunk)
     free(chunk);
 }
 
-static chunk_t *chunk_get_next (downloader_t *thread)
+/* Call with the lock held */
+static void chunk_queue (downloader_t *dl, chunk_t *chunk)
+{
+    chunk->node = interval_tree_add(dl->chunks, chunk->start, chunk->end, chunk);
+}
+
+/* Call with the lock held */
+static void chunk_unqueue (downloader_t *dl, chunk_t *chunk)
+{
+    interval_tree_remove(dl->chunks, chunk->node);
+    chunk->node = NULL;
+}
+
+/* Takes the waiting chunk that starts first.
+ * Call with the lock held */
+static chunk_t *chunk_get_next (downloader_t *dl)
 {
+    interval_node_t *node = interval_tree_first(dl->chunks);
     chunk_t *chunk;
-    int start;
-    int rc = 0;
-    struct timeval tv;
-    struct timespec ts;
-    config_reader_t *config = config_get_reader();
 
 
-    /* wait for a chunk on the list */
-    downloader_trace("chunk_get_next() waiting %u seconds for new chunk...\n",
-              config_timeout_chunk(config));
-    downloader_trace_indent();
+    if (!node) return NULL;
+
+    chunk = interval_node_get_value(node);
+    chunk_unqueue(dl, chunk);
 
 
-    gettimeofday(&tv, NULL);
-    ts.tv_sec = tv.tv_sec + config_timeout_chunk(config);
-    ts.tv_nsec = (tv.tv_usec + 1) * 1000;
+    return chunk;
+}
+
+/* The first waiting chunk that starts after where the stream's got to.
+ * Call with the lock held */
+static chunk_t *chunk_get_ahead (downloader_t *dl)
+{
+    interval_node_t *node;
 
-    pthread_mutex_lock(&thread->chunks_mutex);
-    while (!binary_heap_trypop( thread->chunks, &start, (void **)&chunk ) && rc == 0)
+
+    for (node = interval_tree_first_overlap(dl->chunks, dl->download_offset, INT64_MAX);
+         node;
+         node = interval_tree_next_overlap(node, dl->download_offset, INT64_MAX))
     {
-        rc = pthread_cond_timedwait(&thread->chunks_cond,
-                                    &thread->chunks_mutex,
-                                    &ts);
+        if (interval_node_get_start(node) > dl->download_offset)
+        {
+            return interval_node_get_value(node);
+        }
     }
-    pthread_mutex_unlock(&thread->chunks_mutex);
 
-    if (rc == ETIMEDOUT)
+
+    return NULL;
+}
+
+/* EXECUTES IN THREAD: scheduler worker */
+static void downloader_run (void *ctxt)
+{
+    downloader_t *dl = (downloader_t *)ctxt;
+    chunk_list_t done = TAILQ_HEAD_INITIALIZER(done);
+    chunk_t *c;
+    int free_now = 0;
+
+
+    pthread_mutex_lock(&dl->lock);
+
+    if (dl->deleting)
     {
-        /* timed out, abort */
-        chunk = NULL;
-        downloader_trace("timed out\n");
+        if (dl->swarm)
+        {
+            swarm_delete(dl->swarm);
+            dl->swarm = NULL;
+        }
+
+        if (dl->fetcher)
+        {
+            fetcher_cancel(dl->fetcher);
+        }
+        else if (!dl->finding_alternative)
+        {
+            chunks_fail(dl, EIO);
+            free_now = 1;
+        }
+    }
+    else if (dl->paused)
+    {
+        if (interval_tree_get_count(dl->chunks) || readahead_get_room(dl))
+        {
+            scheduler_transfer_set_idle(dl->task, 0);
+            fetcher_resume(dl->fetcher);
+        }
+        else
+        {
+            /* Keep the connection, unless someone else wants the slot */
+            scheduler_transfer_set_idle(dl->task, 1);
+            if (scheduler_transfer_should_yield(dl->task))
+            {
+                downloader_trace("yielding transfer slot\n");
+                fetcher_cancel(dl->fetcher);
+            }
+        }
     }
-    else if (rc == 0)
+    else if (dl->swarm)
     {
-        downloader_trace("Downloader thread for %s woken up! ",
-                  direntry_get_name(thread->de));
+        chunks_serve(dl);
     }
     else
     {
-        downloader_trace("pthread_cond_timedwait(): error\n");
-        assert(0);
+        transfer_start(dl);
     }
 
-    config_reader_delete(config);
+    /* Answer the read()s outside the lock */
+    TAILQ_CONCAT(&done, &dl->done_chunks, done_list);
 
-    downloader_trace_dedent();
+    pthread_mutex_unlock(&dl->lock);
 
 
-    return chunk;
+    while ((c = TAILQ_FIRST(&done)))
+    {
+        TAILQ_REMOVE(&done, c, done_list);
+        signal_read_thread(c, c->rc, c->bytes_used);
+        chunk_delete(c);
+    }
+
+    if (free_now) downloader_free(dl);
 }
 
-/* This is the entry point for new downloader threads. */
-/* EXECUTES IN THREAD: downloaderead_main().
- * Accesses a thread - ?no mutex needed */
-static void *downloaderead_main (void *arg)
+/* Starts a transfer from the start of the first waiting chunk, or from the
+ * end of the read-ahead if there's room in it, unless there's already one going
+ * or nothing to do.
+ * Call with the lock held */
+static void transfer_start (downloader_t *dl)
 {
-    downloader_t *thread = (downloader_t *)arg;
     string_buffer_t *range_buffer;
-    listing_t *li;
     char *range_str;
-    int rc;
-    int first_time = 1;
-
-
-    downloader_trace("downloaderead_main(file==%s): New downloader thread!\n",
-              direntry_get_name(thread->de) );
-    downloader_trace_indent();
-
-    /* We never try to guess when we're done with a file completely and call
-     * fall straight out of this loop (e.g. when we think we've served the whole
-     * file up - we can't tell unless we keep expensive track of it, and what
-     * does it matter anyway?)
-     * If we've seeked then we must have popped a chunk into current_chunk. The
-     * state of the chunk list is irrelevant.
-     * If we've not seeked, then we've either just entered this function (just
-     * started the file from some position) or we came out of the fetcher
-     * cleanly because we consumed the last buffer of the file. In either case,
-     * there might be another chunk on the list already or there might be one
-     * soon (because we want to start fetching the file from some point, or
-     * because we want to go back and fetch a chunk we seeked around), thus we
-     * have to wait.
-     * This behaviour is fine because we will have signalled all the read()
-     * threads for all the chunks we've filled, so if we did cover the whole
-     * file FUSE will return the user's read() call, and we just tidy up after
-     * a bit of a wait, just like they'd stopped requesting a file half way
-     * through.
-     * TODO: Maybe need to think about separating the two timeouts - how long we
-     * wait for the system to get us another read() chunk when we've returned
-     * the last one, and how long we give the user to request something else
-     * from the file before we decide they're done with it. The first can
-     * probably be quite short, while the latter might need to be quite long to
-     * account for very low bit rate streaming. For now I don't see any reason
-     * why they can't both be very long (save resource usage) because neither
-     * should hold anything important up.
-     */
-    do
-    {
-        /* DEBUGGING ======================================================== */
-        /* this flag is a nicety, to try to make sure things are sane */
-        if (thread->seek)
-        {
-            /* If we've seeked there must be a chunk in hand */
-            assert(thread->current_chunk);
-            thread->seek = 0;
-        }
-        if (first_time)
-        {
-            assert(!thread->current_chunk);
-            first_time = 0;
-        }
-        /* ================================================================== */
+    const char *client;
+    interval_node_t *first;
+    off_t offset;
 
-        /* We won't have a chunk if we've just come in here. At all other times
-         * we should */
-        if (!thread->current_chunk)
-        {
-            thread->current_chunk = chunk_get_next(thread);
 
-            if (!thread->current_chunk)
-            {
-                /* timed out */
-                break;
-            }
-        }
+    if (dl->fetcher || dl->finding_alternative || dl->deleting) return;
 
-        range_buffer = string_buffer_new();
-        if (thread->current_chunk->start)
-        {
-            string_buffer_printf(range_buffer, "%" PRIu64 "-", thread->current_chunk->start);
-        }
-        range_str = string_buffer_commit(range_buffer);
-        thread->download_offset = thread->current_chunk->start;
-        downloader_trace("fetching range \"%s\"\n", range_str);
+    if ((first = interval_tree_first(dl->chunks)))
+    {
+        offset = interval_node_get_start(first);
+    }
+    else if (readahead_get_room(dl) &&
+             readahead_get_end(dl) < direntry_get_size(dl->de))
+    {
+        offset = readahead_get_end(dl);
+    }
+    else
+    {
+        return;
+    }
+
+    /* Backing off after a failure; we'll be woken */
+    if (dl->failures && fsfuse_get_time() < dl->retry_at) return;
 
-        /* Find alternatives */
-        /* TODO: BASE_CLASS() should be universal */
-        if (listing_tryget_best_alternative((listing_t *)thread->de, &li))
+    if (!dl->alternative)
+    {
+        if (dl->alternatives &&
+            dl->alternative_next < listing_list_get_count(dl->alternatives))
         {
-            fetcher_t *fetcher = fetcher_new(listing_get_href(li));
-
-            /* Get the file */
-            rc = fetcher_fetch_body(
-                fetcher,
-                (fetcher_body_cb_t)&buf_consumer,
-                (void *)thread,
-                (thread->current_chunk->start) ? range_str : NULL
-            );
-
-            listing_delete(CALLER_INFO li);
-            fetcher_delete(fetcher);
+            dl->alternative = listing_list_get_item(dl->alternatives, dl->alternative_next++);
         }
         else
         {
-            rc = EBUSY;
-            /* TODO sort out handling of this whole area */
+            /* Find somewhere to download from first, or look again if we've
+             * tried everywhere; we'll be back */
+            if (dl->alternatives) listing_list_delete(CALLER_INFO dl->alternatives);
+            dl->alternatives = NULL;
+
+            dl->finding_alternative = 1;
+            listing_get_alternatives_async((listing_t *)dl->de,
+                                           MAX(dl->swarm_max_peers, dl->retries_max + 1),
+                                           &alternatives_found, dl);
+            return;
         }
+    }
+    client = listing_get_client(dl->alternative);
+
+    if (!scheduler_transfer_tryget(dl->task, client))
+    {
+        /* We'll be woken when there's a slot */
+        string_pool_release(client);
+        return;
+    }
+    string_pool_release(client);
+
+    range_buffer = string_buffer_new();
+    if (offset)
+    {
+        string_buffer_printf(range_buffer, "%" PRIu64 "-", offset);
+    }
+    range_str = string_buffer_commit(range_buffer);
+    dl->download_offset = offset;
+    dl->paused = 0;
+    downloader_trace("fetching range \"%s\"\n", range_str);
+
+    dl->fetcher = fetcher_new(listing_get_href(dl->alternative));
+    fetcher_set_min_speed(dl->fetcher, dl->stall_speed, dl->stall_time);
+    fetcher_fetch_body_async(
+        dl->fetcher,
+        &buf_consumer,
+        dl,
+        offset ? range_str : NULL,
+        &transfer_done,
+        dl
+    );
+
+    free(range_str);
+}
 
-        free(range_str);
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void alternatives_found (void *ctxt, int rc, listing_list_t *lis)
+{
+    downloader_t *dl = (downloader_t *)ctxt;
 
-    } while (rc == 0);
 
+    pthread_mutex_lock(&dl->lock);
 
-    pthread_mutex_lock(&(thread->chunks_mutex));
+    dl->finding_alternative = 0;
 
-    if (rc == 0)
+    if (rc)
     {
-        int key; void *value;
-        /* OK */
-        /* There should be no more chunks, either in-hand or on the list */
-        assert(!thread->current_chunk);
-        assert(!binary_heap_trypop(thread->chunks, &key, &value));
+        transfer_failed(dl, rc);
     }
     else
     {
-        /* TODO: what is this branch for? I think it's for an abnormal exit, in
-         * which case shouldn't we be signaling read thread the whole time
-         * (because we need it to pass the err to user-space)? Shouldn't we use
-         * NULL in place of current_chunk? It's a shame we have to empty the
-         * chunk list too.
-         */
-        if (thread->current_chunk)
+        dl->alternatives = lis;
+        dl->alternative_next = 0;
+
+        /* Big files come from as many of them at once as we can, the first
+         * time around. Otherwise we stream from them one at a time. */
+        if (!dl->swarm_tried &&
+            dl->swarm_max_peers > 1 &&
+            listing_list_get_count(lis) > 1 &&
+            direntry_get_size(dl->de) >= dl->swarm_min_size)
         {
-            signal_read_thread(thread->current_chunk, rc, 0);
-            chunk_delete(thread->current_chunk);
-            thread->current_chunk = NULL;
-
-            chunks_empty(thread, rc);
+            dl->swarm_tried = 1;
+            dl->swarm = swarm_new(dl->hash, direntry_get_size(dl->de), lis,
+                                  dl->swarm_max_peers, dl->task);
         }
     }
 
-    pthread_mutex_unlock(&(thread->chunks_mutex));
+    scheduler_task_wake(dl->task);
 
+    pthread_mutex_unlock(&dl->lock);
+}
 
-    /* Delete the data structures */
-    thread_delete(thread); /* Is this safe here? */
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void transfer_done (void *ctxt, int rc)
+{
+    downloader_t *dl = (downloader_t *)ctxt;
 
-    downloader_trace("downloader_main() returning\n");
-    downloader_trace_dedent();
 
+    pthread_mutex_lock(&dl->lock);
+
+    downloader_trace("transfer done: %d\n", rc);
+
+    fetcher_delete(dl->fetcher);
+    dl->fetcher = NULL;
+    dl->paused = 0;
+    scheduler_transfer_release(dl->task);
+
+    /* If rc is 0 then either we aborted it to seek, or the stream reached the
+     * end of the file, and if it's ECANCELED then we gave up our slot or are
+     * being deleted. Either way the task carries on from wherever the next
+     * chunk is, if there is one. A peer that hangs up part way through is an
+     * error (EIO) like any other. */
+    if (rc != 0 && rc != ECANCELED)
+    {
+        /* Might be the peer that's the problem; the next one gets a go */
+        listing_delete(CALLER_INFO dl->alternative);
+        dl->alternative = NULL;
 
-    pthread_exit(NULL);
+        transfer_failed(dl, rc);
+    }
+
+    scheduler_task_wake(dl->task);
+
+    pthread_mutex_unlock(&dl->lock);
 }
 
-static void chunks_empty (downloader_t *thread, int rc)
+/* Arranges to try again after a pause, if anyone's waiting and we haven't
+ * already tried too many times, and otherwise fails the chunks.
+ * Call with the lock held */
+static void transfer_failed (downloader_t *dl, int rc)
 {
-    chunk_t *c;
-    int start;
+    unsigned backoff_ms;
 
 
-    while (binary_heap_trypop( thread->chunks, &start, (void **)&c ))
+    if (!interval_tree_get_count(dl->chunks))
     {
-        signal_read_thread(c, rc, 0);
-        chunk_delete(c);
+        /* Don't keep trying to read ahead when nobody's asked for anything */
+        downloader_trace("transfer failed (%d) with nothing waiting\n", rc);
+        dl->failures = 0;
+        readahead_reset(dl);
+    }
+    else if (dl->failures < dl->retries_max)
+    {
+        backoff_ms = dl->retry_backoff_ms << MIN(dl->failures, 8);
+        dl->failures++;
+        downloader_trace("transfer failed (%d); retry %u in %ums\n", rc, dl->failures, backoff_ms);
+
+        dl->retry_at = fsfuse_get_time() + backoff_ms / 1000.0;
+        scheduler_task_wake_after(dl->task, backoff_ms);
+    }
+    else
+    {
+        downloader_trace("transfer failed (%d); giving up\n", rc);
+        dl->failures = 0;
+        chunks_fail(dl, rc);
+        readahead_reset(dl);
     }
 }
 
+/* Hands the chunk to the task to answer its read().
+ * Call with the lock held */
+static void chunk_done (downloader_t *dl, chunk_t *chunk, int rc)
+{
+    chunk->rc = rc;
+    TAILQ_INSERT_TAIL(&dl->done_chunks, chunk, done_list);
 
-/* EXECUTES IN THREAD: downloaderead_main(). */
-static int buf_consumer (void *ctxt, void *data, size_t len)
+    scheduler_task_wake(dl->task);
+}
+
+/* Fail every waiting chunk.
+ * Call with the lock held */
+static void chunks_fail (downloader_t *dl, int rc)
 {
-    buf_t *buf = (buf_t *)malloc(sizeof(buf_t));
-    downloader_t *thread = (downloader_t *)ctxt;
-    chunk_t *chunk;
-    int rc = 1;
-    size_t copy_len;
+    chunk_t *c;
 
 
-    if (!thread->current_chunk) thread->current_chunk = chunk_get_next(thread);
-    if (!thread->current_chunk)
+    while ((c = chunk_get_next(dl)))
     {
-        thread->timed_out = 1;
-        goto bail;
+        chunk_done(dl, c, rc);
     }
-    chunk = thread->current_chunk;
+}
 
-    buf->start = thread->download_offset;
-    buf->end   = thread->download_offset + len;
-    buf->buf   = data;
+/* Fills what it can of each chunk from the swarm, asks it for the rest and for
+ * the read-ahead, and lets it forget about anything else. If the swarm's given
+ * up, we go back to streaming.
+ * Call with the lock held */
+static void chunks_serve (downloader_t *dl)
+{
+    chunk_list_t pending = TAILQ_HEAD_INITIALIZER(pending);
+    chunk_t *c;
+    off_t readahead_end, low, high;
+    size_t len;
 
 
-    while (1)
+    while ((c = chunk_get_next(dl)))
     {
-        downloader_trace("buf: %#x-%#x; chunk: %#x-%#x\n", buf->start, buf->end, chunk->start, chunk->end);
+        TAILQ_INSERT_TAIL(&pending, c, done_list);
+    }
+
+    readahead_end = MIN(direntry_get_size(dl->de),
+                        dl->next_read_offset + (off_t)dl->readahead_window);
+    low  = dl->next_read_offset;
+    high = readahead_end;
 
-        if (chunk->start == buf->start)
+    while ((c = TAILQ_FIRST(&pending)))
+    {
+        TAILQ_REMOVE(&pending, c, done_list);
+
+        len = swarm_read(dl->swarm, c->start, c->buf, c->end - c->start);
+        c->bytes_used += len;
+        c->buf        += len;
+        c->start      += len;
+
+        if (c->start == c->end)
         {
-            downloader_trace("chunk ok - continuing stream\n");
+            chunk_done(dl, c, 0);
+        }
+        else
+        {
+            swarm_want(dl->swarm, c->start, c->end);
+            low  = MIN(low,  c->start);
+            high = MAX(high, c->end);
+            chunk_queue(dl, c);
+        }
+    }
 
-            /* How much to copy? */
-            copy_len = MIN((buf->end - buf->start), (chunk->end - chunk->start));
-            downloader_trace("copy_len == %#x\n", copy_len);
+    swarm_want(dl->swarm, dl->next_read_offset, readahead_end);
+    swarm_forget_outside(dl->swarm, low, high);
 
-            /* DO IT */
-            downloader_trace("doing it: absolute start == %#x, absolute end == %#x\n",
-                      buf->start, buf->start + copy_len);
-            memcpy(chunk->buf, buf->buf, copy_len);
+    if (swarm_has_failed(dl->swarm))
+    {
+        downloader_trace("swarm failed - falling back to streaming\n");
 
-            chunk->bytes_used += copy_len;
+        swarm_delete(dl->swarm);
+        dl->swarm = NULL;
+        transfer_start(dl);
+    }
+}
 
-            buf->start += copy_len;
-            buf->buf   += copy_len;
-            downloader_trace("buf->start now == %#x\n", buf->start);
-            chunk->start += copy_len;
-            chunk->buf   += copy_len;
-            downloader_trace("chunk->start now == %#x\n", buf->start);
+/* Copies the stream's bytes at download_offset into every chunk that's waiting
+ * for them - there can be several, when reads overlap - and says how many it
+ * used: no more than the shortest of those chunks wants, and no further than
+ * where the next chunk along starts, so that it gets its share too. Returns 0
+ * if nothing's waiting for these bytes.
+ * Call with the lock held */
+static int chunks_feed (downloader_t *dl, const char *data, size_t len, size_t *used)
+{
+    chunk_list_t fed = TAILQ_HEAD_INITIALIZER(fed);
+    interval_node_t *node;
+    chunk_t *c;
+    off_t off = dl->download_offset;
+    size_t step = len;
 
 
-            if (buf->start == buf->end && chunk->start == chunk->end)
-            {
-                downloader_trace("End of buf && chunk\n");
+    for (node = interval_tree_first_overlap(dl->chunks, off, off + len);
+         node;
+         node = interval_tree_next_overlap(node, off, off + len))
+    {
+        c = interval_node_get_value(node);
 
-                /* End of chunk stuff
-                 * (but don't get a new one because end of buf might mean end
-                 * of file) */
-                signal_read_thread(chunk, 0, chunk->bytes_used);
+        /* It wanted some of what's already gone past */
+        if (c->start < off) continue;
 
-                /* free the chunk */
-                chunk_delete(chunk);
+        if (c->start > off)
+        {
+            step = MIN(step, (size_t)(c->start - off));
+            break;
+        }
 
-                /* indicate current chunk is no longer valid, but don't replace
-                 * it, as we don't know where the next chunk is going to start
-                 * */
-                thread->current_chunk = NULL;
+        step = MIN(step, (size_t)(c->end - c->start));
+        TAILQ_INSERT_TAIL(&fed, c, done_list);
+    }
 
+    if (TAILQ_EMPTY(&fed)) return 0;
 
-                /* end of buf stuff */
-                break;
-            }
+    while ((c = TAILQ_FIRST(&fed)))
+    {
+        TAILQ_REMOVE(&fed, c, done_list);
+        chunk_unqueue(dl, c);
 
-            if (buf->start == buf->end)
-            {
-                downloader_trace("End of buf\n");
-                break;
-            }
+        memcpy(c->buf, data, step);
+        c->bytes_used += step;
+        c->buf        += step;
+        c->start      += step;
 
-            if (chunk->start == chunk->end)
-            {
-                downloader_trace("End of chunk\n");
-
-                /* we've reached the end of this chunk's buffer. signal its
-                 * semaphore so that its read() thread can wake and return */
-                signal_read_thread(chunk, 0, chunk->bytes_used);
-
-                /* free the chunk */
-                chunk_delete(chunk);
-
-                thread->current_chunk = chunk_get_next(thread);
-                if (!thread->current_chunk)
-                {
-                    thread->timed_out = 1;
-                    goto bail;
-                }
-                chunk = thread->current_chunk;
-                assert(chunk); /* shouldn't happen - chunk_get_next() should block */
-            }
+        if (c->start == c->end)
+        {
+            downloader_trace("End of chunk\n");
+
+            /* we've reached the end of this chunk's buffer, so its read()
+             * can return */
+            chunk_done(dl, c, 0);
         }
         else
         {
-            downloader_trace("chunk not ok - bailing out to seek\n");
-
-            /* haven't consumed the whole buf, so curl will bail out with an
-             * error and we end up back in downloaderead_main() */
-            thread->seek = 1;
-            goto bail;
+            chunk_queue(dl, c);
         }
     }
-    downloader_trace("buf->start caught buf->end - finished buf processing loop\n");
 
-    thread->download_offset = buf->end;
-    downloader_trace("offset now == %#x\n\n", thread->download_offset);
-    rc = 0;
+    *used = step;
+
+
+    return 1;
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static int buf_consumer (void *ctxt, void *data, size_t len)
+{
+    downloader_t *dl = (downloader_t *)ctxt;
+    chunk_t *next;
+    off_t buf_start, buf_end;
+    char *p;
+    size_t avail, copy_len;
+    int rc = 0;
+
+
+    pthread_mutex_lock(&dl->lock);
+
+    /* After a pause, curl gives us the same buffer again, part of which we've
+     * already used */
+    buf_start = dl->paused ? dl->paused_buf_start : dl->download_offset;
+    buf_end   = buf_start + len;
+    dl->paused = 0;
+
+    while (dl->download_offset < buf_end)
+    {
+        p = (char *)data + (dl->download_offset - buf_start);
+        avail = buf_end - dl->download_offset;
 
+        downloader_trace("buf: %#jx-%#jx; %u chunks waiting\n",
+                         dl->download_offset, buf_end, interval_tree_get_count(dl->chunks));
 
-bail:
-    free(buf);
+        if (chunks_feed(dl, p, avail, &copy_len))
+        {
+            dl->failures = 0;
+        }
+        else if ((next = chunk_get_ahead(dl)) &&
+                 next->start - dl->download_offset <= GAP_MAX)
+        {
+            /* Not far to the next one; carry on to it */
+            copy_len = MIN(avail, (size_t)(next->start - dl->download_offset));
+        }
+        else if (interval_tree_get_count(dl->chunks))
+        {
+            downloader_trace("chunks not ok - bailing out to seek\n");
 
-    downloader_trace_dedent();
+            /* Not consuming the buf makes curl bail out with an error, and
+             * transfer_done() starts again from the first waiting chunk */
+            rc = 1;
+            break;
+        }
+        else if (!(copy_len = readahead_fill(dl, p, avail)))
+        {
+            downloader_trace("out of chunks - pausing\n");
+
+            dl->paused = 1;
+            dl->paused_buf_start = buf_start;
+            rc = FETCHER_PAUSE;
+
+            /* So that it can decide whether to keep the slot */
+            scheduler_task_wake(dl->task);
+            break;
+        }
+
+        block_fill(dl, p, copy_len);
+        dl->download_offset += copy_len;
+    }
+
+    pthread_mutex_unlock(&dl->lock);
 
 
     return rc;
 }
 
+/* Whether a read at <start> follows on from the last one, or from somewhere in
+ * what's been read ahead.
+ * Call with the lock held */
+static int readahead_follows_on (downloader_t *dl, off_t start)
+{
+    size_t len = ring_buffer_get_len(dl->readahead);
+
+
+    return start == dl->next_read_offset ||
+           (start >= dl->readahead_start &&
+            start <  dl->readahead_start + (off_t)len);
+}
+
+/* Grows or resets the read-ahead window depending on whether the chunk follows
+ * on from the last one, and fills what we can of the chunk from the read-ahead.
+ * Call with the lock held */
+static void readahead_update (downloader_t *dl, chunk_t *chunk)
+{
+    size_t len;
+    int in_readahead;
+
+
+    if (!dl->readahead) return;
+
+    len = ring_buffer_get_len(dl->readahead);
+    in_readahead = chunk->start >= dl->readahead_start &&
+                   chunk->start <  dl->readahead_start + (off_t)len;
+
+    if (readahead_follows_on(dl, chunk->start))
+    {
+        dl->readahead_window = dl->readahead_window ?
+            MIN(dl->readahead_window * 2, dl->readahead_max) :
+            dl->readahead_min;
+    }
+    else
+    {
+        downloader_trace("seek - resetting read-ahead\n");
+        dl->readahead_window = 0;
+    }
+    dl->next_read_offset = chunk->end;
+
+    if (!in_readahead)
+    {
+        /* Nothing we've got is any use, and whatever follows this chunk
+         * will come from wherever the stream goes for it */
+        ring_buffer_clear(dl->readahead);
+        return;
+    }
+
+    ring_buffer_drop(dl->readahead, chunk->start - dl->readahead_start);
+    len = ring_buffer_read(dl->readahead, chunk->buf, chunk->end - chunk->start);
+    dl->readahead_start = chunk->start + len;
+
+    chunk->bytes_used += len;
+    chunk->buf        += len;
+    chunk->start      += len;
+}
+
+/* How much more the stream can put into the read-ahead */
+static size_t readahead_get_room (downloader_t *dl)
+{
+    size_t len;
+
+
+    if (!dl->readahead) return 0;
+
+    len = ring_buffer_get_len(dl->readahead);
+
+
+    return (dl->readahead_window > len) ? dl->readahead_window - len : 0;
+}
+
+/* File offset the read-ahead carries on from */
+static off_t readahead_get_end (downloader_t *dl)
+{
+    if (!dl->readahead || !ring_buffer_get_len(dl->readahead))
+    {
+        return dl->next_read_offset;
+    }
+
+
+    return dl->readahead_start + ring_buffer_get_len(dl->readahead);
+}
+
+/* Puts stream data that no chunk wants into the read-ahead, if there's room.
+ * Call with the lock held */
+static size_t readahead_fill (downloader_t *dl, const char *data, size_t len)
+{
+    if (!readahead_get_room(dl)) return 0;
+
+    if (!ring_buffer_get_len(dl->readahead) ||
+        readahead_get_end(dl) != dl->download_offset)
+    {
+        ring_buffer_clear(dl->readahead);
+        dl->readahead_start = dl->download_offset;
+    }
+
+
+    return ring_buffer_write(dl->readahead, data, MIN(len, readahead_get_room(dl)));
+}
+
+static void readahead_reset (downloader_t *dl)
+{
+    if (!dl->readahead) return;
+
+    ring_buffer_clear(dl->readahead);
+    dl->readahead_window = 0;
+}
+
+/* Collects the stream's data, which starts at download_offset, into blocks for
+ * the cache. A block's only cached if we saw all of it.
+ * Call with the lock held */
+static void block_fill (downloader_t *dl, const char *data, size_t len)
+{
+    off_t off = dl->download_offset, size = direntry_get_size(dl->de);
+    size_t block_off, copy_len;
+
+
+    if (!dl->block) return;
+
+    while (len)
+    {
+        block_off = off % BLOCK_CACHE_BLOCK_SIZE;
+        copy_len = MIN(len, BLOCK_CACHE_BLOCK_SIZE - block_off);
+
+        if (!block_off)
+        {
+            dl->block_filling = 1;
+            dl->block_index = off / BLOCK_CACHE_BLOCK_SIZE;
+            dl->block_len = 0;
+        }
+
+        if (dl->block_filling &&
+            dl->block_index == off / BLOCK_CACHE_BLOCK_SIZE &&
+            dl->block_len == block_off)
+        {
+            memcpy(dl->block + block_off, data, copy_len);
+            dl->block_len += copy_len;
+
+            if (dl->block_len == BLOCK_CACHE_BLOCK_SIZE || off + (off_t)copy_len == size)
+            {
+                block_cache_insert(dl->hash, dl->block_index, dl->block, dl->block_len);
+                dl->block_filling = 0;
+            }
+        }
+        else
+        {
+            /* The stream's jumped; wait for the next boundary */
+            dl->block_filling = 0;
+        }
+
+        off  += copy_len;
+        data += copy_len;
+        len  -= copy_len;
+    }
+}
+
 static void signal_read_thread (chunk_t *chunk, int rc, size_t size)
 {
     downloader_trace("signalling read() thread - err %d, %zu bytes\n", rc, size);
@@ -569,17 +1064,16 @@ void dump_chunk (chunk_t *chunk)
     trace_np("%#x -> %#x -> %#x", chunk->start, chunk->bytes_used, chunk->end);
 }
 
-void dump_chunks (downloader_t *thread)
+void dump_chunks (downloader_t *dl)
 {
-    chunk_t *chunk;
-    int start;
+    interval_node_t *node;
     unsigned i = 0;
 
 
-    while (binary_heap_trypop(thread->chunks, &start, (void **)&chunk))
+    for (node = interval_tree_first(dl->chunks); node; node = interval_tree_next(node))
     {
         trace_np("  [%u] ", i++);
-        dump_chunk(chunk);
+        dump_chunk(interval_node_get_value(node));
     }
 }
 #endif /* DEBUG */
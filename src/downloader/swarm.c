@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Swarm class.
+ * A swarm downloads one big file from several peers at once. The file is split
+ * into pieces (a whole number of cache blocks each), and there's a "lane" per
+ * peer: a scheduler task which holds a transfer slot for that peer and fetches
+ * one piece at a time from it, always the earliest one that's wanted and that
+ * nobody's fetching yet. Fast peers thus come back for more sooner, so they end
+ * up doing most of the work.
+ * A lane with nothing left to do will also duplicate a piece that another peer
+ * is lagging on - one that's taken more than twice as long as this lane usually
+ * takes for a piece - and whichever finishes first cancels the other.
+ * A lane that fails too often in a row gives up - a stalled transfer counts as
+ * a failure - and once they all have the downloader goes back to streaming.
+ *
+ * Finished pieces are put in the block cache straight away, and kept here for
+ * the downloader until it says they're no longer of interest.
+ */
+
+#include "common.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "swarm.h"
+
+#include "block_cache.h"
+#include "config_manager.h"
+#include "config_reader.h"
+#include "downloader.h"
+#include "fetcher.h"
+#include "listing.h"
+#include "queue.h"
+#include "string_buffer.h"
+#include "string_pool.h"
+#include "utils.h"
+
+
+#define SWARM_PIECE_SIZE (4 * BLOCK_CACHE_BLOCK_SIZE)
+/* A lane gives up after this many failures in a row */
+#define SWARM_LANE_FAILURES 3
+/* Never steal a piece that's been going for less than this */
+#define SWARM_STEAL_MIN_SECS 1.0
+/* How often idle lanes look for something to steal */
+#define SWARM_TICK_SECS 1
+
+
+typedef enum
+{
+    piece_state_NONE,
+    piece_state_WANTED,
+    piece_state_FETCHING,
+    piece_state_DONE
+} piece_state_t;
+
+typedef struct
+{
+    piece_state_t state;
+    unsigned fetchers; /* lanes fetching it; two once it's been stolen */
+    double started;    /* when the first of them started */
+    char *data;        /* once it's done */
+} piece_t;
+
+typedef struct _lane_t
+{
+    swarm_t *swarm;
+    scheduler_task_t *task;
+    listing_t *li;
+    const char *client; /* pooled */
+
+    /* Everything below is protected by the swarm's lock, except that the body
+     * callback has buf and received to itself while a transfer's going */
+    fetcher_t *fetcher; /* the current transfer, if there is one... */
+    int finished;       /* ...which has finished... */
+    int rc;             /* ...with this */
+    int cancelled;
+    size_t piece;       /* what it's fetching */
+    char *buf;
+    size_t len;
+    size_t received;
+    double started;
+
+    double avg_secs;    /* how long a piece usually takes from this peer */
+    unsigned failures;  /* in a row */
+
+    TAILQ_ENTRY(_lane_t) lanes;
+} lane_t;
+
+typedef TAILQ_HEAD(_lane_list_t,_lane_t) lane_list_t;
+
+struct _swarm_t
+{
+    char *hash;
+    off_t size;
+    size_t piece_count;
+    unsigned long stall_speed;
+    unsigned stall_time;
+
+    pthread_mutex_t lock; /* protects everything below */
+    scheduler_task_t *owner; /* NULL once the owner's gone */
+    piece_t *pieces;
+    lane_list_t lanes;
+    unsigned refs; /* the owner's, and one for each lane */
+};
+
+
+static void swarm_free (swarm_t *swarm);
+static void lane_run (void *ctxt);
+static void lane_next (lane_t *lane);
+static void lane_finish_transfer (lane_t *lane);
+static int lane_remove (lane_t *lane);
+static int lane_body (void *ctxt, void *data, size_t len);
+static void lane_done (void *ctxt, int rc);
+static void lanes_wake_idle (swarm_t *swarm);
+static int piece_find_wanted (swarm_t *swarm, size_t *index);
+static int piece_find_lagging (lane_t *lane, size_t *index);
+static int piece_any_fetching (swarm_t *swarm);
+static size_t piece_get_len (swarm_t *swarm, size_t index);
+static void piece_cache (swarm_t *swarm, size_t index, const char *data, size_t len);
+
+
+swarm_t *swarm_new (const char *hash,
+                    off_t size,
+                    listing_list_t *alternatives,
+                    unsigned max_peers,
+                    scheduler_task_t *owner)
+{
+    swarm_t *swarm = (swarm_t *)calloc(1, sizeof(swarm_t));
+    config_reader_t *config = config_get_reader();
+    lane_t *lane;
+    unsigned i;
+
+
+    swarm->stall_speed = MAX(config_downloader_stall_speed(config), 0);
+    swarm->stall_time = MAX(config_downloader_stall_time(config), 0);
+    config_reader_delete(config);
+
+    swarm->hash = strdup(hash);
+    swarm->size = size;
+    swarm->piece_count = (size + SWARM_PIECE_SIZE - 1) / SWARM_PIECE_SIZE;
+    swarm->pieces = (piece_t *)calloc(swarm->piece_count, sizeof(piece_t));
+    swarm->owner = owner;
+    swarm->refs = 1;
+    TAILQ_INIT(&swarm->lanes);
+    pthread_mutex_init(&swarm->lock, NULL);
+
+    for (i = 0; i < listing_list_get_count(alternatives) && i < max_peers; ++i)
+    {
+        lane = (lane_t *)calloc(1, sizeof(lane_t));
+        lane->swarm = swarm;
+        lane->li = listing_list_get_item(alternatives, i);
+        lane->client = listing_get_client(lane->li);
+        lane->task = scheduler_task_new(&lane_run, lane);
+
+        TAILQ_INSERT_TAIL(&swarm->lanes, lane, lanes);
+        swarm->refs++;
+    }
+
+    downloader_trace("swarm of %u peers, %zu pieces\n", swarm->refs - 1, swarm->piece_count);
+
+
+    return swarm;
+}
+
+void swarm_delete (swarm_t *swarm)
+{
+    lane_t *lane;
+    int free_now;
+
+
+    pthread_mutex_lock(&swarm->lock);
+
+    swarm->owner = NULL;
+    free_now = !--swarm->refs;
+
+    /* Each lane cancels whatever it's got going, and then goes away */
+    TAILQ_FOREACH(lane, &swarm->lanes, lanes)
+    {
+        scheduler_task_wake(lane->task);
+    }
+
+    pthread_mutex_unlock(&swarm->lock);
+
+
+    if (free_now) swarm_free(swarm);
+}
+
+/* Called outside the lock, once the owner and all the lanes have gone */
+static void swarm_free (swarm_t *swarm)
+{
+    size_t i;
+
+
+    assert(TAILQ_EMPTY(&swarm->lanes));
+
+    for (i = 0; i < swarm->piece_count; ++i)
+    {
+        free(swarm->pieces[i].data);
+    }
+    free(swarm->pieces);
+    free(swarm->hash);
+    pthread_mutex_destroy(&swarm->lock);
+
+    free(swarm);
+}
+
+void swarm_want (swarm_t *swarm, off_t start, off_t end)
+{
+    size_t i;
+    int wanted = 0;
+
+
+    pthread_mutex_lock(&swarm->lock);
+
+    for (i = start / SWARM_PIECE_SIZE;
+         i < swarm->piece_count && (off_t)(i * SWARM_PIECE_SIZE) < end;
+         ++i)
+    {
+        if (swarm->pieces[i].state == piece_state_NONE)
+        {
+            swarm->pieces[i].state = piece_state_WANTED;
+            wanted = 1;
+        }
+    }
+
+    if (wanted) lanes_wake_idle(swarm);
+
+    pthread_mutex_unlock(&swarm->lock);
+}
+
+void swarm_forget_outside (swarm_t *swarm, off_t start, off_t end)
+{
+    piece_t *piece;
+    off_t piece_start;
+    size_t i;
+
+
+    pthread_mutex_lock(&swarm->lock);
+
+    for (i = 0; i < swarm->piece_count; ++i)
+    {
+        piece = &swarm->pieces[i];
+        piece_start = i * SWARM_PIECE_SIZE;
+
+        if (piece_start + (off_t)piece_get_len(swarm, i) > start && piece_start < end) continue;
+
+        switch (piece->state)
+        {
+            case piece_state_DONE:
+                free(piece->data);
+                piece->data = NULL;
+                piece->state = piece_state_NONE;
+                break;
+            case piece_state_WANTED:
+                piece->state = piece_state_NONE;
+                break;
+            default:
+                /* Ones being fetched can't be taken back */
+                break;
+        }
+    }
+
+    pthread_mutex_unlock(&swarm->lock);
+}
+
+size_t swarm_read (swarm_t *swarm, off_t off, char *buf, size_t len)
+{
+    piece_t *piece;
+    size_t i, piece_off, copy_len, copied = 0;
+
+
+    pthread_mutex_lock(&swarm->lock);
+
+    while (copied < len)
+    {
+        i = (off + copied) / SWARM_PIECE_SIZE;
+        if (i >= swarm->piece_count) break;
+
+        piece = &swarm->pieces[i];
+        if (piece->state != piece_state_DONE) break;
+
+        piece_off = (off + copied) % SWARM_PIECE_SIZE;
+        copy_len = MIN(len - copied, piece_get_len(swarm, i) - piece_off);
+        memcpy(buf + copied, piece->data + piece_off, copy_len);
+        copied += copy_len;
+    }
+
+    pthread_mutex_unlock(&swarm->lock);
+
+
+    return copied;
+}
+
+int swarm_has_failed (swarm_t *swarm)
+{
+    int rc;
+
+
+    pthread_mutex_lock(&swarm->lock);
+    rc = TAILQ_EMPTY(&swarm->lanes);
+    pthread_mutex_unlock(&swarm->lock);
+
+
+    return rc;
+}
+
+/* EXECUTES IN THREAD: scheduler worker */
+static void lane_run (void *ctxt)
+{
+    lane_t *lane = (lane_t *)ctxt;
+    swarm_t *swarm = lane->swarm;
+    int free_now = 0;
+
+
+    pthread_mutex_lock(&swarm->lock);
+
+    if (lane->fetcher && lane->finished)
+    {
+        lane_finish_transfer(lane);
+    }
+
+    if (!swarm->owner || lane->failures >= SWARM_LANE_FAILURES)
+    {
+        if (!lane->fetcher)
+        {
+            free_now = lane_remove(lane);
+        }
+        else if (!lane->cancelled)
+        {
+            lane->cancelled = 1;
+            fetcher_cancel(lane->fetcher);
+        }
+    }
+    else if (!lane->fetcher)
+    {
+        lane_next(lane);
+    }
+
+    pthread_mutex_unlock(&swarm->lock);
+
+
+    if (free_now) swarm_free(swarm);
+}
+
+/* Starts fetching the next piece that needs it, if there is one and we can get
+ * a slot.
+ * Call with the lock held */
+static void lane_next (lane_t *lane)
+{
+    swarm_t *swarm = lane->swarm;
+    piece_t *piece;
+    string_buffer_t *range_buffer;
+    char *range_str;
+    off_t start;
+    size_t i;
+
+
+    if (!piece_find_wanted(swarm, &i) && !piece_find_lagging(lane, &i))
+    {
+        /* Let someone else have the slot while we've nothing to do */
+        scheduler_transfer_release(lane->task);
+
+        /* A piece that's lagging won't tell anyone, so come back and look */
+        if (piece_any_fetching(swarm))
+        {
+            scheduler_task_wake_after(lane->task, SWARM_TICK_SECS * 1000);
+        }
+        return;
+    }
+
+    if (!scheduler_transfer_tryget(lane->task, lane->client))
+    {
+        /* We'll be woken when there's a slot, and look again */
+        return;
+    }
+
+    piece = &swarm->pieces[i];
+    if (piece->state == piece_state_WANTED)
+    {
+        piece->state = piece_state_FETCHING;
+        piece->started = fsfuse_get_time();
+    }
+    else
+    {
+        downloader_trace("%s stealing piece %zu\n", lane->client, i);
+    }
+    piece->fetchers++;
+
+    start = i * SWARM_PIECE_SIZE;
+    lane->piece = i;
+    lane->len = piece_get_len(swarm, i);
+    lane->buf = malloc(lane->len);
+    lane->received = 0;
+    lane->started = fsfuse_get_time();
+
+    range_buffer = string_buffer_new();
+    string_buffer_printf(range_buffer, "%" PRIu64 "-%" PRIu64,
+                         start, start + lane->len - 1);
+    range_str = string_buffer_commit(range_buffer);
+    downloader_trace("%s fetching range \"%s\"\n", lane->client, range_str);
+
+    lane->fetcher = fetcher_new(listing_get_href(lane->li));
+    fetcher_set_min_speed(lane->fetcher, swarm->stall_speed, swarm->stall_time);
+    fetcher_fetch_body_async(
+        lane->fetcher,
+        &lane_body,
+        lane,
+        range_str,
+        &lane_done,
+        lane
+    );
+
+    free(range_str);
+}
+
+/* Deals with the transfer that's just finished: a whole piece is put in the
+ * cache and handed over, anything else puts it back up for grabs.
+ * Call with the lock held */
+static void lane_finish_transfer (lane_t *lane)
+{
+    swarm_t *swarm = lane->swarm;
+    piece_t *piece = &swarm->pieces[lane->piece];
+    lane_t *other;
+    double secs = fsfuse_get_time() - lane->started;
+
+
+    fetcher_delete(lane->fetcher);
+    lane->fetcher = NULL;
+
+    if (!lane->rc && lane->received == lane->len)
+    {
+        lane->failures = 0;
+        lane->avg_secs = lane->avg_secs ? (lane->avg_secs * 3 + secs) / 4 : secs;
+
+        if (piece->state == piece_state_FETCHING)
+        {
+            /* Nothing else can change a piece that's being fetched, and the
+             * cache can take a while */
+            pthread_mutex_unlock(&swarm->lock);
+            piece_cache(swarm, lane->piece, lane->buf, lane->len);
+            pthread_mutex_lock(&swarm->lock);
+        }
+
+        /* Someone else might have beaten us to it while we were caching */
+        if (piece->state == piece_state_FETCHING)
+        {
+            piece->state = piece_state_DONE;
+            piece->data = lane->buf;
+            lane->buf = NULL;
+
+            TAILQ_FOREACH(other, &swarm->lanes, lanes)
+            {
+                if (other != lane && other->fetcher && !other->finished &&
+                    !other->cancelled && other->piece == lane->piece)
+                {
+                    other->cancelled = 1;
+                    fetcher_cancel(other->fetcher);
+                }
+            }
+
+            if (swarm->owner) scheduler_task_wake(swarm->owner);
+        }
+    }
+    else if (lane->rc != ECANCELED)
+    {
+        /* ECANCELED means we lost a race, or are going away */
+        lane->failures++;
+        downloader_trace("%s failed piece %zu (%d), %u in a row\n",
+                         lane->client, lane->piece, lane->rc, lane->failures);
+    }
+
+    if (!--piece->fetchers && piece->state == piece_state_FETCHING)
+    {
+        piece->state = piece_state_WANTED;
+    }
+
+    free(lane->buf);
+    lane->buf = NULL;
+    lane->finished = 0;
+    lane->cancelled = 0;
+
+    /* Whatever's just been given up could be picked up by someone else */
+    lanes_wake_idle(swarm);
+}
+
+/* The lane goes away. Returns true if it was the last thing holding on to the
+ * swarm.
+ * Call with the lock held, from the lane's own task */
+static int lane_remove (lane_t *lane)
+{
+    swarm_t *swarm = lane->swarm;
+
+
+    TAILQ_REMOVE(&swarm->lanes, lane, lanes);
+
+    scheduler_transfer_release(lane->task);
+    scheduler_task_delete(lane->task);
+
+    if (swarm->owner && TAILQ_EMPTY(&swarm->lanes))
+    {
+        downloader_trace("every peer in the swarm has failed\n");
+        scheduler_task_wake(swarm->owner);
+    }
+
+    listing_delete(CALLER_INFO lane->li);
+    string_pool_release(lane->client);
+    free(lane);
+
+
+    return !--swarm->refs;
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static int lane_body (void *ctxt, void *data, size_t len)
+{
+    lane_t *lane = (lane_t *)ctxt;
+
+
+    /* More than we asked for; the peer probably ignored the range */
+    if (len > lane->len - lane->received) return 1;
+
+    memcpy(lane->buf + lane->received, data, len);
+    lane->received += len;
+
+
+    return 0;
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void lane_done (void *ctxt, int rc)
+{
+    lane_t *lane = (lane_t *)ctxt;
+
+
+    pthread_mutex_lock(&lane->swarm->lock);
+
+    lane->finished = 1;
+    lane->rc = rc;
+    scheduler_task_wake(lane->task);
+
+    pthread_mutex_unlock(&lane->swarm->lock);
+}
+
+/* Call with the lock held */
+static void lanes_wake_idle (swarm_t *swarm)
+{
+    lane_t *lane;
+
+
+    TAILQ_FOREACH(lane, &swarm->lanes, lanes)
+    {
+        if (!lane->fetcher) scheduler_task_wake(lane->task);
+    }
+}
+
+/* Call with the lock held */
+static int piece_find_wanted (swarm_t *swarm, size_t *index)
+{
+    size_t i;
+
+
+    for (i = 0; i < swarm->piece_count; ++i)
+    {
+        if (swarm->pieces[i].state == piece_state_WANTED)
+        {
+            *index = i;
+            return 1;
+        }
+    }
+
+
+    return 0;
+}
+
+/* The earliest piece that only one other lane is fetching, and that's been
+ * going for long enough that we'd probably do it faster.
+ * Call with the lock held */
+static int piece_find_lagging (lane_t *lane, size_t *index)
+{
+    swarm_t *swarm = lane->swarm;
+    double now = fsfuse_get_time(), threshold = MAX(SWARM_STEAL_MIN_SECS, lane->avg_secs * 2);
+    size_t i;
+
+
+    for (i = 0; i < swarm->piece_count; ++i)
+    {
+        if (swarm->pieces[i].state == piece_state_FETCHING &&
+            swarm->pieces[i].fetchers == 1 &&
+            now - swarm->pieces[i].started > threshold)
+        {
+            *index = i;
+            return 1;
+        }
+    }
+
+
+    return 0;
+}
+
+/* Whether anyone's fetching anything, which might yet lag.
+ * Call with the lock held */
+static int piece_any_fetching (swarm_t *swarm)
+{
+    size_t i;
+
+
+    for (i = 0; i < swarm->piece_count; ++i)
+    {
+        if (swarm->pieces[i].state == piece_state_FETCHING) return 1;
+    }
+
+
+    return 0;
+}
+
+static size_t piece_get_len (swarm_t *swarm, size_t index)
+{
+    off_t start = index * SWARM_PIECE_SIZE;
+
+
+    return MIN(SWARM_PIECE_SIZE, swarm->size - start);
+}
+
+static void piece_cache (swarm_t *swarm, size_t index, const char *data, size_t len)
+{
+    off_t block = index * (SWARM_PIECE_SIZE / BLOCK_CACHE_BLOCK_SIZE);
+    size_t off;
+
+
+    for (off = 0; off < len; off += BLOCK_CACHE_BLOCK_SIZE, ++block)
+    {
+        block_cache_insert(swarm->hash, block, data + off, MIN(BLOCK_CACHE_BLOCK_SIZE, len - off));
+    }
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Swarm class - fetches one file from several peers at once. Internal to the
+ * downloader.
+ */
+
+#ifndef _INCLUDED_SWARM_H
+#define _INCLUDED_SWARM_H
+
+#include "common.h"
+
+#include <sys/types.h>
+
+#include "listing_list.h"
+#include "scheduler.h"
+
+
+typedef struct _swarm_t swarm_t;
+
+
+/* Uses the first <max_peers> of <alternatives>. <owner> is woken whenever a
+ * piece arrives, and when the swarm's given up. */
+extern swarm_t *swarm_new (const char *hash,
+                           off_t size,
+                           listing_list_t *alternatives,
+                           unsigned max_peers,
+                           scheduler_task_t *owner);
+/* The owner isn't woken again; transfers in flight are cancelled, and the
+ * swarm goes away once they have */
+extern void swarm_delete (swarm_t *swarm);
+
+/* Ask for [start, end) to be fetched, if it hasn't been */
+extern void swarm_want (swarm_t *swarm, off_t start, off_t end);
+/* Forget fetched pieces, and stop wanting pieces, that aren't in [start, end) */
+extern void swarm_forget_outside (swarm_t *swarm, off_t start, off_t end);
+/* Copies as much of [off, off + len) as has arrived, from off onwards */
+extern size_t swarm_read (swarm_t *swarm, off_t off, char *buf, size_t len);
+/* Every peer has failed too often, so nothing more will arrive */
+extern int swarm_has_failed (swarm_t *swarm);
+
+#endif /* _INCLUDED_SWARM_H */
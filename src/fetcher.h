@@ -18,8 +18,14 @@ TRACE_DECLARE(fetcher)
 
 typedef struct _fetcher_t fetcher_t;
 
+/* Body callbacks return 0 to carry on, FETCHER_PAUSE to stop the transfer
+ * until fetcher_resume() (when they'll be given the same data again), or
+ * anything else to abort it. */
+#define FETCHER_PAUSE (-1)
+
 typedef int (*fetcher_header_cb_t)( void *ctxt, const char *key, const char *value );
 typedef int (*fetcher_body_cb_t)(   void *ctxt, void *data, size_t len );
+typedef void (*fetcher_done_cb_t)(  void *ctxt, int rc );
 
 
 extern int fetcher_init (void);
@@ -28,6 +34,7 @@ extern void fetcher_finalise (void);
 extern fetcher_t *fetcher_new (const char *url);
 extern void fetcher_delete (fetcher_t *fetcher);
 
+/* Block until the transfer's done. Mustn't be called from a fetcher callback. */
 extern int fetcher_fetch_headers(
     fetcher_t *fetcher,
     fetcher_header_cb_t header_cb,
@@ -40,6 +47,33 @@ extern int fetcher_fetch_body(
     const char *range
 );
 
+/* Start the transfer and return straight away. All the callbacks are called on
+ * a fetcher thread, so they mustn't block. done_cb is called exactly once, when
+ * the transfer's finished, failed or been cancelled (rc ECANCELED), and may
+ * delete the fetcher. */
+extern void fetcher_fetch_headers_async(
+    fetcher_t *fetcher,
+    fetcher_header_cb_t header_cb,
+    void *header_cb_ctxt,
+    fetcher_done_cb_t done_cb,
+    void *done_ctxt
+);
+extern void fetcher_fetch_body_async(
+    fetcher_t *fetcher,
+    fetcher_body_cb_t body_cb,
+    void *body_cb_ctxt,
+    const char *range,
+    fetcher_done_cb_t done_cb,
+    void *done_ctxt
+);
+/* Body transfers started after this fail with ETIMEDOUT if they get less than
+ * <bytes_per_sec> for <secs> in a row, not counting time spent paused. 0
+ * turns it off. */
+extern void fetcher_set_min_speed( fetcher_t *fetcher, unsigned long bytes_per_sec, unsigned secs );
+/* Only valid between starting an async transfer and its done_cb */
+extern void fetcher_resume( fetcher_t *fetcher );
+extern void fetcher_cancel( fetcher_t *fetcher );
+
 extern const char *fetcher_make_http_url (
     const char *host,
     const char *port,
@@ -10,6 +10,8 @@
  * Fetcher module. This contains the functions that arrange for actual file
  * transfers, be they of XML metadata files (e.g. dir listings), or actual data
  * (e.g. for read()).
+ * Transfers are run by the engine (fetcher_engine.c). The blocking functions
+ * just start an async transfer and wait for it.
  */
 
 #include "common.h"
@@ -17,12 +19,15 @@
 #include <assert.h>
 #include <curl/curl.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "fetcher.h"
+#include "fetcher_internal.h"
 
 #include "config_manager.h"
 #include "config_reader.h"
@@ -40,14 +45,6 @@
 TRACE_DEFINE(fetcher)
 
 
-struct _fetcher_t
-{
-    const char *url;
-    CURL *eh;
-    char *error_buffer;
-    struct curl_slist *slist;
-};
-
 typedef struct
 {
     fetcher_header_cb_t cb;
@@ -57,8 +54,29 @@ typedef struct
 {
     fetcher_body_cb_t cb;
     void *ctxt;
+
+    /* Stall detection */
+    int paused;
+    unsigned long min_speed;
+    unsigned min_speed_time;
+    time_t window_start;     /* 0 to start a new window at the next check */
+    curl_off_t window_bytes; /* how much we'd had when it started */
 } body_cb_wrapper_ctxt_t;
 
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int rc;
+} sync_ctxt_t;
+
+
+/* The live connections are kept by the engine's multi handles. These count how
+ * often a transfer found one to reuse (a hit) or had to connect (a miss). */
+static unsigned long s_pool_hits = 0;
+static unsigned long s_pool_misses = 0;
+
 
 /* ========================================================================== */
 /*      Init & Teardown                                                       */
@@ -72,25 +90,52 @@ int fetcher_init (void)
     curl_global_init(CURL_GLOBAL_NOTHING);
 
 
-    return 0;
+    return fetcher_engine_init();
 }
 
 void fetcher_finalise (void)
 {
+    /* Stop the engine first; its transfers are still counting */
+    fetcher_engine_finalise();
+
+    trace_info("Connection pool: %lu hits, %lu misses\n",
+               __atomic_load_n(&s_pool_hits, __ATOMIC_RELAXED),
+               __atomic_load_n(&s_pool_misses, __ATOMIC_RELAXED));
+
     curl_global_cleanup();
 }
 
+/* Transfers are sent to an engine loop, and so share its connections, by the
+ * host and port that we first connect to. Any redirects are followed in the
+ * same loop. */
+static const char *url_host_key (const char *url)
+{
+    const char *start = strstr(url, "://"), *end;
+    char *key;
+    size_t len;
+
+
+    start = start ? start + 3 : url;
+    end = start + strcspn(start, "/?#");
+    len = end - start;
+
+    key = malloc(len + 1);
+    memcpy(key, start, len);
+    key[len] = '\0';
+
+
+    return key;
+}
 
 fetcher_t *fetcher_new (const char *url)
 {
     config_reader_t *config = config_get_reader();
-    fetcher_t *fetcher = malloc(sizeof(*fetcher));
+    fetcher_t *fetcher = calloc(1, sizeof(*fetcher));
     string_buffer_t *alias = string_buffer_new();
 
 
     fetcher->url = url;
-
-    /* New handle */
+    fetcher->host_key = url_host_key(url);
     fetcher->eh = curl_easy_init();
 
     /* Error buffer */
@@ -113,9 +158,9 @@ fetcher_t *fetcher_new (const char *url)
     string_buffer_delete(alias);
     curl_easy_setopt(fetcher->eh, CURLOPT_HTTPHEADER, fetcher->slist);
 
-    /* No keep-alive */
-    curl_easy_setopt(fetcher->eh, CURLOPT_FRESH_CONNECT, 1);
-    curl_easy_setopt(fetcher->eh, CURLOPT_FORBID_REUSE, 1);
+    /* Keep-alive. The engine loop's multi handle keeps the connection for the
+     * next transfer to the same host */
+    curl_easy_setopt(fetcher->eh, CURLOPT_TCP_KEEPALIVE, 1L);
 
     /* Have libcurl abort on error (http >= 400) */
     curl_easy_setopt(fetcher->eh, CURLOPT_FAILONERROR, 1);
@@ -128,7 +173,11 @@ fetcher_t *fetcher_new (const char *url)
 
 void fetcher_delete (fetcher_t *fetcher)
 {
+    assert(!fetcher->cb_wrapper_ctxt);
+    fetcher_engine_forget(fetcher);
+
     curl_easy_cleanup(fetcher->eh);
+    free_const(fetcher->host_key);
     curl_slist_free_all(fetcher->slist);
     free(fetcher->error_buffer);
     free_const(fetcher->url);
@@ -262,8 +311,17 @@ static int process_curl_response( fetcher_t *fetcher, int curl_rc )
             break;
 
         case CURLE_PARTIAL_FILE:
-            /* i.e. server closed the connection half way through */
-            rc = 0;
+            /* i.e. server closed the connection half way through. That's the
+             * peer failing, not the end of the file; whatever we got has
+             * been passed on, but whoever asked needs to know there should
+             * have been more (and maybe to try someone else for it) */
+            rc = EIO;
+            break;
+
+        case CURLE_ABORTED_BY_CALLBACK:
+            /* the stall check gave up on it */
+        case CURLE_OPERATION_TIMEDOUT:
+            rc = ETIMEDOUT;
             break;
 
         case CURLE_COULDNT_CONNECT:
@@ -322,21 +380,117 @@ static size_t header_cb_wrapper( char *header, size_t size, size_t nmemb, void *
 static size_t body_cb_wrapper( char *data, size_t size, size_t nmemb, void *ctxt )
 {
     body_cb_wrapper_ctxt_t *wrapper_ctxt = (body_cb_wrapper_ctxt_t *)ctxt;
+    size_t rc = size * nmemb;
+
 
-    return wrapper_ctxt->cb( wrapper_ctxt->ctxt, data, size * nmemb ) ? 0 : size * nmemb;
+    /* Time spent paused doesn't count against the peer */
+    if( wrapper_ctxt->paused ) wrapper_ctxt->window_start = 0;
+    wrapper_ctxt->paused = 0;
+
+    switch( wrapper_ctxt->cb( wrapper_ctxt->ctxt, data, size * nmemb ) )
+    {
+        case 0:
+            break;
+        case FETCHER_PAUSE:
+            wrapper_ctxt->paused = 1;
+            rc = CURL_WRITEFUNC_PAUSE;
+            break;
+        default:
+            rc = 0;
+            break;
+    }
+
+
+    return rc;
 }
 
-int fetcher_fetch_headers(
+/* curl calls this about once a second while a transfer's going, whether or not
+ * anything's arriving. Aborts the transfer if less than min_speed bytes a second
+ * have come in over the last min_speed_time seconds. */
+static int xferinfo_cb_wrapper( void *ctxt, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow )
+{
+    body_cb_wrapper_ctxt_t *wrapper_ctxt = (body_cb_wrapper_ctxt_t *)ctxt;
+    time_t now = time( NULL );
+
+
+    NOT_USED(dltotal);
+    NOT_USED(ultotal);
+    NOT_USED(ulnow);
+
+    if( wrapper_ctxt->paused || !wrapper_ctxt->window_start )
+    {
+        wrapper_ctxt->window_start = now;
+        wrapper_ctxt->window_bytes = dlnow;
+    }
+    else if( now - wrapper_ctxt->window_start >= (time_t)wrapper_ctxt->min_speed_time )
+    {
+        if( (unsigned long)(dlnow - wrapper_ctxt->window_bytes) <
+            wrapper_ctxt->min_speed * wrapper_ctxt->min_speed_time )
+        {
+            fetcher_trace( "transfer stalled: %lu bytes in %us\n",
+                           (unsigned long)(dlnow - wrapper_ctxt->window_bytes),
+                           (unsigned)(now - wrapper_ctxt->window_start) );
+            return 1;
+        }
+
+        wrapper_ctxt->window_start = now;
+        wrapper_ctxt->window_bytes = dlnow;
+    }
+
+
+    return 0;
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+void fetcher_transfer_done( fetcher_t *fetcher, CURLcode result )
+{
+    int rc = fetcher->cancelled ? ECANCELED : process_curl_response( fetcher, result );
+    long connects = 0, code = 0;
+
+
+    /* Anything that got a response and didn't have to connect for it used a
+     * connection from the pool */
+    curl_easy_getinfo( fetcher->eh, CURLINFO_NUM_CONNECTS, &connects );
+    curl_easy_getinfo( fetcher->eh, CURLINFO_RESPONSE_CODE, &code );
+    if( connects )   __atomic_add_fetch( &s_pool_misses, 1, __ATOMIC_RELAXED );
+    else if( code )  __atomic_add_fetch( &s_pool_hits, 1, __ATOMIC_RELAXED );
+
+    free( fetcher->cb_wrapper_ctxt );
+    fetcher->cb_wrapper_ctxt = NULL;
+    curl_easy_setopt(fetcher->eh, CURLOPT_RANGE, NULL);
+
+    /* Last thing; the callback is allowed to delete the fetcher */
+    fetcher->done_cb( fetcher->done_ctxt, rc );
+}
+
+static void transfer_start(
+    fetcher_t *fetcher,
+    fetcher_done_cb_t done_cb,
+    void *done_ctxt
+)
+{
+    assert(done_cb);
+
+    fetcher->done_cb = done_cb;
+    fetcher->done_ctxt = done_ctxt;
+    fetcher->cancelled = 0;
+
+    fetcher_engine_add( fetcher );
+}
+
+void fetcher_fetch_headers_async(
     fetcher_t *fetcher,
     fetcher_header_cb_t header_cb,
-    void *header_cb_ctxt
+    void *header_cb_ctxt,
+    fetcher_done_cb_t done_cb,
+    void *done_ctxt
 )
 {
-    header_cb_wrapper_ctxt_t *header_cb_wrapper_ctxt = NULL;
-    int rc;
+    header_cb_wrapper_ctxt_t *header_cb_wrapper_ctxt;
 
 
     assert(header_cb);
+    assert(!fetcher->cb_wrapper_ctxt);
 
     /* Do a HEAD request */
     curl_easy_setopt(fetcher->eh, CURLOPT_NOBODY, 1);
@@ -345,56 +499,151 @@ int fetcher_fetch_headers(
     header_cb_wrapper_ctxt = malloc(sizeof(*header_cb_wrapper_ctxt));
     header_cb_wrapper_ctxt->cb = header_cb;
     header_cb_wrapper_ctxt->ctxt = header_cb_ctxt;
+    fetcher->cb_wrapper_ctxt = header_cb_wrapper_ctxt;
 
     curl_easy_setopt(fetcher->eh, CURLOPT_HEADERFUNCTION, &header_cb_wrapper);
-    curl_easy_setopt(fetcher->eh, CURLOPT_HEADERDATA, header_cb_ctxt);
-
-
-    /* Do it - blocks */
-    rc = process_curl_response( fetcher, curl_easy_perform(fetcher->eh) );
-
+    curl_easy_setopt(fetcher->eh, CURLOPT_HEADERDATA, header_cb_wrapper_ctxt);
 
-    free( header_cb_wrapper_ctxt );
 
-
-    return rc;
+    transfer_start( fetcher, done_cb, done_ctxt );
 }
 
-int fetcher_fetch_body(
+void fetcher_fetch_body_async(
     fetcher_t *fetcher,
     fetcher_body_cb_t body_cb,
     void *body_cb_ctxt,
-    const char *range
+    const char *range,
+    fetcher_done_cb_t done_cb,
+    void *done_ctxt
 )
 {
-    body_cb_wrapper_ctxt_t *body_cb_wrapper_ctxt = NULL;
-    int rc;
+    body_cb_wrapper_ctxt_t *body_cb_wrapper_ctxt;
+
 
+    assert(body_cb);
+    assert(!fetcher->cb_wrapper_ctxt);
 
     /* Body consumer */
-    body_cb_wrapper_ctxt = malloc(sizeof(*body_cb_wrapper_ctxt));
+    body_cb_wrapper_ctxt = calloc(1, sizeof(*body_cb_wrapper_ctxt));
     body_cb_wrapper_ctxt->cb = body_cb;
     body_cb_wrapper_ctxt->ctxt = body_cb_ctxt;
+    fetcher->cb_wrapper_ctxt = body_cb_wrapper_ctxt;
 
     curl_easy_setopt(fetcher->eh, CURLOPT_WRITEFUNCTION, &body_cb_wrapper);
-    curl_easy_setopt(fetcher->eh, CURLOPT_WRITEDATA, body_cb_ctxt);
+    curl_easy_setopt(fetcher->eh, CURLOPT_WRITEDATA, body_cb_wrapper_ctxt);
+
+    /* Stall detection. Not curl's LOW_SPEED options, as we mustn't count the
+     * time a transfer spends paused */
+    if (fetcher->min_speed && fetcher->min_speed_time)
+    {
+        body_cb_wrapper_ctxt->min_speed = fetcher->min_speed;
+        body_cb_wrapper_ctxt->min_speed_time = fetcher->min_speed_time;
 
-    /* Range */
+        curl_easy_setopt(fetcher->eh, CURLOPT_XFERINFOFUNCTION, &xferinfo_cb_wrapper);
+        curl_easy_setopt(fetcher->eh, CURLOPT_XFERINFODATA, body_cb_wrapper_ctxt);
+        curl_easy_setopt(fetcher->eh, CURLOPT_NOPROGRESS, 0L);
+    }
+
+    /* Range - curl takes a copy */
     if (range)
     {
         curl_easy_setopt(fetcher->eh, CURLOPT_RANGE, range);
     }
 
 
-    /* Do it - blocks */
-    rc = process_curl_response( fetcher, curl_easy_perform( fetcher->eh ) );
+    transfer_start( fetcher, done_cb, done_ctxt );
+}
 
+void fetcher_set_min_speed( fetcher_t *fetcher, unsigned long bytes_per_sec, unsigned secs )
+{
+    fetcher->min_speed = bytes_per_sec;
+    fetcher->min_speed_time = secs;
+}
 
-    free( body_cb_wrapper_ctxt );
-    curl_easy_setopt(fetcher->eh, CURLOPT_RANGE, NULL);
+void fetcher_resume( fetcher_t *fetcher )
+{
+    fetcher_engine_resume( fetcher );
+}
 
+void fetcher_cancel( fetcher_t *fetcher )
+{
+    fetcher_engine_cancel( fetcher );
+}
 
-    return rc;
+
+/* Blocking versions ======================================================== */
+
+static void sync_ctxt_init( sync_ctxt_t *sync )
+{
+    /* Waiting for the engine from one of its own threads would never end */
+    assert(!fetcher_engine_on_loop_thread());
+
+    pthread_mutex_init(&sync->lock, NULL);
+    pthread_cond_init(&sync->cond, NULL);
+    sync->done = 0;
+    sync->rc = 0;
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void sync_done_cb( void *ctxt, int rc )
+{
+    sync_ctxt_t *sync = (sync_ctxt_t *)ctxt;
+
+
+    pthread_mutex_lock(&sync->lock);
+    sync->rc = rc;
+    sync->done = 1;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
+}
+
+static int sync_wait( sync_ctxt_t *sync )
+{
+    pthread_mutex_lock(&sync->lock);
+    while (!sync->done)
+    {
+        pthread_cond_wait(&sync->cond, &sync->lock);
+    }
+    pthread_mutex_unlock(&sync->lock);
+
+    pthread_cond_destroy(&sync->cond);
+    pthread_mutex_destroy(&sync->lock);
+
+
+    return sync->rc;
+}
+
+int fetcher_fetch_headers(
+    fetcher_t *fetcher,
+    fetcher_header_cb_t header_cb,
+    void *header_cb_ctxt
+)
+{
+    sync_ctxt_t sync;
+
+
+    sync_ctxt_init(&sync);
+    fetcher_fetch_headers_async(fetcher, header_cb, header_cb_ctxt, &sync_done_cb, &sync);
+
+
+    return sync_wait(&sync);
+}
+
+int fetcher_fetch_body(
+    fetcher_t *fetcher,
+    fetcher_body_cb_t body_cb,
+    void *body_cb_ctxt,
+    const char *range
+)
+{
+    sync_ctxt_t sync;
+
+
+    sync_ctxt_init(&sync);
+    fetcher_fetch_body_async(fetcher, body_cb, body_cb_ctxt, range, &sync_done_cb, &sync);
+
+
+    return sync_wait(&sync);
 }
 
 
@@ -0,0 +1,555 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Fetcher engine. Runs many transfers at once on a small pool of event loop
+ * threads, rather than parking a thread in curl_easy_perform() for each one.
+ *
+ * Each loop thread drives one curl multi handle. On Linux it waits on the
+ * multi's sockets with epoll (curl tells us which ones via the socket
+ * callback); elsewhere it falls back to curl_multi_poll().
+ * Other threads never touch a multi handle. They queue commands (add, resume,
+ * cancel) on the loop and wake it up, and the loop carries them out.
+ *
+ * The threads are started on first use, not at init, because fuse_daemonize()
+ * forks after we've initialised and threads don't survive that.
+ */
+
+#include "common.h"
+
+#include <assert.h>
+#include <curl/curl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "fetcher_internal.h"
+
+#include "config_manager.h"
+#include "config_reader.h"
+#include "queue.h"
+
+
+#if defined(__linux__)
+#define USE_EPOLL 1
+#define EPOLL_MAX_EVENTS 64
+#else
+#define USE_EPOLL 0
+#define POLL_TIMEOUT_MS 1000
+#endif
+
+
+typedef enum
+{
+    cmd_ADD,
+    cmd_RESUME,
+    cmd_CANCEL
+} cmd_type_t;
+
+typedef struct _cmd_t
+{
+    cmd_type_t type;
+    fetcher_t *fetcher;
+    TAILQ_ENTRY(_cmd_t) next;
+} cmd_t;
+
+struct _fetcher_loop_t
+{
+    pthread_t thread;
+    CURLM *multi;
+
+    pthread_mutex_t lock; /* protects cmds, batch and quit */
+    TAILQ_HEAD(_cmd_list_t,_cmd_t) cmds;
+    struct _cmd_list_t batch; /* those cmds_run() has taken but not yet run */
+    int quit;
+
+    fetcher_list_t running; /* only touched by the loop thread */
+
+#if USE_EPOLL
+    int epoll_fd;
+    int wake_fd;
+    long timeout_ms;
+#endif
+};
+
+
+static fetcher_loop_t *s_loops = NULL;
+static unsigned s_loop_count = 0;
+static int s_started = 0;
+static pthread_mutex_t s_start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void *loop_main( void *arg );
+
+
+/* ========================================================================== */
+/*      Backends                                                              */
+/* ========================================================================== */
+
+#if USE_EPOLL
+
+static int socket_cb( CURL *eh, curl_socket_t s, int what, void *userp, void *socketp )
+{
+    fetcher_loop_t *loop = (fetcher_loop_t *)userp;
+    struct epoll_event ev;
+
+
+    NOT_USED(eh);
+    NOT_USED(socketp);
+
+    if( what == CURL_POLL_REMOVE )
+    {
+        /* curl may have closed it already, in which case it's gone anyway */
+        epoll_ctl( loop->epoll_fd, EPOLL_CTL_DEL, s, NULL );
+    }
+    else
+    {
+        memset( &ev, 0, sizeof(ev) );
+        ev.events = ((what & CURL_POLL_IN)  ? EPOLLIN  : 0) |
+                    ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+        ev.data.fd = s;
+
+        if( epoll_ctl( loop->epoll_fd, EPOLL_CTL_MOD, s, &ev ) && errno == ENOENT )
+        {
+            assert( !epoll_ctl( loop->epoll_fd, EPOLL_CTL_ADD, s, &ev ) );
+        }
+    }
+
+
+    return 0;
+}
+
+static int timer_cb( CURLM *multi, long timeout_ms, void *userp )
+{
+    fetcher_loop_t *loop = (fetcher_loop_t *)userp;
+
+
+    NOT_USED(multi);
+
+    loop->timeout_ms = timeout_ms;
+
+
+    return 0;
+}
+
+static void backend_init( fetcher_loop_t *loop )
+{
+    struct epoll_event ev;
+
+
+    loop->epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+    assert( loop->epoll_fd != -1 );
+
+    loop->wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    assert( loop->wake_fd != -1 );
+
+    memset( &ev, 0, sizeof(ev) );
+    ev.events = EPOLLIN;
+    ev.data.fd = loop->wake_fd;
+    assert( !epoll_ctl( loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev ) );
+
+    loop->timeout_ms = -1;
+
+    curl_multi_setopt( loop->multi, CURLMOPT_SOCKETFUNCTION, &socket_cb );
+    curl_multi_setopt( loop->multi, CURLMOPT_SOCKETDATA, loop );
+    curl_multi_setopt( loop->multi, CURLMOPT_TIMERFUNCTION, &timer_cb );
+    curl_multi_setopt( loop->multi, CURLMOPT_TIMERDATA, loop );
+}
+
+static void backend_finalise( fetcher_loop_t *loop )
+{
+    close( loop->wake_fd );
+    close( loop->epoll_fd );
+}
+
+static void backend_wake( fetcher_loop_t *loop )
+{
+    uint64_t one = 1;
+
+
+    /* Only fails if the counter's saturated, in which case it's awake anyway */
+    if( write( loop->wake_fd, &one, sizeof(one) ) != sizeof(one) ) {}
+}
+
+/* Waits for something to happen, then lets curl deal with it */
+static void backend_run( fetcher_loop_t *loop )
+{
+    struct epoll_event events[ EPOLL_MAX_EVENTS ];
+    uint64_t count;
+    int n, i, flags, running;
+
+
+    n = epoll_wait( loop->epoll_fd, events, EPOLL_MAX_EVENTS, (int)loop->timeout_ms );
+
+    if( n == 0 )
+    {
+        curl_multi_socket_action( loop->multi, CURL_SOCKET_TIMEOUT, 0, &running );
+    }
+
+    for( i = 0; i < n; i++ )
+    {
+        if( events[ i ].data.fd == loop->wake_fd )
+        {
+            if( read( loop->wake_fd, &count, sizeof(count) ) != sizeof(count) ) {}
+            continue;
+        }
+
+        flags = ((events[ i ].events & EPOLLIN)               ? CURL_CSELECT_IN  : 0) |
+                ((events[ i ].events & EPOLLOUT)              ? CURL_CSELECT_OUT : 0) |
+                ((events[ i ].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR : 0);
+
+        curl_multi_socket_action( loop->multi, events[ i ].data.fd, flags, &running );
+    }
+}
+
+#else /* USE_EPOLL */
+
+static void backend_init( fetcher_loop_t *loop )
+{
+    NOT_USED(loop);
+}
+
+static void backend_finalise( fetcher_loop_t *loop )
+{
+    NOT_USED(loop);
+}
+
+static void backend_wake( fetcher_loop_t *loop )
+{
+    curl_multi_wakeup( loop->multi );
+}
+
+static void backend_run( fetcher_loop_t *loop )
+{
+    int running;
+
+
+    curl_multi_perform( loop->multi, &running );
+    curl_multi_poll( loop->multi, NULL, 0, POLL_TIMEOUT_MS, NULL );
+    curl_multi_perform( loop->multi, &running );
+}
+
+#endif /* USE_EPOLL */
+
+
+/* ========================================================================== */
+/*      Init & Teardown                                                       */
+/* ========================================================================== */
+
+int fetcher_engine_init( void )
+{
+    config_reader_t *config = config_get_reader( );
+    unsigned i;
+
+
+    s_loop_count = MAX( config_fetcher_threads( config ), 1 );
+    s_loops = calloc( s_loop_count, sizeof(*s_loops) );
+
+    for( i = 0; i < s_loop_count; i++ )
+    {
+        s_loops[ i ].multi = curl_multi_init( );
+        /* The multi handle keeps the connections, so it gets the pool's
+         * limits: a share of the total, and all of each host's, as a host's
+         * transfers all go to the one loop */
+        curl_multi_setopt( s_loops[ i ].multi, CURLMOPT_MAXCONNECTS,
+                           (long)MAX( config_fetcher_pool_max_total( config ) / s_loop_count, 1 ) );
+        curl_multi_setopt( s_loops[ i ].multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                           (long)MAX( config_fetcher_pool_max_per_host( config ), 1 ) );
+
+        pthread_mutex_init( &s_loops[ i ].lock, NULL );
+        TAILQ_INIT( &s_loops[ i ].cmds );
+        TAILQ_INIT( &s_loops[ i ].batch );
+        TAILQ_INIT( &s_loops[ i ].running );
+
+        backend_init( &s_loops[ i ] );
+    }
+
+    config_reader_delete( config );
+
+
+    return 0;
+}
+
+static void engine_start( void )
+{
+    unsigned i;
+
+
+    pthread_mutex_lock( &s_start_lock );
+
+    if( !s_started )
+    {
+        fetcher_trace( "starting %u fetcher loop threads\n", s_loop_count );
+
+        for( i = 0; i < s_loop_count; i++ )
+        {
+            assert( !pthread_create( &s_loops[ i ].thread, NULL, &loop_main, &s_loops[ i ] ) );
+        }
+
+        s_started = 1;
+    }
+
+    pthread_mutex_unlock( &s_start_lock );
+}
+
+void fetcher_engine_finalise( void )
+{
+    unsigned i;
+
+
+    for( i = 0; i < s_loop_count; i++ )
+    {
+        if( s_started )
+        {
+            pthread_mutex_lock( &s_loops[ i ].lock );
+            s_loops[ i ].quit = 1;
+            pthread_mutex_unlock( &s_loops[ i ].lock );
+
+            backend_wake( &s_loops[ i ] );
+            pthread_join( s_loops[ i ].thread, NULL );
+        }
+
+        assert( TAILQ_EMPTY( &s_loops[ i ].cmds ) );
+
+        backend_finalise( &s_loops[ i ] );
+        curl_multi_cleanup( s_loops[ i ].multi );
+        pthread_mutex_destroy( &s_loops[ i ].lock );
+    }
+
+    free( s_loops );
+    s_loops = NULL;
+    s_loop_count = 0;
+    s_started = 0;
+}
+
+
+/* ========================================================================== */
+/*      Commands                                                              */
+/* ========================================================================== */
+
+static unsigned key_hash( const char *key )
+{
+    unsigned h = 5381;
+
+
+    while( *key ) h = h * 33 + (unsigned char)*key++;
+
+
+    return h;
+}
+
+static void cmd_post( fetcher_loop_t *loop, cmd_type_t type, fetcher_t *fetcher )
+{
+    cmd_t *cmd = malloc( sizeof(*cmd) );
+
+
+    cmd->type = type;
+    cmd->fetcher = fetcher;
+
+    pthread_mutex_lock( &loop->lock );
+    TAILQ_INSERT_TAIL( &loop->cmds, cmd, next );
+    pthread_mutex_unlock( &loop->lock );
+
+    backend_wake( loop );
+}
+
+void fetcher_engine_add( fetcher_t *fetcher )
+{
+    engine_start( );
+
+    fetcher->loop = &s_loops[ key_hash( fetcher->host_key ) % s_loop_count ];
+    cmd_post( fetcher->loop, cmd_ADD, fetcher );
+}
+
+void fetcher_engine_resume( fetcher_t *fetcher )
+{
+    assert( fetcher->loop );
+
+    cmd_post( fetcher->loop, cmd_RESUME, fetcher );
+}
+
+void fetcher_engine_cancel( fetcher_t *fetcher )
+{
+    assert( fetcher->loop );
+
+    cmd_post( fetcher->loop, cmd_CANCEL, fetcher );
+}
+
+static void cmds_forget( struct _cmd_list_t *cmds, fetcher_t *fetcher )
+{
+    cmd_t *cmd, *next;
+
+
+    for( cmd = TAILQ_FIRST( cmds ); cmd; cmd = next )
+    {
+        next = TAILQ_NEXT( cmd, next );
+
+        if( cmd->fetcher == fetcher )
+        {
+            TAILQ_REMOVE( cmds, cmd, next );
+            free( cmd );
+        }
+    }
+}
+
+void fetcher_engine_forget( fetcher_t *fetcher )
+{
+    fetcher_loop_t *loop = fetcher->loop;
+
+
+    if( loop )
+    {
+        /* The batch too: the fetcher's usually deleted by its done callback,
+         * which a cmd in the batch ahead of these might well have called */
+        pthread_mutex_lock( &loop->lock );
+        cmds_forget( &loop->cmds, fetcher );
+        cmds_forget( &loop->batch, fetcher );
+        pthread_mutex_unlock( &loop->lock );
+    }
+}
+
+int fetcher_engine_on_loop_thread( void )
+{
+    unsigned i;
+    int rc = 0;
+
+
+    for( i = 0; s_started && i < s_loop_count; i++ )
+    {
+        if( pthread_equal( pthread_self( ), s_loops[ i ].thread ) ) rc = 1;
+    }
+
+
+    return rc;
+}
+
+
+/* ========================================================================== */
+/*      Loop                                                                  */
+/* ========================================================================== */
+
+/* EXECUTES IN THREAD: loop_main() */
+static void transfer_finish( fetcher_loop_t *loop, fetcher_t *fetcher, CURLcode result )
+{
+    curl_multi_remove_handle( loop->multi, fetcher->eh );
+    TAILQ_REMOVE( &loop->running, fetcher, running_list );
+    fetcher->running = 0;
+
+    /* May well delete the fetcher */
+    fetcher_transfer_done( fetcher, result );
+}
+
+/* EXECUTES IN THREAD: loop_main() */
+static int cmds_run( fetcher_loop_t *loop )
+{
+    cmd_t *cmd;
+    int quit;
+
+
+    /* Take the whole queue, so that what's posted while we work waits for the
+     * next go round. It's still the loop's, so that fetcher_engine_forget()
+     * can get at it, and we don't hold the lock while we work on a cmd */
+    pthread_mutex_lock( &loop->lock );
+    while( (cmd = TAILQ_FIRST( &loop->cmds )) )
+    {
+        TAILQ_REMOVE( &loop->cmds, cmd, next );
+        TAILQ_INSERT_TAIL( &loop->batch, cmd, next );
+    }
+    quit = loop->quit;
+
+    while( (cmd = TAILQ_FIRST( &loop->batch )) )
+    {
+        TAILQ_REMOVE( &loop->batch, cmd, next );
+        pthread_mutex_unlock( &loop->lock );
+
+        switch( cmd->type )
+        {
+            case cmd_ADD:
+                curl_easy_setopt( cmd->fetcher->eh, CURLOPT_PRIVATE, cmd->fetcher );
+                curl_multi_add_handle( loop->multi, cmd->fetcher->eh );
+                TAILQ_INSERT_TAIL( &loop->running, cmd->fetcher, running_list );
+                cmd->fetcher->running = 1;
+                break;
+
+            /* Either of these can race with the transfer finishing on its own,
+             * in which case there's nothing to do */
+            case cmd_RESUME:
+                if( cmd->fetcher->running )
+                {
+                    /* Harmless if it's not paused */
+                    curl_easy_pause( cmd->fetcher->eh, CURLPAUSE_CONT );
+                }
+                break;
+
+            case cmd_CANCEL:
+                if( cmd->fetcher->running )
+                {
+                    cmd->fetcher->cancelled = 1;
+                    transfer_finish( loop, cmd->fetcher, CURLE_ABORTED_BY_CALLBACK );
+                }
+                break;
+        }
+
+        free( cmd );
+
+        pthread_mutex_lock( &loop->lock );
+    }
+    pthread_mutex_unlock( &loop->lock );
+
+
+    return quit;
+}
+
+/* EXECUTES IN THREAD: loop_main() */
+static void completions_run( fetcher_loop_t *loop )
+{
+    CURLMsg *msg;
+    fetcher_t *fetcher;
+    int msgs_left;
+
+
+    while( (msg = curl_multi_info_read( loop->multi, &msgs_left )) )
+    {
+        if( msg->msg == CURLMSG_DONE )
+        {
+            curl_easy_getinfo( msg->easy_handle, CURLINFO_PRIVATE, (char **)&fetcher );
+            transfer_finish( loop, fetcher, msg->data.result );
+        }
+    }
+}
+
+/* This is the entry point for fetcher loop threads. */
+static void *loop_main( void *arg )
+{
+    fetcher_loop_t *loop = (fetcher_loop_t *)arg;
+    fetcher_t *fetcher;
+
+
+    while( !cmds_run( loop ) )
+    {
+        backend_run( loop );
+        completions_run( loop );
+    }
+
+    /* Anything still going at shutdown is cancelled */
+    while( (fetcher = TAILQ_FIRST( &loop->running )) )
+    {
+        fetcher->cancelled = 1;
+        transfer_finish( loop, fetcher, CURLE_ABORTED_BY_CALLBACK );
+    }
+
+
+    return NULL;
+}
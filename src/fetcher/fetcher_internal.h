@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Declarations internal to the fetcher and its engine.
+ */
+
+#ifndef _INCLUDED_FETCHER_INTERNAL_H
+#define _INCLUDED_FETCHER_INTERNAL_H
+
+#include "common.h"
+
+#include <curl/curl.h>
+
+#include "fetcher.h"
+
+#include "queue.h"
+
+
+typedef struct _fetcher_loop_t fetcher_loop_t;
+
+struct _fetcher_t
+{
+    const char *url;
+    const char *host_key;
+    CURL *eh;
+    char *error_buffer;
+    struct curl_slist *slist;
+    unsigned long min_speed;
+    unsigned min_speed_time;
+
+    /* Async transfer state */
+    fetcher_loop_t *loop;          /* the loop it was last given to */
+    void *cb_wrapper_ctxt;
+    fetcher_done_cb_t done_cb;
+    void *done_ctxt;
+    int cancelled;
+    int running;                   /* only touched by the loop thread */
+    TAILQ_ENTRY(_fetcher_t) running_list;
+};
+
+typedef TAILQ_HEAD(_fetcher_list_t,_fetcher_t) fetcher_list_t;
+
+
+/* Engine. Runs transfers on a few event loop threads, each driving a curl multi
+ * handle. Transfers for the same host key always go to the same loop, so that
+ * they share its connection cache. */
+extern int fetcher_engine_init( void );
+extern void fetcher_engine_finalise( void );
+
+extern void fetcher_engine_add( fetcher_t *fetcher );
+extern void fetcher_engine_resume( fetcher_t *fetcher );
+extern void fetcher_engine_cancel( fetcher_t *fetcher );
+/* Drops any commands still queued for the fetcher. Called when it's deleted. */
+extern void fetcher_engine_forget( fetcher_t *fetcher );
+
+extern int fetcher_engine_on_loop_thread( void );
+
+/* Called by the engine, on the loop thread, when a transfer has finished */
+extern void fetcher_transfer_done( fetcher_t *fetcher, CURLcode result );
+
+#endif /* _INCLUDED_FETCHER_INTERNAL_H */
@@ -0,0 +1,15 @@
+#
+# Copyright (C) 2008-2012 Matthew Turner. Distributed under the GPL v3.
+#
+# Directory makefile fragment.
+#
+
+FETCHER_HERE := $(SRC_ROOT)/fetcher
+
+vpath %.c $(FETCHER_HERE)
+
+# Should list these explicitly, really
+FETCHER_SOURCES = $(wildcard $(FETCHER_HERE)/*.c)
+FETCHER_OBJECTS = $(patsubst %.c,%.o,$(notdir $(FETCHER_SOURCES)))
+
+OBJECTS += $(FETCHER_OBJECTS)
@@ -14,15 +14,21 @@ vpath %.xsl $(SRC_HERE)
 # fsfuse.o isn't listed because it isn't always wanted.
 SRC_OBJECTS :=                         \
                alarm_simple.o          \
-               binary_heap.o           \
-               fetcher.o               \
+               arena.o                 \
+               block_cache.o           \
+               disk_cache.o            \
                fs2_constants.o         \
+               fuse_loop.o             \
+               interval_tree.o         \
                kvp.o                   \
                localei.o               \
                locks.o                 \
+               name_index.o            \
                peerstats.o             \
-               ref_count.o             \
+               ring_buffer.o           \
+               scheduler.o             \
                string_buffer.o         \
+               string_pool.o           \
                trace.o                 \
                utils.o
 
@@ -28,15 +28,20 @@
 #include <curl/curl.h>
 #include <libxml/xmlversion.h>
 
+#include "block_cache.h"
 #include "buildnumber.h"
 #include "config_manager.h"
 #include "config_reader.h"
 #include "direntry.h"
+#include "disk_cache.h"
 #include "fetcher.h"
+#include "fuse_loop.h"
 #include "indexnodes.h"
 #include "localei.h"
 #include "peerstats.h"
+#include "scheduler.h"
 #include "string_buffer.h"
+#include "string_pool.h"
 #include "utils.h"
 
 #include "fuse_methods.h"
@@ -59,11 +64,13 @@ typedef struct
 
 static char *progname = NULL;
 static mountpoint_t mountpoint;
+static struct fuse_chan *s_chan = NULL; /* while mounted */
 
 
 static int settings_tryget_config_file            (int argc, char *argv[], const char **config_file_path);
 static start_action_t settings_parse_command_line (int argc, char *argv[]);
 static int my_fuse_main (void);
+static void inode_changed (ino_t ino);
 static void fuse_args_set (struct fuse_args *fuse_args, config_reader_t *config);
 static void fsfuse_splash (void);
 static void fsfuse_versions (void);
@@ -150,7 +157,11 @@ int main(int argc, char *argv[])
     /* Inits */
     if (trace_init()                ||
         utils_init()                ||
+        string_pool_init()          ||
         locale_init()               ||
+        scheduler_init()            ||
+        block_cache_init()          ||
+        disk_cache_init()           ||
         fetcher_init()              ||
         direntry_init()               )
     {
@@ -165,7 +176,11 @@ int main(int argc, char *argv[])
     /* finalisations */
     direntry_finalise();
     fetcher_finalise();
+    disk_cache_finalise();
+    block_cache_finalise();
+    scheduler_finalise();
     locale_finalise();
+    string_pool_finalise();
     utils_finalise();
     trace_finalise();
 
@@ -201,17 +216,26 @@ static int my_fuse_main (void)
             fuse_session_add_chan(se, ch);
             fuse_daemonize(config_proc_fg(config));
 
+            s_chan = ch;
+            direntry_set_changed_cb(&inode_changed);
+
             /* Go! */
             if (config_proc_singlethread(config))
             {
                 rc = fuse_session_loop(se);
             }
+            else if (config_fuse_threads(config) > 0)
+            {
+                rc = fuse_loop_run(se, ch, config_fuse_threads(config), config_fuse_clone_fd(config));
+            }
             else
             {
                 rc = fuse_session_loop_mt(se);
             }
 
             /* Teardown */
+            direntry_set_changed_cb(NULL);
+            s_chan = NULL;
             fuse_session_remove_chan(ch);
             fuse_remove_signal_handlers(se);
             fuse_session_destroy(se);
@@ -225,6 +249,19 @@ static int my_fuse_main (void)
     return rc;
 }
 
+/* EXECUTES IN THREAD: fetcher
+ * A file's content has changed, so the kernel mustn't use what it's cached of
+ * it (neither its pages nor its attributes) */
+static void inode_changed (ino_t ino)
+{
+#if FUSE_VERSION >= 28
+    /* Fails harmlessly if the kernel's forgotten it meanwhile */
+    fuse_lowlevel_notify_inval_inode(s_chan, ino, 0, 0);
+#else
+    NOT_USED(ino);
+#endif /* FUSE_VERSION >= 28 */
+}
+
 /* Performs a minimal parse of the command line args to get the config file
  * location */
 static int settings_tryget_config_file (int argc, char *argv[], const char **config_file_path)
@@ -420,6 +457,14 @@ static void fuse_args_set (struct fuse_args *fuse_args, config_reader_t *config)
     string_buffer_printf(my_arg, "-oro");
     fuse_opt_add_arg(fuse_args, string_buffer_peek(my_arg));
 
+    /* The biggest read() the kernel will send us. The rest of the tuning is
+     * negotiated in init() */
+    if (config_fuse_max_read(config) > 0)
+    {
+        string_buffer_printf(my_arg, "-omax_read=%d", config_fuse_max_read(config));
+        fuse_opt_add_arg(fuse_args, string_buffer_peek(my_arg));
+    }
+
     string_buffer_delete(my_arg);
 }
 
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * FUSE request loop implementation.
+ * Modelled on libfuse's own fuse_loop_mt(): each worker receives a request and
+ * processes it, with cancellation only allowed while it's waiting, and the
+ * calling thread sleeps until the session's exited (by a signal, or by the
+ * kernel going away) and then cancels any that are still waiting.
+ * A cloned fd is a channel of our own, which reads and writes the clone
+ * directly. It isn't added to the session (which only has room for one), so
+ * anything that isn't a reply (notifications) still goes out on the original.
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fuse.h>
+#endif /* __linux__ */
+
+#include "fuse_loop.h"
+#include "trace.h"
+
+
+typedef struct
+{
+    struct fuse_session *se;
+    struct fuse_chan *ch;    /* that it reads from */
+    struct fuse_chan *clone; /* ch, if it's a clone of our own */
+    char *buf;
+    size_t bufsize;
+    sem_t *finished;
+    int error;
+    int done;
+    pthread_t thread;
+} worker_t;
+
+
+/* Cloned channels ========================================================== */
+
+/* The data of a clone is its session */
+
+static int clone_receive (struct fuse_chan **chp, char *buf, size_t size)
+{
+    struct fuse_chan *ch = *chp;
+    struct fuse_session *se = (struct fuse_session *)fuse_chan_data(ch);
+    ssize_t res;
+
+
+    do
+    {
+        res = read(fuse_chan_fd(ch), buf, size);
+
+        if (fuse_session_exited(se)) return 0;
+
+        /* ENOENT means the request was interrupted before we got it */
+    } while (res == -1 && errno == ENOENT);
+
+    if (res == -1)
+    {
+        /* The filesystem's been unmounted */
+        if (errno == ENODEV)
+        {
+            fuse_session_exit(se);
+            return 0;
+        }
+
+        if (errno != EINTR && errno != EAGAIN) perror("fuse: reading cloned device");
+
+
+        return -errno;
+    }
+
+
+    return res;
+}
+
+static int clone_send (struct fuse_chan *ch, const struct iovec iov[], size_t count)
+{
+    struct fuse_session *se = (struct fuse_session *)fuse_chan_data(ch);
+    ssize_t res = writev(fuse_chan_fd(ch), iov, count);
+    int err = errno;
+
+
+    if (res == -1)
+    {
+        /* ENOENT means the request was interrupted, which is fine */
+        if (!fuse_session_exited(se) && err != ENOENT) perror("fuse: writing cloned device");
+
+
+        return -err;
+    }
+
+
+    return 0;
+}
+
+static void clone_destroy (struct fuse_chan *ch)
+{
+    close(fuse_chan_fd(ch));
+}
+
+static struct fuse_chan_ops s_clone_ops =
+{
+    .receive = &clone_receive,
+    .send    = &clone_send,
+    .destroy = &clone_destroy
+};
+
+/* NULL if the kernel (or the platform) can't */
+static struct fuse_chan *chan_clone (struct fuse_session *se, struct fuse_chan *ch)
+{
+    struct fuse_chan *clone = NULL;
+#ifdef FUSE_DEV_IOC_CLONE
+    uint32_t master = fuse_chan_fd(ch);
+    int fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+
+
+    if (fd == -1) return NULL;
+
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &master) == -1 ||
+        !(clone = fuse_chan_new(&s_clone_ops, fd, fuse_chan_bufsize(ch), se)))
+    {
+        close(fd);
+    }
+#else
+    NOT_USED(se);
+    NOT_USED(ch);
+#endif /* FUSE_DEV_IOC_CLONE */
+
+
+    return clone;
+}
+
+
+/* Workers ================================================================== */
+
+static void *worker_main (void *w_void)
+{
+    worker_t *w = (worker_t *)w_void;
+    struct fuse_chan *ch;
+    struct fuse_buf fbuf;
+    int res;
+
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (!fuse_session_exited(w->se))
+    {
+        ch = w->ch;
+        memset(&fbuf, 0, sizeof(fbuf));
+        fbuf.mem = w->buf;
+        fbuf.size = w->bufsize;
+
+        /* Only waiting for a request can be cut short */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(w->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (res == -EINTR) continue;
+        if (res <= 0)
+        {
+            if (res < 0)
+            {
+                w->error = 1;
+                fuse_session_exit(w->se);
+            }
+            break;
+        }
+
+        fuse_session_process_buf(w->se, &fbuf, ch);
+    }
+
+    w->done = 1;
+    sem_post(w->finished);
+
+
+    return NULL;
+}
+
+int fuse_loop_run (struct fuse_session *se,
+                   struct fuse_chan *ch,
+                   unsigned threads,
+                   int clone_fd)
+{
+    worker_t *workers = calloc(threads, sizeof(*workers));
+    sem_t finished;
+    unsigned i, started = 0, cloned = 0;
+    int rc = 0;
+
+
+    sem_init(&finished, 0, 0);
+
+    for (i = 0; i < threads; i++)
+    {
+        workers[i].se = se;
+        workers[i].clone = clone_fd ? chan_clone(se, ch) : NULL;
+        workers[i].ch = workers[i].clone ? workers[i].clone : ch;
+        workers[i].bufsize = fuse_chan_bufsize(ch);
+        workers[i].buf = malloc(workers[i].bufsize);
+        workers[i].finished = &finished;
+
+        if (workers[i].clone) cloned++;
+
+        if (pthread_create(&workers[i].thread, NULL, &worker_main, &workers[i]))
+        {
+            trace_error("couldn't start fuse worker %u\n", i);
+            break;
+        }
+        started++;
+    }
+
+    trace_info("%u fuse workers, %u with their own fd\n", started, cloned);
+
+    if (started)
+    {
+        /* Signals interrupt the wait, so that we notice the exit */
+        while (!fuse_session_exited(se))
+        {
+            sem_wait(&finished);
+        }
+
+        for (i = 0; i < started; i++)
+        {
+            if (!workers[i].done) pthread_cancel(workers[i].thread);
+        }
+        for (i = 0; i < started; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+            if (workers[i].error) rc = -1;
+        }
+    }
+    else
+    {
+        rc = -1;
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        if (workers[i].clone) fuse_chan_destroy(workers[i].clone);
+        free(workers[i].buf);
+    }
+    free(workers);
+
+    sem_destroy(&finished);
+
+    fuse_session_reset(se);
+
+
+    return rc;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * FUSE request loop. A fixed pool of workers taking requests from the kernel,
+ * as an alternative to fuse_session_loop_mt(), which starts as many as it
+ * likes.
+ */
+
+#ifndef _INCLUDED_FUSE_LOOP_H
+#define _INCLUDED_FUSE_LOOP_H
+
+#include "common.h"
+
+#include <fuse/fuse_lowlevel.h>
+
+
+/* Runs <se>'s requests on <threads> workers until it's exited. If <clone_fd>,
+ * each worker reads from its own clone of <ch>'s fd, so that they don't all
+ * queue on the one, where the kernel can do that. Returns 0, or -1 if a worker
+ * stopped on an error. */
+extern int fuse_loop_run (struct fuse_session *se,
+                          struct fuse_chan *ch,
+                          unsigned threads,
+                          int clone_fd);
+
+#endif /* _INCLUDED_FUSE_LOOP_H */
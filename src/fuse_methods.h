@@ -36,9 +36,20 @@ typedef struct _fsfuse_ctxt_t
 typedef struct
 {
     direntry_t *de;
+    const char *hash; /* pooled */
     downloader_t *downloader;
 } open_file_ctxt_t;
 
+typedef struct
+{
+    direntry_t *de;
+    /* ".", ".." and the children, as of the last readdir() from offset 0 */
+    direntry_t **entries;
+    unsigned entries_count;
+} open_dir_ctxt_t;
+
+extern void open_dir_snapshot_release (open_dir_ctxt_t *dir);
+
 
 /* fsfuse fuse methods vtable */
 extern struct fuse_lowlevel_ops fuse_methods;
@@ -88,6 +99,10 @@ extern void fsfuse_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_inf
 
 extern void fsfuse_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
 
+#if FUSE_USE_VERSION >= 30
+extern void fsfuse_readdirplus (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+#endif /* FUSE_USE_VERSION >= 30 */
+
 extern void fsfuse_releasedir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 
 extern void fsfuse_fsyncdir (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
@@ -12,44 +12,22 @@
 
 #include "common.h"
 
-#include <errno.h>
-
 #include "direntry.h"
 #include "fuse_methods.h"
 #include "trace.h"
 
 
-/* TODO: I don't think lookup should get direntires. What's it acutally for? I
- * think in lookup we should just be generating inode numbers. */
-/* TODO: lookup count goes up for every fuse_reply_entry - this is only called
- * by lookup(). */
-/* NB: Not guaranteed to get forget() for inodes still around at unmount.
- * TODO: finalise() should kill any remaining inodes / listings/ direntries */
+/* NB: Not guaranteed to get forget() for inodes still around at unmount;
+ * direntry_finalise() clears up any that are left. */
 void fsfuse_forget (fuse_req_t req,
                     fuse_ino_t ino,
                     unsigned long nlookup)
 {
-    int rc;
-    direntry_t *de;
-
-
     method_trace("fsfuse_forget(ino %lu, nlookup %lu)\n",
          ino, nlookup);
     method_trace_indent();
 
-    rc = direntry_get_by_inode(ino, &de);
-
-    if (!rc)
-    {
-        /* Delete our copy... */
-        direntry_delete(CALLER_INFO de);
-
-        /* ...and all the ones taken by lookup() */
-        while (nlookup--)
-        {
-            direntry_delete(CALLER_INFO de);
-        }
-    }
+    direntry_forget(ino, nlookup);
 
     method_trace_dedent();
 
@@ -71,4 +71,7 @@ struct fuse_lowlevel_ops fuse_methods =
 #endif /* FUSE_USE_VERSION >= 28 */
 #endif /* FUSE_USE_VERSION >= 26 */
 #endif /* FUSE_USE_VERSION >= 25 */
+#if FUSE_USE_VERSION >= 30
+    .readdirplus = &fsfuse_readdirplus,
+#endif /* FUSE_USE_VERSION >= 30 */
 };
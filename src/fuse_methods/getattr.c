@@ -20,30 +20,42 @@
 #include "direntry.h"
 
 
+/* fi is "for future use, currently always NULL", so the direntry comes from
+ * the inode, even for an open file */
 void fsfuse_getattr (fuse_req_t req,
                      fuse_ino_t ino,
                      struct fuse_file_info *fi)
 {
-    open_file_ctxt_t *ctxt = (open_file_ctxt_t *)fi->fh;
+    direntry_t *de;
     struct stat stats;
+    double timeout = 0;
+    int rc;
 
 
-    NOT_USED(ino);
+    NOT_USED(fi);
 
     method_trace("fsfuse_getattr(ino %ld)\n", ino);
     method_trace_indent();
 
-    memset(&stats, 0, sizeof(stats));
-    direntry_de2stat(ctxt->de, &stats);
-    direntry_delete(CALLER_INFO ctxt->de);
+    rc = direntry_get_by_inode(ino, &de);
+    if (!rc)
+    {
+        memset(&stats, 0, sizeof(stats));
+        direntry_de2stat(de, &stats);
+        timeout = direntry_get_attr_timeout(de);
+        direntry_delete(CALLER_INFO de);
+    }
 
     method_trace_dedent();
 
 
-    /* TODO: timeout value below. The fuse example takes its struct stat off
-     * the stack and passes it into reply_attr, so it must get copied during
-     * the call.
-     * The timeout, I assume, therefore indicates how long to trust those
-     * stats for before requesting them again. */
-    assert(!fuse_reply_attr(req, &stats, 1.0));
+    /* The kernel trusts the stats for <timeout> seconds before asking again */
+    if (!rc)
+    {
+        assert(!fuse_reply_attr(req, &stats, timeout));
+    }
+    else
+    {
+        assert(!fuse_reply_err(req, rc));
+    }
 }
@@ -14,6 +14,8 @@
 
 #include <errno.h>
 
+#include "config_manager.h"
+#include "config_reader.h"
 #include "fuse_methods.h"
 #include "indexnodes.h"
 #include "trace.h"
@@ -26,10 +28,9 @@
 void fsfuse_init (void *userdata, struct fuse_conn_info *conn)
 {
     fsfuse_ctxt_t *ctxt = (fsfuse_ctxt_t *)userdata;
+    config_reader_t *config = config_get_reader();
 
 
-    NOT_USED(conn);
-
     method_trace("fsfuse_init()\n");
     method_trace_indent();
 
@@ -43,8 +44,41 @@ void fsfuse_init (void *userdata, struct fuse_conn_info *conn)
         conn->max_readahead
     );
 
+    /* Have the kernel send more than one read() at a time, which our
+     * downloaders and the block cache are happy to serve out of order */
+    if (conn->capable & FUSE_CAP_ASYNC_READ) conn->want |= FUSE_CAP_ASYNC_READ;
+
+    /* Let lookup()s and readdir()s in the same directory run together */
+#ifdef FUSE_CAP_PARALLEL_DIROPS
+    if (conn->capable & FUSE_CAP_PARALLEL_DIROPS) conn->want |= FUSE_CAP_PARALLEL_DIROPS;
+#endif /* FUSE_CAP_PARALLEL_DIROPS */
+
+    /* The kernel won't take bigger values than it offered */
+    if (config_fuse_max_readahead(config) > 0)
+    {
+        conn->max_readahead = MIN(conn->max_readahead, (unsigned)config_fuse_max_readahead(config));
+    }
+#if FUSE_VERSION >= 29
+    /* How many requests (read-ahead, mostly) the kernel has outstanding before
+     * it stops sending them, and the point before that at which it tells
+     * writers to back off */
+    if (config_fuse_max_background(config) > 0)
+    {
+        conn->max_background = config_fuse_max_background(config);
+    }
+    if (config_fuse_congestion_threshold(config) > 0)
+    {
+        conn->congestion_threshold = config_fuse_congestion_threshold(config);
+    }
+#endif /* FUSE_VERSION >= 29 */
+
+    method_trace("want: %#x of %#x, max_readahead: %u\n",
+                 conn->want, conn->capable, conn->max_readahead);
+
     ctxt->indexnodes = indexnodes_new();
 
+    config_reader_delete(config);
+
     method_trace_dedent();
 
 
@@ -13,6 +13,7 @@
 #include "common.h"
 
 #include <errno.h>
+#include <string.h>
 
 #include "direntry.h"
 #include "fuse_methods.h"
@@ -41,16 +42,28 @@ void fsfuse_lookup (fuse_req_t req,
 
     if (!rc)
     {
+        /* The kernel can now ask for it by inode, until it forget()s it. This
+         * can move its inode, so comes first. */
+        direntry_looked_up(de);
+
         direntry_de2fuse_entry(de, &entry);
-        entry.attr_timeout = 1.0;
-        entry.entry_timeout = 1.0;
+        entry.attr_timeout = direntry_get_attr_timeout(de);
+        entry.entry_timeout = direntry_get_entry_timeout(de);
+        direntry_delete(CALLER_INFO de);
+    }
+    else if (rc == ENOENT && direntry_get_negative_timeout())
+    {
+        /* An entry with no inode tells the kernel to remember that there's
+         * nothing there, so that it doesn't ask again for a while */
+        memset(&entry, 0, sizeof(entry));
+        entry.ino = 0;
+        entry.entry_timeout = direntry_get_negative_timeout();
+        rc = 0;
     }
 
     method_trace_dedent();
 
 
-    /* Don't delete the de, as the success branch usurps the copy to be owned by
-     * the looked-up file, and the error branch doesn't have a de to delete */
     if (!rc)
     {
         assert(!fuse_reply_entry(req, &entry));
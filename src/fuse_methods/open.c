@@ -42,8 +42,13 @@ void fsfuse_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
         {
             open_file_ctxt_t *ctxt = malloc( sizeof(*ctxt) );
             ctxt->de = de;
+            ctxt->hash = direntry_get_hash( de );
             ctxt->downloader = downloader_new( de );
             fi->fh = (typeof(fi->fh))ctxt;
+
+            /* A file's content is fixed by its hash, so if that's the same as
+             * last time then so is whatever the kernel's cached of it */
+            fi->keep_cache = direntry_opened(de);
         }
     }
 
@@ -13,6 +13,7 @@
 #include "common.h"
 
 #include <errno.h>
+#include <stdlib.h>
 
 #include "fuse_methods.h"
 #include "trace.h"
@@ -40,14 +41,24 @@ void fsfuse_opendir (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
         if ((fi->flags & 3) != O_RDONLY)                     rc = EROFS;
         if (direntry_get_type(de) != listing_type_DIRECTORY) rc = ENOTDIR;
 
-        fi->fh = (typeof(fi->fh))de;
+        if (!rc)
+        {
+            open_dir_ctxt_t *ctxt = malloc(sizeof(*ctxt));
+            ctxt->de = de;
+            ctxt->entries = NULL;
+            ctxt->entries_count = 0;
+            fi->fh = (typeof(fi->fh))ctxt;
+        }
+        else
+        {
+            direntry_delete(CALLER_INFO de);
+        }
     }
 
     method_trace_dedent();
 
 
-    /* Don't delete the de, as the success branch usurps the copy to be owned by
-     * the open directory, and the error branch doesn't have a de to delete */
+    /* The success branch usurps the de to be owned by the open directory */
     if (!rc)
     {
         assert(!fuse_reply_open(req, fi));
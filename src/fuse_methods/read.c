@@ -15,9 +15,11 @@
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #include "locks.h"
 #include "fuse_methods.h"
+#include "block_cache.h"
 #include "direntry.h"
 #include "downloader.h"
 
@@ -25,16 +27,27 @@
 TRACE_DEFINE(read)
 
 
+/* Enough for any read() the kernel sends (at most max_read, usually 128KiB) to
+ * be served from the blocks in place, with room to spare */
+#define READ_SPANS_MAX 8
+
+
 typedef struct
 {
     direntry_t *de;
     fuse_req_t req;
     size_t size; /* requested size */
-    void *buf;
+    block_cache_span_t spans[READ_SPANS_MAX]; /* the start, from the cache */
+    unsigned spans_count;
+    size_t held; /* bytes in spans */
+    size_t copied; /* bytes at the start of buf that came from the cache */
+    char *buf; /* the rest */
 } read_context_t;
 
 
 static void chunk_done (void *read_ctxt, int rc, size_t size);
+static void reply_data (read_context_t *ctxt, size_t len);
+static void read_context_teardown (read_context_t *ctxt);
 
 
 /* MUST return as many bytes as were asked for, unless error or EOF.
@@ -75,8 +88,9 @@ void fsfuse_read (fuse_req_t req,
                   struct fuse_file_info *fi)
 {
     open_file_ctxt_t *ctxt = (open_file_ctxt_t *)fi->fh;
-    read_context_t *read_ctxt = (read_context_t *)calloc(sizeof(read_context_t), 1);
-    void *buf;
+    read_context_t local, *read_ctxt;
+    size_t rest;
+    unsigned i;
 
 
     NOT_USED(ino);
@@ -99,14 +113,44 @@ void fsfuse_read (fuse_req_t req,
         size = direntry_get_size(ctxt->de) - off;
     }
 
-    buf = malloc(size);
+    local.req  = req;
+    local.size = size;
+
+    /* Whatever's in the cache doesn't need downloading. What's in memory is
+     * replied with where it is; anything after that which is only on disk has
+     * to be read in, along with whatever needs downloading. */
+    local.spans_count = block_cache_get(ctxt->hash, off, size, local.spans, READ_SPANS_MAX);
+    for (i = 0, local.held = 0; i < local.spans_count; i++) local.held += local.spans[i].len;
+
+    rest = size - local.held;
+    local.buf = rest ? malloc(rest) : NULL;
+    local.copied = rest ? block_cache_read(ctxt->hash, off + local.held, rest, local.buf) : 0;
 
-    read_ctxt->req  = req;
-    read_ctxt->de   = ctxt->de;
-    read_ctxt->size = size;
-    read_ctxt->buf  = buf;
+    /* The downloader won't see this much, so tell it, or it'll think the next
+     * read is a seek and throw away what it's read ahead */
+    if (local.held + local.copied)
+    {
+        downloader_note_read(ctxt->downloader, off, off + local.held + local.copied);
+    }
 
-    downloader_chunk_add(ctxt->downloader, off, off + size, buf, &chunk_done, (void *)read_ctxt);
+    if (size && local.copied == rest)
+    {
+        read_trace("served from the block cache\n");
+
+        local.de = NULL;
+        reply_data(&local, local.copied);
+        read_context_teardown(&local);
+    }
+    else
+    {
+        read_ctxt = (read_context_t *)malloc(sizeof(read_context_t));
+        *read_ctxt = local;
+        read_ctxt->de = direntry_copy(CALLER_INFO ctxt->de);
+
+        downloader_chunk_add(ctxt->downloader,
+                             off + local.held + local.copied, off + size,
+                             read_ctxt->buf + local.copied, &chunk_done, (void *)read_ctxt);
+    }
 
     method_trace_dedent();
 }
@@ -118,7 +162,9 @@ static void chunk_done (void *read_ctxt, int rc, size_t size)
     read_context_t *ctxt = (read_context_t *)read_ctxt;
 
 
-    if (size != ctxt->size)
+    size += ctxt->copied;
+
+    if (ctxt->held + size != ctxt->size)
     {
         read_trace("bytes read != request size => EOF / error\n");
     }
@@ -145,14 +191,46 @@ static void chunk_done (void *read_ctxt, int rc, size_t size)
 
     if (!rc)
     {
-        assert(!fuse_reply_buf(ctxt->req, ctxt->buf, size));
+        reply_data(ctxt, size);
     }
     else
     {
         assert(!fuse_reply_err(ctxt->req, rc));
     }
 
-    direntry_delete(CALLER_INFO ctxt->de);
-    free(ctxt->buf);
+    read_context_teardown(ctxt);
     free(read_ctxt);
 }
+
+/* Replies with the spans from the cache followed by the first <len> bytes of
+ * buf, without copying any of it here: the writev() copies it into the kernel,
+ * once, from where it is.
+ * Splicing (fuse_reply_data()) wouldn't save that copy. libfuse only splices
+ * buffers that are fds, and falls back to gathering memory buffers into one
+ * more malloc()ed buffer first. */
+static void reply_data (read_context_t *ctxt, size_t len)
+{
+    struct iovec iov[READ_SPANS_MAX + 1];
+    unsigned count = 0, i;
+
+
+    for (i = 0; i < ctxt->spans_count; i++)
+    {
+        iov[count].iov_base = (void *)ctxt->spans[i].data;
+        iov[count++].iov_len = ctxt->spans[i].len;
+    }
+    if (len)
+    {
+        iov[count].iov_base = ctxt->buf;
+        iov[count++].iov_len = len;
+    }
+
+    assert(!fuse_reply_iov(ctxt->req, iov, count));
+}
+
+static void read_context_teardown (read_context_t *ctxt)
+{
+    block_cache_release(ctxt->spans, ctxt->spans_count);
+    free(ctxt->buf);
+    if (ctxt->de) direntry_delete(CALLER_INFO ctxt->de);
+}
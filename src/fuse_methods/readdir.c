@@ -7,7 +7,11 @@
  * (at your option) any later version.
  *
  *
- * readdir() implementation.
+ * readdir() and readdirplus() implementations.
+ * The open directory holds a snapshot of its entries - ".", ".." and then the
+ * children - taken by the readdir() at offset 0. Offsets are indices into that,
+ * so each call serialises only the entries it returns, straight into a buffer
+ * of the size asked for, rather than the whole directory every time.
  */
 
 #include "common.h"
@@ -18,107 +22,261 @@
 
 #include "direntry.h"
 #include "fuse_methods.h"
+#include "string_pool.h"
 
 
-/* from fuse_lowlevel.h:
- * "From the 'stbuf' argument the st_ino field and bits 12-15 of the st_mode
- * field are used.  The other fields are ignored".
- * Bytes 12-15 are 010000 - 0100000 (0x1000 - 0x8000) which represent node type
- * (file / dir / etc). Mode flags are ignored.
- */
+#define SNAPSHOT_SIZE_MIN 16
 
-static void dirbuf_add (
-    fuse_req_t req,
-    char **buf,
-    size_t *size,
-    direntry_t *de,
-    const char *name
-)
+
+typedef struct
 {
-    struct stat stats;
-    size_t old_size = *size;
+    fuse_req_t req;
+    open_dir_ctxt_t *dir;
+    size_t size;
+    off_t off;
+    int plus;
+} readdir_ctxt_t;
 
 
-    name = name ? name : direntry_get_name(de);
+void open_dir_snapshot_release (open_dir_ctxt_t *dir)
+{
+    unsigned i;
 
-    /* Saw this trick (to determine, a priori, the exact size this entry will
-     * need) in the fuse_lowlevel example. If it stops working, go back to
-     * standard: try, compare return to remaining size, realloc up by MOD on
-     * fail. */
-    *size += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
-    *buf = realloc(*buf, *size);
 
-    direntry_de2stat(de, &stats);
-    fuse_add_direntry(req, *buf + old_size, *size - old_size, name, &stats, *size);
+    for (i = 0; i < dir->entries_count; i++)
+    {
+        direntry_delete(CALLER_INFO dir->entries[i]);
+    }
+    free(dir->entries);
 
-    method_trace("dirbuf_adding: inode %lu \"%s\" at %zu size %zu buf size %zu\n",
-        stats.st_ino, name, old_size, *size - old_size, *size);
+    dir->entries = NULL;
+    dir->entries_count = 0;
 }
 
-/* The FUSE docs assert that readdir() will only be called on existing, valid
- * directories, so there's no need to check for the existence / type of the
- * direntry at path
- */
-void fsfuse_readdir (fuse_req_t req,
-                     fuse_ino_t ino,
-                     size_t size,
-                     off_t off,
-                     struct fuse_file_info *fi)
+static void snapshot_take (open_dir_ctxt_t *dir)
 {
-    direntry_t *de = (direntry_t *)fi->fh,
-               *parent, *child, *old_child;
-    char *buf = NULL; size_t bufsize = 0;
-
+    direntry_t *parent, *child;
+    unsigned size = SNAPSHOT_SIZE_MIN;
 
-    NOT_USED(ino);
-    NOT_USED(size);
-    NOT_USED(off);
-
-    method_trace("fsfuse_readir(ino %lu, size %zu, offset %lu)\n", ino, size, off);
-    method_trace_indent();
 
+    open_dir_snapshot_release(dir);
 
-    dirbuf_add(req, &buf, &bufsize, de, ".");
+    dir->entries = malloc(size * sizeof(*dir->entries));
 
     /* TODO: we always used to use NULL struct stat for "." and ".." and got
      * away with it fine. We could consider carrying on doing that here, as
      * fetching them could be a pita. Nativefs should just hide this though -
      * you ask it for the parenty of a de and it either fetches it or hands it
      * to you from the cache. */
-    parent = direntry_get_parent(de);
+    parent = direntry_get_parent(dir->de);
+    dir->entries[0] = direntry_copy(CALLER_INFO dir->de);
+    dir->entries[1] = parent ? parent : direntry_copy(CALLER_INFO dir->de);
+    dir->entries_count = 2;
 
-    if (parent)
+    /* The snapshot usurps each child */
+    child = direntry_get_first_child(dir->de);
+    while (child)
     {
-        dirbuf_add(req, &buf, &bufsize, parent, "..");
-        direntry_delete(CALLER_INFO parent);
+        if (dir->entries_count == size)
+        {
+            size *= 2;
+            dir->entries = realloc(dir->entries, size * sizeof(*dir->entries));
+        }
+        dir->entries[dir->entries_count++] = child;
+
+        child = direntry_get_next_sibling(child);
     }
-    else
+}
+
+static const char *entry_name (readdir_ctxt_t *ctxt, off_t i, const char **own_name)
+{
+    *own_name = NULL;
+
+    if (i == 0) return ".";
+    if (i == 1) return "..";
+
+
+    return *own_name = direntry_get_name(ctxt->dir->entries[i]);
+}
+
+/* from fuse_lowlevel.h:
+ * "From the 'stbuf' argument the st_ino field and bits 12-15 of the st_mode
+ * field are used.  The other fields are ignored".
+ * Bytes 12-15 are 010000 - 0100000 (0x1000 - 0x8000) which represent node type
+ * (file / dir / etc). Mode flags are ignored.
+ */
+
+/* Adds entry <i> of the snapshot to <buf> if it fits. Returns the size it
+ * needs either way, like fuse_add_direntry(). */
+static size_t dirbuf_add (readdir_ctxt_t *ctxt, char *buf, size_t bufsize, off_t i)
+{
+    direntry_t *de = ctxt->dir->entries[i];
+    struct stat stats;
+    const char *own_name;
+    const char *name = entry_name(ctxt, i, &own_name);
+    size_t entry_size;
+
+
+    direntry_de2stat(de, &stats);
+    entry_size = fuse_add_direntry(ctxt->req, buf, bufsize, name, &stats, i + 1);
+
+    method_trace("dirbuf_adding: inode %lu \"%s\" at %ld size %zu\n",
+        stats.st_ino, name, i, entry_size);
+
+    string_pool_release(own_name);
+
+
+    return entry_size;
+}
+
+#if FUSE_USE_VERSION >= 30
+/* readdirplus() gives the kernel each child's attributes along with its name,
+ * so that an "ls -l" doesn't have to look each one up and getattr() it
+ * afterwards. Every child that makes it into the reply counts as a lookup() of
+ * it (the kernel doesn't count "." and ".."), so each one's accounted for once
+ * we know it fits. */
+static size_t dirbuf_add_plus (readdir_ctxt_t *ctxt, char *buf, size_t bufsize, off_t i)
+{
+    direntry_t *de = ctxt->dir->entries[i];
+    struct fuse_entry_param entry;
+    const char *own_name;
+    const char *name = entry_name(ctxt, i, &own_name);
+    size_t entry_size;
+
+
+    entry_size = fuse_add_direntry_plus(ctxt->req, NULL, 0, name, NULL, 0);
+
+    if (entry_size <= bufsize)
     {
-        dirbuf_add(req, &buf, &bufsize, de, "..");
+        /* Can move its inode, so comes first */
+        if (i > 1) direntry_looked_up(de);
+
+        memset(&entry, 0, sizeof(entry));
+        direntry_de2fuse_entry(de, &entry);
+        entry.attr_timeout = direntry_get_attr_timeout(de);
+        entry.entry_timeout = direntry_get_entry_timeout(de);
+
+        fuse_add_direntry_plus(ctxt->req, buf, bufsize, name, &entry, i + 1);
+
+        method_trace("dirbuf_adding_plus: inode %lu \"%s\" at %ld size %zu\n",
+            entry.ino, name, i, entry_size);
     }
 
-    direntry_ensure_children(de);
-    child = direntry_get_first_child(de);
-    while (child)
+    string_pool_release(own_name);
+
+
+    return entry_size;
+}
+#endif /* FUSE_USE_VERSION >= 30 */
+
+static size_t entry_add (readdir_ctxt_t *ctxt, char *buf, size_t bufsize, off_t i)
+{
+#if FUSE_USE_VERSION >= 30
+    if (ctxt->plus) return dirbuf_add_plus(ctxt, buf, bufsize, i);
+#endif /* FUSE_USE_VERSION >= 30 */
+
+    return dirbuf_add(ctxt, buf, bufsize, i);
+}
+
+/* Replies with as many whole entries from <off> as fit in <size> */
+static void reply_from_snapshot (readdir_ctxt_t *ctxt)
+{
+    char *buf = malloc(ctxt->size);
+    size_t used = 0, entry_size;
+    off_t i;
+
+
+    method_trace_indent();
+
+    for (i = ctxt->off; i < (off_t)ctxt->dir->entries_count; i++)
     {
-        dirbuf_add(req, &buf, &bufsize, child, NULL);
+        entry_size = entry_add(ctxt, buf + used, ctxt->size - used, i);
+        if (entry_size > ctxt->size - used) break;
 
-        old_child = child;
-        child = direntry_get_next_sibling(child);
-        direntry_delete(CALLER_INFO old_child);
+        used += entry_size;
     }
 
     method_trace_dedent();
 
 
-    if ((unsigned)off < bufsize)
+    assert(!fuse_reply_buf(ctxt->req, buf, used));
+
+    free(buf);
+    free(ctxt);
+}
+
+/* EXECUTES IN THREAD: fetcher, or the calling fuse one */
+static void children_ready (void *ctxt_void, int rc)
+{
+    readdir_ctxt_t *ctxt = (readdir_ctxt_t *)ctxt_void;
+
+
+    /* A directory we couldn't list is still listed, just empty */
+    NOT_USED(rc);
+
+    snapshot_take(ctxt->dir);
+
+    reply_from_snapshot(ctxt);
+}
+
+/* The kernel doesn't issue concurrent readdir()s on the same open directory,
+ * so the snapshot needs no lock of its own */
+static void readdir_common (fuse_req_t req,
+                            size_t size,
+                            off_t off,
+                            struct fuse_file_info *fi,
+                            int plus)
+{
+    readdir_ctxt_t *ctxt = malloc(sizeof(*ctxt));
+
+
+    ctxt->req  = req;
+    ctxt->dir  = (open_dir_ctxt_t *)fi->fh;
+    ctxt->size = size;
+    ctxt->off  = off;
+    ctxt->plus = plus;
+
+    /* Reading from the start - the first time, or after a rewinddir() - sees
+     * the directory as it is now. The rest happens once we've got the
+     * children, which might be on a fetcher thread. */
+    if (!off || !ctxt->dir->entries)
     {
-        assert(!fuse_reply_buf(req, buf + off, MIN(bufsize - off, size)));
+        direntry_ensure_children_async(ctxt->dir->de, &children_ready, ctxt);
     }
     else
     {
-        assert(!fuse_reply_buf(req, NULL, 0));
+        reply_from_snapshot(ctxt);
     }
+}
 
-    free(buf);
+/* The FUSE docs assert that readdir() will only be called on existing, valid
+ * directories, so there's no need to check for the existence / type of the
+ * direntry at path
+ */
+void fsfuse_readdir (fuse_req_t req,
+                     fuse_ino_t ino,
+                     size_t size,
+                     off_t off,
+                     struct fuse_file_info *fi)
+{
+    NOT_USED(ino);
+
+    method_trace("fsfuse_readir(ino %lu, size %zu, offset %lu)\n", ino, size, off);
+
+    readdir_common(req, size, off, fi, 0);
+}
+
+#if FUSE_USE_VERSION >= 30
+void fsfuse_readdirplus (fuse_req_t req,
+                         fuse_ino_t ino,
+                         size_t size,
+                         off_t off,
+                         struct fuse_file_info *fi)
+{
+    NOT_USED(ino);
+
+    method_trace("fsfuse_readirplus(ino %lu, size %zu, offset %lu)\n", ino, size, off);
+
+    readdir_common(req, size, off, fi, 1);
 }
+#endif /* FUSE_USE_VERSION >= 30 */
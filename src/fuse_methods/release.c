@@ -17,6 +17,7 @@
 
 #include "direntry.h"
 #include "fuse_methods.h"
+#include "string_pool.h"
 #include "trace.h"
 
 
@@ -43,12 +44,12 @@ void fsfuse_release (fuse_req_t req,
     method_trace("fsfuse_release(ino %lu)\n", ino);
     method_trace_indent();
 
-    /* Delete our copy, and the one taken by open() */
-    direntry_delete(CALLER_INFO ctxt->de);
+    /* Delete the copy taken by open(); read()s hold their own */
     direntry_delete(CALLER_INFO ctxt->de);
 
-    //downloader_delete( ctxt->downloader ); TODO when this is public
+    downloader_delete(ctxt->downloader);
 
+    string_pool_release(ctxt->hash);
     free(ctxt);
 
     method_trace_dedent();
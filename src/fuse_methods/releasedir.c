@@ -13,6 +13,7 @@
 #include "common.h"
 
 #include <errno.h>
+#include <stdlib.h>
 
 #include "direntry.h"
 #include "fuse_methods.h"
@@ -28,7 +29,7 @@ void fsfuse_releasedir (fuse_req_t req,
                         fuse_ino_t ino,
                         struct fuse_file_info *fi)
 {
-    direntry_t *de = (direntry_t *)fi->fh;
+    open_dir_ctxt_t *ctxt = (open_dir_ctxt_t *)fi->fh;
 
 
     NOT_USED(ino);
@@ -36,9 +37,10 @@ void fsfuse_releasedir (fuse_req_t req,
     method_trace("fsfuse_releasedir(ino %lu)\n", ino);
     method_trace_indent();
 
-    /* Delete our copy, and the one taken by opendir() */
-    direntry_delete(CALLER_INFO de);
-    direntry_delete(CALLER_INFO de);
+    /* Delete the snapshot, and the copy taken by opendir() */
+    open_dir_snapshot_release(ctxt);
+    direntry_delete(CALLER_INFO ctxt->de);
+    free(ctxt);
 
     method_trace_dedent();
 
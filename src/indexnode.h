@@ -19,6 +19,7 @@ TRACE_DECLARE(indexnode)
 typedef struct _indexnode_t indexnode_t;
 
 typedef void (*indexnode_stats_cb_t)( void *ctxt, unsigned long files, unsigned long bytes );
+typedef void (*indexnode_done_cb_t)( void *ctxt, int rc );
 
 
 extern indexnode_t *indexnode_new(
@@ -33,11 +34,15 @@ extern indexnode_t *indexnode_copy( CALLER_DECL indexnode_t *in);
 extern void indexnode_delete( CALLER_DECL indexnode_t *in );
 
 extern int indexnode_equals( indexnode_t *in, const char *id );
+extern char *indexnode_get_id( indexnode_t *in );
 
 extern char *indexnode_tostring( indexnode_t *in );
 
-extern int indexnode_tryget_listing( indexnode_t *in, const char *path, nativefs_entry_found_cb_t entry_cb, void *entry_ctxt );
-extern int indexnode_tryget_alternatives( indexnode_t *in, char *hash, nativefs_entry_found_cb_t entry_cb, void *entry_ctxt );
-extern int indexnode_tryget_stats( indexnode_t *in, indexnode_stats_cb_t stats_cb, void *stats_ctxt );
+/* These return straight away. The results are passed to the entry / stats
+ * callback as they're parsed, then done_cb is called with the fetcher's rc.
+ * All of the callbacks are given <ctxt>, and run on a fetcher thread. */
+extern void indexnode_get_listing_async( indexnode_t *in, const char *path, nativefs_entry_found_cb_t entry_cb, indexnode_done_cb_t done_cb, void *ctxt );
+extern void indexnode_get_alternatives_async( indexnode_t *in, char *hash, nativefs_entry_found_cb_t entry_cb, indexnode_done_cb_t done_cb, void *ctxt );
+extern void indexnode_get_stats_async( indexnode_t *in, indexnode_stats_cb_t stats_cb, indexnode_done_cb_t done_cb, void *ctxt );
 
 #endif /* _INCLUDED_INDEXNODE_H */
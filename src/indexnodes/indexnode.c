@@ -43,7 +43,7 @@ struct _indexnode_t
 {
     proto_indexnode_t pin;
 
-    ref_count_t *ref_count;
+    ref_count_t ref_count;
 
     const char *version;
     const char *id;
@@ -80,7 +80,7 @@ indexnode_t *indexnode_new(
 
         proto_indexnode_init( BASE_CLASS(in), host, port );
 
-        in->ref_count = ref_count_new( );
+        ref_count_init( &in->ref_count );
 
         in->version          = version;
         in->id               = id;
@@ -105,7 +105,7 @@ indexnode_t *indexnode_new(
 
 indexnode_t *indexnode_copy( CALLER_DECL indexnode_t *in )
 {
-    unsigned refc = ref_count_inc( in->ref_count );
+    unsigned refc = ref_count_inc( &in->ref_count );
 
 
     NOT_USED(refc);
@@ -118,12 +118,10 @@ indexnode_t *indexnode_copy( CALLER_DECL indexnode_t *in )
 
 void indexnode_delete( CALLER_DECL indexnode_t *in )
 {
-    unsigned refc = ref_count_dec( in->ref_count );
+    unsigned refc = ref_count_dec( &in->ref_count );
 
-    /* This should go in the dec method, which should take the logger (which can
-     * be queried for class_name, or know how to log a delete). This way it can
-     * be done under the lock (at least copy the data out under the lock - file
-     * IO under the lock is not clever) */
+    /* The count traced is the one our dec left, whatever other threads have
+     * done since, so no lock is needed to make the trace consistent */
     indexnode_trace("[indexnode @%p] delete (" CALLER_FORMAT ") ref %u\n",
                      in, CALLER_PASS refc);
     indexnode_trace_indent();
@@ -132,8 +130,6 @@ void indexnode_delete( CALLER_DECL indexnode_t *in )
     {
         indexnode_trace("refcount == 0 => free()ing\n");
 
-        ref_count_delete( in->ref_count );
-
         proto_indexnode_teardown( BASE_CLASS(in) );
         free_const( in->version );
         free_const( in->id );
@@ -149,6 +145,11 @@ int indexnode_equals( indexnode_t *in, const char *id )
     return !strcmp( in->id, id );
 }
 
+char *indexnode_get_id( indexnode_t *in )
+{
+    return strdup( in->id );
+}
+
 char *indexnode_tostring( indexnode_t *in )
 {
     string_buffer_t *sb = string_buffer_new( );
@@ -183,68 +184,92 @@ int indexnode_still_valid( const indexnode_t *in )
     return ret;
 }
 
-int indexnode_tryget_listing( indexnode_t *in, const char *path, nativefs_entry_found_cb_t entry_cb, void *entry_ctxt )
+typedef void (*parser_delete_t)( void *parser );
+
+typedef struct
+{
+    fetcher_t *fetcher;
+    void *parser;
+    parser_delete_t parser_delete;
+    indexnode_done_cb_t done_cb;
+    void *done_ctxt;
+} fetch_ctxt_t;
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void fetch_done( void *ctxt_void, int rc )
 {
-    const char *url = proto_indexnode_make_url( BASE_CLASS(in), strdup( "browse" ), path );
-    fetcher_t *fetcher = fetcher_new( url );
-    parser_filelist_t *parser = parser_filelist_new( entry_cb, entry_ctxt );
-    int rc;
+    fetch_ctxt_t *ctxt = (fetch_ctxt_t *)ctxt_void;
 
 
-    rc = fetcher_fetch_body(
-        fetcher,
-        (fetcher_body_cb_t)&parser_filelist_consume,
-        (void *)parser,
-        NULL
-    );
-
+    ctxt->parser_delete( ctxt->parser );
+    fetcher_delete( ctxt->fetcher );
 
-    parser_filelist_delete( parser );
-    fetcher_delete( fetcher );
+    ctxt->done_cb( ctxt->done_ctxt, rc );
 
-    return rc;
+    free( ctxt );
 }
 
-int indexnode_tryget_alternatives( indexnode_t *in, char *hash, nativefs_entry_found_cb_t entry_cb, void *entry_ctxt )
+/* Fetches <url> (usurped) into <parser>, which is deleted when it's done */
+static void fetch_async(
+    const char *url,
+    fetcher_body_cb_t parser_consume,
+    void *parser,
+    parser_delete_t parser_delete,
+    indexnode_done_cb_t done_cb,
+    void *done_ctxt
+)
 {
-    const char *url = proto_indexnode_make_url( BASE_CLASS(in), strdup( "alternatives" ), hash );
-    fetcher_t *fetcher = fetcher_new( url );
-    parser_filelist_t *parser = parser_filelist_new( entry_cb, entry_ctxt );
-    int rc;
-
+    fetch_ctxt_t *ctxt = malloc( sizeof(*ctxt) );
+
+
+    ctxt->fetcher = fetcher_new( url );
+    ctxt->parser = parser;
+    ctxt->parser_delete = parser_delete;
+    ctxt->done_cb = done_cb;
+    ctxt->done_ctxt = done_ctxt;
+
+    fetcher_fetch_body_async(
+        ctxt->fetcher,
+        parser_consume,
+        parser,
+        NULL,
+        &fetch_done,
+        ctxt
+    );
+}
 
-    rc = fetcher_fetch_body(
-        fetcher,
+void indexnode_get_listing_async( indexnode_t *in, const char *path, nativefs_entry_found_cb_t entry_cb, indexnode_done_cb_t done_cb, void *ctxt )
+{
+    fetch_async(
+        proto_indexnode_make_url( BASE_CLASS(in), strdup( "browse" ), path ),
         (fetcher_body_cb_t)&parser_filelist_consume,
-        (void *)parser,
-        NULL
+        parser_filelist_new( entry_cb, ctxt ),
+        (parser_delete_t)&parser_filelist_delete,
+        done_cb,
+        ctxt
     );
-
-
-    parser_filelist_delete( parser );
-    fetcher_delete( fetcher );
-
-    return rc;
 }
 
-int indexnode_tryget_stats( indexnode_t *in, indexnode_stats_cb_t stats_cb, void *stats_ctxt )
+void indexnode_get_alternatives_async( indexnode_t *in, char *hash, nativefs_entry_found_cb_t entry_cb, indexnode_done_cb_t done_cb, void *ctxt )
 {
-    const char *url = proto_indexnode_make_url( BASE_CLASS(in), strdup( "stats" ), strdup( "" ) );
-    fetcher_t *fetcher = fetcher_new( url );
-    parser_stats_t *parser = parser_stats_new( stats_cb, stats_ctxt );
-    int rc;
-
+    fetch_async(
+        proto_indexnode_make_url( BASE_CLASS(in), strdup( "alternatives" ), hash ),
+        (fetcher_body_cb_t)&parser_filelist_consume,
+        parser_filelist_new( entry_cb, ctxt ),
+        (parser_delete_t)&parser_filelist_delete,
+        done_cb,
+        ctxt
+    );
+}
 
-    rc = fetcher_fetch_body(
-        fetcher,
+void indexnode_get_stats_async( indexnode_t *in, indexnode_stats_cb_t stats_cb, indexnode_done_cb_t done_cb, void *ctxt )
+{
+    fetch_async(
+        proto_indexnode_make_url( BASE_CLASS(in), strdup( "stats" ), strdup( "" ) ),
         (fetcher_body_cb_t)&parser_stats_consume,
-        (void *)parser,
-        NULL
+        parser_stats_new( stats_cb, ctxt ),
+        (parser_delete_t)&parser_stats_delete,
+        done_cb,
+        ctxt
     );
-
-
-    parser_stats_delete( parser );
-    fetcher_delete( fetcher );
-
-    return rc;
 }
@@ -11,11 +11,12 @@
  * This module spanws a thread that listens for indexnode broadcats and
  * maintains a list.
  * When a copy of the list is given out it only contains live indexnodes.
- * At the same time, this class gives up its copy of any dead indexnodes so that
- * they will eventually be free()d.
+ * This class gives up its own copy of any dead indexnodes, so that they will
+ * eventually be free()d, when it next adds one (getting a copy only has the
+ * list for reading, so can't).
  * This is done lazily, rather than pro-actively. Yes, this is a slight memory
- * leak if indexnodes die and no-one fetches the list for ages, but it saves a
- * load of complexity.
+ * leak if indexnodes die and no new ones turn up for ages, but it saves a load
+ * of complexity.
  */
 
 #include "common.h"
@@ -91,10 +92,11 @@ indexnodes_list_t *indexnodes_get (CALLER_DECL indexnodes_t *ins)
 
 
     rw_lock_rlock(ins->lock);
-    ins->list = indexnodes_list_remove_expired(CALLER_PASS ins->list);
     list = indexnodes_list_copy(CALLER_PASS ins->list);
     rw_lock_runlock(ins->lock);
 
+    list = indexnodes_list_remove_expired(CALLER_PASS list);
+
 
     return list;
 }
@@ -138,7 +140,11 @@ static void new_indexnode_event (
     {
         trace_info("Seen advert for indexnode %s at %s:%s (version %s)\n", id, host, port, version);
 
-        if ((found_in = indexnodes_list_find(CALLER_INFO ins->list, id)))
+        rw_lock_rlock(ins->lock);
+        found_in = indexnodes_list_find(CALLER_INFO ins->list, id);
+        rw_lock_runlock(ins->lock);
+
+        if (found_in)
         {
             indexnode_seen(found_in);
 
@@ -152,6 +158,7 @@ static void new_indexnode_event (
                 rw_lock_wlock(ins->lock);
 
                 /* If it's not been seen before, add it */
+                ins->list = indexnodes_list_remove_expired(CALLER_INFO ins->list);
                 indexnodes_list_add(ins->list, new_in);
 
                 rw_lock_wunlock(ins->lock);
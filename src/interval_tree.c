@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Interval tree.
+ * A binary search tree on the intervals' starts, where each node also knows the
+ * furthest end of anything beneath it, so that whole subtrees that finish
+ * before a range can be skipped when looking for overlaps.
+ * It's kept balanced as a treap: each node gets a random priority, and is
+ * rotated up above anything with a lower one.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+
+#include "interval_tree.h"
+
+
+struct _interval_node_t
+{
+    int64_t start;
+    int64_t end;
+    int64_t max_end; /* furthest end of this node and everything beneath it */
+    void *value;
+    unsigned priority;
+    interval_node_t *left, *right, *parent;
+};
+
+struct _interval_tree_t
+{
+    interval_node_t *root;
+    unsigned count;
+    unsigned seed;
+};
+
+
+interval_tree_t *interval_tree_new( void )
+{
+    interval_tree_t *tree = calloc( 1, sizeof(*tree) );
+
+
+    tree->seed = 2463534242u;
+
+
+    return tree;
+}
+
+void interval_tree_delete( interval_tree_t *tree )
+{
+    assert( tree->count == 0 );
+
+    free( tree );
+}
+
+/* xorshift; all we need is for the priorities not to follow the keys */
+static unsigned next_priority( interval_tree_t *tree )
+{
+    tree->seed ^= tree->seed << 13;
+    tree->seed ^= tree->seed >> 17;
+    tree->seed ^= tree->seed << 5;
+
+
+    return tree->seed;
+}
+
+static void update_max_end( interval_node_t *node )
+{
+    node->max_end = node->end;
+    if( node->left  ) node->max_end = MAX( node->max_end, node->left->max_end );
+    if( node->right ) node->max_end = MAX( node->max_end, node->right->max_end );
+}
+
+/* Moves the node up above its parent, keeping the order */
+static void rotate_up( interval_tree_t *tree, interval_node_t *node )
+{
+    interval_node_t *parent = node->parent, *grandparent = parent->parent;
+
+
+    if( node == parent->left )
+    {
+        parent->left = node->right;
+        if( node->right ) node->right->parent = parent;
+        node->right = parent;
+    }
+    else
+    {
+        parent->right = node->left;
+        if( node->left ) node->left->parent = parent;
+        node->left = parent;
+    }
+    parent->parent = node;
+    node->parent = grandparent;
+
+    if( !grandparent )
+    {
+        tree->root = node;
+    }
+    else if( grandparent->left == parent )
+    {
+        grandparent->left = node;
+    }
+    else
+    {
+        grandparent->right = node;
+    }
+
+    update_max_end( parent );
+    update_max_end( node );
+}
+
+interval_node_t *interval_tree_add( interval_tree_t *tree, int64_t start, int64_t end, void *value )
+{
+    interval_node_t *node = calloc( 1, sizeof(*node) ), *parent = NULL, **link = &tree->root;
+
+
+    assert( start <= end );
+
+    node->start = start;
+    node->end = end;
+    node->max_end = end;
+    node->value = value;
+    node->priority = next_priority( tree );
+
+    /* Equal starts go to the right, so that they come out in order */
+    while( *link )
+    {
+        parent = *link;
+        parent->max_end = MAX( parent->max_end, end );
+        link = (start < parent->start) ? &parent->left : &parent->right;
+    }
+    *link = node;
+    node->parent = parent;
+
+    while( node->parent && node->priority > node->parent->priority )
+    {
+        rotate_up( tree, node );
+    }
+
+    tree->count++;
+
+
+    return node;
+}
+
+void *interval_tree_remove( interval_tree_t *tree, interval_node_t *node )
+{
+    interval_node_t *child, *parent;
+    void *value = node->value;
+
+
+    /* Rotate it down until it's a leaf, then cut it off */
+    while( node->left || node->right )
+    {
+        if( !node->left )
+        {
+            child = node->right;
+        }
+        else if( !node->right )
+        {
+            child = node->left;
+        }
+        else
+        {
+            child = (node->left->priority > node->right->priority) ? node->left : node->right;
+        }
+
+        rotate_up( tree, child );
+    }
+
+    parent = node->parent;
+    if( !parent )
+    {
+        tree->root = NULL;
+    }
+    else if( parent->left == node )
+    {
+        parent->left = NULL;
+    }
+    else
+    {
+        parent->right = NULL;
+    }
+
+    for( ; parent; parent = parent->parent )
+    {
+        update_max_end( parent );
+    }
+
+    free( node );
+    tree->count--;
+
+
+    return value;
+}
+
+unsigned interval_tree_get_count( interval_tree_t *tree )
+{
+    return tree->count;
+}
+
+static interval_node_t *leftmost( interval_node_t *node )
+{
+    while( node && node->left ) node = node->left;
+
+
+    return node;
+}
+
+interval_node_t *interval_tree_first( interval_tree_t *tree )
+{
+    return leftmost( tree->root );
+}
+
+interval_node_t *interval_tree_next( interval_node_t *node )
+{
+    if( node->right ) return leftmost( node->right );
+
+    while( node->parent && node == node->parent->right )
+    {
+        node = node->parent;
+    }
+
+
+    return node->parent;
+}
+
+static int overlaps( interval_node_t *node, int64_t start, int64_t end )
+{
+    return node->start < end &&
+           (node->end > start || node->start >= start);
+}
+
+/* The first node under <node> that overlaps [start, end) */
+static interval_node_t *search( interval_node_t *node, int64_t start, int64_t end )
+{
+    interval_node_t *found;
+
+
+    /* Nothing under here reaches the range (an empty interval right at its
+     * start still counts, hence not <=) */
+    if( !node || node->max_end < start ) return NULL;
+
+    if( (found = search( node->left, start, end )) ) return found;
+
+    /* Nothing from here rightwards starts before the range ends */
+    if( node->start >= end ) return NULL;
+
+    if( overlaps( node, start, end ) ) return node;
+
+
+    return search( node->right, start, end );
+}
+
+interval_node_t *interval_tree_first_overlap( interval_tree_t *tree, int64_t start, int64_t end )
+{
+    return search( tree->root, start, end );
+}
+
+interval_node_t *interval_tree_next_overlap( interval_node_t *node, int64_t start, int64_t end )
+{
+    interval_node_t *found, *parent;
+
+
+    if( (found = search( node->right, start, end )) ) return found;
+
+    /* Back up the tree; each parent we reach from the left comes next, and
+     * then its right subtree */
+    for( ; (parent = node->parent); node = parent )
+    {
+        if( node != parent->left ) continue;
+
+        if( parent->start >= end ) return NULL;
+        if( overlaps( parent, start, end ) ) return parent;
+        if( (found = search( parent->right, start, end )) ) return found;
+    }
+
+
+    return NULL;
+}
+
+int64_t interval_node_get_start( interval_node_t *node )
+{
+    return node->start;
+}
+
+int64_t interval_node_get_end( interval_node_t *node )
+{
+    return node->end;
+}
+
+void *interval_node_get_value( interval_node_t *node )
+{
+    return node->value;
+}
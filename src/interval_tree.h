@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Interval tree. Holds [start, end) intervals (with a value each), in order of
+ * start, and finds the ones that overlap a given range.
+ * Not thread-safe.
+ */
+
+#ifndef _INCLUDED_INTERVAL_TREE_H
+#define _INCLUDED_INTERVAL_TREE_H
+
+#include "common.h"
+
+#include <stdint.h>
+
+
+typedef struct _interval_tree_t interval_tree_t;
+typedef struct _interval_node_t interval_node_t;
+
+
+extern interval_tree_t *interval_tree_new( void );
+/* Must be empty */
+extern void interval_tree_delete( interval_tree_t *tree );
+
+/* Intervals with the same start come out in the order they went in */
+extern interval_node_t *interval_tree_add( interval_tree_t *tree, int64_t start, int64_t end, void *value );
+/* Returns the node's value */
+extern void *interval_tree_remove( interval_tree_t *tree, interval_node_t *node );
+extern unsigned interval_tree_get_count( interval_tree_t *tree );
+
+/* All of them, in order of start */
+extern interval_node_t *interval_tree_first( interval_tree_t *tree );
+extern interval_node_t *interval_tree_next( interval_node_t *node );
+
+/* The ones that overlap [start, end), in order of start. An empty interval
+ * counts as overlapping if it lies within [start, end). */
+extern interval_node_t *interval_tree_first_overlap( interval_tree_t *tree, int64_t start, int64_t end );
+extern interval_node_t *interval_tree_next_overlap( interval_node_t *node, int64_t start, int64_t end );
+
+extern int64_t interval_node_get_start( interval_node_t *node );
+extern int64_t interval_node_get_end( interval_node_t *node );
+extern void *interval_node_get_value( interval_node_t *node );
+
+#endif /* _INCLUDED_INTERVAL_TREE_H */
@@ -31,6 +31,11 @@ typedef enum
     listing_type_DIRECTORY
 } listing_type_t;
 
+typedef void (*listing_alternative_cb_t)( void *ctxt, int rc, listing_t *li_best );
+/* listing_list.h needs this header, so the list type can't be named here */
+struct _listing_list_t;
+typedef void (*listing_alternatives_cb_t)( void *ctxt, int rc, struct _listing_list_t *lis );
+
 
 #include "indexnode.h"
 
@@ -50,16 +55,25 @@ extern void listing_delete (CALLER_DECL listing_t *li);
 
 extern int listing_equal (listing_t *li, listing_t *other);
 
-extern char *          listing_get_name          (listing_t *li);
-extern char *          listing_get_hash          (listing_t *li);
+/* The name, hash and client are pooled (see string_pool.h) */
+extern const char *    listing_get_name          (listing_t *li);
+extern const char *    listing_get_hash          (listing_t *li);
 extern listing_type_t  listing_get_type          (listing_t *li);
 extern off_t           listing_get_size          (listing_t *li);
 extern unsigned long   listing_get_link_count    (listing_t *li);
 extern char *          listing_get_href          (listing_t *li);
-extern char *          listing_get_client        (listing_t *li);
+extern const char *    listing_get_client        (listing_t *li);
+/* <client> must be pooled */
+extern int             listing_is_from_client    (listing_t *li,
+                                                  const char *client);
 extern void            listing_li2stat           (listing_t *li,
                                                   struct stat *st);
 
-extern int listing_tryget_best_alternative( listing_t *li_reference, listing_t **li_best );
+/* Calls back, on a fetcher thread, with the best alternative to download
+ * <li_reference> from, or an error */
+extern void listing_get_best_alternative_async( listing_t *li_reference, listing_alternative_cb_t cb, void *cb_ctxt );
+/* Calls back, on a fetcher thread, with up to <max> alternatives to download
+ * <li_reference> from, best first, or an error */
+extern void listing_get_alternatives_async( listing_t *li_reference, unsigned max, listing_alternatives_cb_t cb, void *cb_ctxt );
 
 #endif /* _INCLUDED_LISTING_H */
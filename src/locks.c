@@ -8,10 +8,27 @@
  *
  *
  * Portable lock / mutex / semaphore implementation.
+ *
+ * rw_lock_t is a "big reader" lock. Readers count themselves in one of a set of
+ * slots, picked by thread, each on its own cache line, so readers on different
+ * CPUs don't fight over anything but a flag they only read. A writer raises the
+ * flag, and then waits for all the slots to empty. A reader that finds the flag
+ * up backs out and waits for the writer to finish, which is what stops a stream
+ * of readers starving writers. Readers only touch the mutex, which is for
+ * sleeping on, when there's a writer about.
+ * The flag and the counts are seq_cst, because each side writes its own and then
+ * reads the other's, and at least one of them has to see the other.
+ *
+ * What each thread holds of each lock is kept in a thread-specific value (as a
+ * number, so there's nothing to allocate or free):
+ *   bit 0          its read is counted in its slot
+ *   bits 1-15      how deep its write locks go
+ *   the rest       how deep its read locks go
  */
 
 #include <string.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/syscall.h>
@@ -19,26 +36,65 @@
 
 #include "common.h"
 #include "locks.h"
+#include "utils.h"
+
+
+#define CACHE_LINE 64
+#define SLOTS      64
+
+#define HELD_COUNTED     ((uintptr_t)1)
+#define HELD_WRITE_SHIFT 1
+#define HELD_WRITE_MASK  ((uintptr_t)0x7fff << HELD_WRITE_SHIFT)
+#define HELD_READ_SHIFT  16
+
+#define HELD_WRITES(h) (((h) & HELD_WRITE_MASK) >> HELD_WRITE_SHIFT)
+#define HELD_READS(h)  ((h) >> HELD_READ_SHIFT)
+#define HELD_WRITE     ((uintptr_t)1 << HELD_WRITE_SHIFT)
+#define HELD_READ      ((uintptr_t)1 << HELD_READ_SHIFT)
 
 
+typedef union
+{
+    unsigned readers;
+    char pad[CACHE_LINE];
+} slot_t;
+
 struct _rw_lock_t
 {
-    int readers_reading;
-    int writer_writing;
+    slot_t *slots;
+    int writing;
     pthread_mutex_t mutex;
-    pthread_cond_t lock_free;
-    pthread_t locking_thread;
+    pthread_cond_t readers_gone;
+    pthread_cond_t writer_gone;
+    pthread_key_t held;
 };
 
 
 rw_lock_t *rw_lock_new (void)
 {
     rw_lock_t *mutex = (rw_lock_t *)malloc(sizeof(*mutex));
+    void *slots;
 
 
     memset((void *)mutex, 0, sizeof(rw_lock_t));
+
+    if (posix_memalign(&slots, CACHE_LINE, SLOTS * sizeof(slot_t)))
+    {
+        free(mutex);
+        return NULL;
+    }
+    if (pthread_key_create(&(mutex->held), NULL))
+    {
+        free(slots);
+        free(mutex);
+        return NULL;
+    }
+    memset(slots, 0, SLOTS * sizeof(slot_t));
+    mutex->slots = (slot_t *)slots;
+
     pthread_mutex_init(&(mutex->mutex), NULL);
-    pthread_cond_init(&(mutex->lock_free), NULL);
+    pthread_cond_init(&(mutex->readers_gone), NULL);
+    pthread_cond_init(&(mutex->writer_gone), NULL);
 
 
     return mutex;
@@ -46,89 +102,163 @@ rw_lock_t *rw_lock_new (void)
 
 int rw_lock_delete (rw_lock_t *mutex)
 {
-    pthread_cond_destroy(&(mutex->lock_free));
+    pthread_key_delete(mutex->held);
+    pthread_cond_destroy(&(mutex->writer_gone));
+    pthread_cond_destroy(&(mutex->readers_gone));
     pthread_mutex_destroy(&(mutex->mutex));
 
+    free(mutex->slots);
     free(mutex);
 
 
     return 0;
 }
 
-int rw_lock_rlock (rw_lock_t *mutex)
+
+/* Innards ================================================================== */
+
+static uintptr_t held_get (rw_lock_t *mutex)
 {
-    if (mutex->locking_thread &&
-        pthread_equal(mutex->locking_thread, pthread_self()))
-    {
-        return 0;
-    }
+    return (uintptr_t)pthread_getspecific(mutex->held);
+}
 
-    pthread_mutex_lock(&(mutex->mutex));
+static void held_set (rw_lock_t *mutex, uintptr_t held)
+{
+    pthread_setspecific(mutex->held, (void *)held);
+}
 
-    while (mutex->writer_writing)
+static slot_t *slot_get (rw_lock_t *mutex)
+{
+    return &(mutex->slots[fsfuse_get_thread_index() % SLOTS]);
+}
+
+static unsigned readers_count (rw_lock_t *mutex)
+{
+    unsigned i, count = 0;
+
+
+    for (i = 0; i < SLOTS; i++)
     {
-        pthread_cond_wait(&(mutex->lock_free), &(mutex->mutex));
+        count += __atomic_load_n(&(mutex->slots[i].readers), __ATOMIC_SEQ_CST);
     }
-    mutex->readers_reading++;
 
-    mutex->locking_thread = pthread_self();
 
-    pthread_mutex_unlock(&(mutex->mutex));
+    return count;
+}
 
+static void slot_leave (rw_lock_t *mutex, slot_t *slot)
+{
+    __atomic_sub_fetch(&(slot->readers), 1, __ATOMIC_SEQ_CST);
 
-    return 0;
+    /* A writer might be waiting for us */
+    if (__atomic_load_n(&(mutex->writing), __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&(mutex->mutex));
+        pthread_cond_signal(&(mutex->readers_gone));
+        pthread_mutex_unlock(&(mutex->mutex));
+    }
 }
 
-int rw_lock_runlock (rw_lock_t *mutex)
+static void read_acquire (rw_lock_t *mutex)
 {
-    int rc;
+    slot_t *slot = slot_get(mutex);
+
 
+    for (;;)
+    {
+        __atomic_add_fetch(&(slot->readers), 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&(mutex->writing), __ATOMIC_SEQ_CST)) break;
+
+        /* Let the writer have it first */
+        slot_leave(mutex, slot);
 
+        pthread_mutex_lock(&(mutex->mutex));
+        while (mutex->writing)
+        {
+            pthread_cond_wait(&(mutex->writer_gone), &(mutex->mutex));
+        }
+        pthread_mutex_unlock(&(mutex->mutex));
+    }
+}
+
+static void write_acquire (rw_lock_t *mutex)
+{
     pthread_mutex_lock(&(mutex->mutex));
 
-    if (!mutex->readers_reading)
+    while (mutex->writing)
     {
-        rc = -1;
+        pthread_cond_wait(&(mutex->writer_gone), &(mutex->mutex));
     }
-    else
+    __atomic_store_n(&(mutex->writing), 1, __ATOMIC_SEQ_CST);
+
+    while (readers_count(mutex))
     {
-        mutex->readers_reading--;
-        if (!mutex->readers_reading)
-        {
-            pthread_cond_signal(&(mutex->lock_free));
+        pthread_cond_wait(&(mutex->readers_gone), &(mutex->mutex));
+    }
 
-            mutex->locking_thread = 0;
-        }
+    pthread_mutex_unlock(&(mutex->mutex));
+}
 
-        rc = 0;
-    }
+static void write_release (rw_lock_t *mutex)
+{
+    pthread_mutex_lock(&(mutex->mutex));
 
+    __atomic_store_n(&(mutex->writing), 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&(mutex->writer_gone));
 
     pthread_mutex_unlock(&(mutex->mutex));
+}
+
 
+/* Interface ================================================================ */
 
-    return rc;
+int rw_lock_rlock (rw_lock_t *mutex)
+{
+    uintptr_t held = held_get(mutex);
+
+
+    /* Already reading, or writing, which is as good */
+    if (!held) read_acquire(mutex);
+
+    held += HELD_READ;
+    if (!HELD_WRITES(held)) held |= HELD_COUNTED;
+    held_set(mutex, held);
+
+
+    return 0;
 }
 
-int rw_lock_wlock (rw_lock_t *mutex)
+int rw_lock_runlock (rw_lock_t *mutex)
 {
-    if (mutex->locking_thread &&
-        pthread_equal(mutex->locking_thread, pthread_self()))
-    {
-        return 0;
-    }
+    uintptr_t held = held_get(mutex);
 
-    pthread_mutex_lock(&(mutex->mutex));
 
-    while (mutex->writer_writing || mutex->readers_reading)
+    if (!HELD_READS(held)) return -1;
+
+    held -= HELD_READ;
+    if (!HELD_READS(held) && (held & HELD_COUNTED))
     {
-        pthread_cond_wait(&(mutex->lock_free), &(mutex->mutex));
+        slot_leave(mutex, slot_get(mutex));
+        held &= ~HELD_COUNTED;
     }
-    mutex->writer_writing++;
+    held_set(mutex, held);
 
-    mutex->locking_thread = pthread_self();
 
-    pthread_mutex_unlock(&(mutex->mutex));
+    return 0;
+}
+
+int rw_lock_wlock (rw_lock_t *mutex)
+{
+    uintptr_t held = held_get(mutex);
+
+
+    /* Waiting for ourself to stop reading would never end (nor would two
+     * readers waiting for each other) */
+    if (HELD_READS(held) && !HELD_WRITES(held)) return -1;
+
+    if (!held) write_acquire(mutex);
+
+    held_set(mutex, held + HELD_WRITE);
 
 
     return 0;
@@ -136,26 +266,25 @@ int rw_lock_wlock (rw_lock_t *mutex)
 
 int rw_lock_wunlock (rw_lock_t *mutex)
 {
-    int rc;
+    uintptr_t held = held_get(mutex);
 
 
-    pthread_mutex_lock(&(mutex->mutex));
+    if (!HELD_WRITES(held)) return -1;
 
-    if (!mutex->writer_writing)
-    {
-        rc = -1;
-    }
-    else
+    held -= HELD_WRITE;
+    if (!HELD_WRITES(held))
     {
-        mutex->writer_writing = 0;
-        pthread_cond_broadcast(&(mutex->lock_free));
-        rc = 0;
-        mutex->locking_thread = 0;
-    }
-
+        /* Still reading, so keep that, counted as a reader now */
+        if (HELD_READS(held))
+        {
+            __atomic_add_fetch(&(slot_get(mutex)->readers), 1, __ATOMIC_SEQ_CST);
+            held |= HELD_COUNTED;
+        }
 
-    pthread_mutex_unlock(&(mutex->mutex));
+        write_release(mutex);
+    }
+    held_set(mutex, held);
 
 
-    return rc;
+    return 0;
 }
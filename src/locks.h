@@ -10,6 +10,16 @@
 #include <pthread.h>
 
 
+/* A readers / writer lock for things that are read far more than they're
+ * written. Readers don't contend with each other, and a waiting writer holds
+ * off new readers, so it can't be starved.
+ * Both kinds of lock can be taken recursively, and a thread that's writing can
+ * take it for reading too. One that's only reading can't take it for writing:
+ * wlock() fails (-1) rather than deadlock. If a thread stops writing while it's
+ * still reading, it keeps its read lock. Unlocking what the thread doesn't
+ * have fails (-1).
+ * Uses a thread-specific data key per lock, and fsfuse_get_thread_index(), so
+ * utils_init() has to have been called. */
 typedef struct _rw_lock_t rw_lock_t;
 
 
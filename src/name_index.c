@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Name index.
+ * Open addressing with linear probing, in a power-of-two table that's kept no
+ * more than 3/4 full. Each slot holds the name's hash next to the value, so
+ * most slots that aren't the one we want are passed over without looking at
+ * the name at all. There's no removal; indices are built once and thrown away
+ * whole.
+ */
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "name_index.h"
+
+
+#define MIN_SLOTS 8
+
+
+typedef struct
+{
+    uint32_t hash;
+    void *value; /* NULL if the slot's empty */
+} slot_t;
+
+struct _name_index_t
+{
+    name_index_name_cb_t name_cb;
+    slot_t *slots;
+    unsigned size; /* always a power of two */
+    unsigned count;
+};
+
+
+static uint32_t name_hash( const char *name )
+{
+    uint32_t hash = 5381;
+
+
+    while( *name ) hash = (hash * 33) ^ (unsigned char)*name++;
+
+
+    return hash;
+}
+
+/* Spread the hash over the table; its low bits alone are a bit too regular */
+static unsigned slot_first( name_index_t *index, uint32_t hash )
+{
+    return (hash * UINT32_C(2654435769)) & (index->size - 1);
+}
+
+static void slots_alloc( name_index_t *index, unsigned count )
+{
+    unsigned size = MIN_SLOTS;
+
+
+    while( size / 4 * 3 < count ) size *= 2;
+
+    index->slots = calloc( size, sizeof(*index->slots) );
+    index->size = size;
+}
+
+name_index_t *name_index_new( unsigned count, name_index_name_cb_t name_cb )
+{
+    name_index_t *index = calloc( 1, sizeof(*index) );
+
+
+    index->name_cb = name_cb;
+    slots_alloc( index, count );
+
+
+    return index;
+}
+
+void name_index_delete( name_index_t *index )
+{
+    free( index->slots );
+    free( index );
+}
+
+/* Where <name> is, or the empty slot where it would go */
+static slot_t *slot_find( name_index_t *index, uint32_t hash, const char *name )
+{
+    unsigned i = slot_first( index, hash );
+    slot_t *slot;
+
+
+    for( ; ; i = (i + 1) & (index->size - 1) )
+    {
+        slot = &index->slots[ i ];
+
+        if( !slot->value ) break;
+        if( slot->hash == hash && !strcmp( index->name_cb( slot->value ), name ) ) break;
+    }
+
+
+    return slot;
+}
+
+static void grow( name_index_t *index )
+{
+    slot_t *old_slots = index->slots;
+    unsigned old_size = index->size, i;
+
+
+    slots_alloc( index, index->count + 1 );
+
+    for( i = 0; i < old_size; i++ )
+    {
+        if( old_slots[ i ].value )
+        {
+            *slot_find( index, old_slots[ i ].hash, index->name_cb( old_slots[ i ].value ) ) = old_slots[ i ];
+        }
+    }
+
+    free( old_slots );
+}
+
+void name_index_add( name_index_t *index, void *value )
+{
+    const char *name = index->name_cb( value );
+    uint32_t hash = name_hash( name );
+    slot_t *slot;
+
+
+    assert( value );
+
+    if( index->count + 1 > index->size / 4 * 3 ) grow( index );
+
+    slot = slot_find( index, hash, name );
+    if( !slot->value ) index->count++;
+
+    slot->hash = hash;
+    slot->value = value;
+}
+
+void *name_index_get( name_index_t *index, const char *name )
+{
+    return slot_find( index, name_hash( name ), name )->value;
+}
+
+unsigned name_index_get_count( name_index_t *index )
+{
+    return index->count;
+}
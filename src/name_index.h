@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Name index. A hash table from names to values, for finding things by name
+ * without walking a list of them. The names aren't copied: the index asks for
+ * a value's name when it needs it, so they have to stay put while the value's
+ * in the index.
+ * Not thread-safe.
+ */
+
+#ifndef _INCLUDED_NAME_INDEX_H
+#define _INCLUDED_NAME_INDEX_H
+
+#include "common.h"
+
+
+typedef struct _name_index_t name_index_t;
+
+typedef const char *(*name_index_name_cb_t)(void *value);
+
+
+/* <count> is roughly how many values are coming; it grows past that if need be */
+extern name_index_t *name_index_new( unsigned count, name_index_name_cb_t name_cb );
+extern void name_index_delete( name_index_t *index );
+
+/* A value with the same name as one that's already there replaces it */
+extern void name_index_add( name_index_t *index, void *value );
+/* NULL if there's nothing of that name */
+extern void *name_index_get( name_index_t *index, const char *name );
+extern unsigned name_index_get_count( name_index_t *index );
+
+#endif /* _INCLUDED_NAME_INDEX_H */
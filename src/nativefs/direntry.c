@@ -9,11 +9,43 @@
  *
  * This file deals with "direntries" - "entries in a directory". This is
  * basically our internal file system tree implementation.
+ *
+ * A directory's children are fetched from the indexnode the first time anyone
+ * wants them, and kept for timeouts/cache seconds. After that they're still
+ * served, but the first use also starts a fetch in the background. When that
+ * arrives the children are brought up to date rather than being replaced:
+ * anything that hasn't changed keeps its direntry (and so its inode, and its
+ * own children, if it's a directory). With options/cache off, every use waits
+ * for a new fetch instead.
+ *
+ * A direntry's inode is a hash of its indexnode's id and its path, so that it's
+ * the same every time the file's listed, even across remounts. If two that the
+ * kernel knows about at once hash the same, the later one moves along to the
+ * next free inode. The generation is a hash of the content hash, so a file
+ * that's changed gets a new one. If the kernel knows the old one, the new one
+ * takes over its inode and the kernel's told to drop what it's cached of it;
+ * otherwise an inode's cached content is kept for as long as it's the same.
+ *
+ * A directory's first listing is published as it's parsed, so lookups can find
+ * the names that have arrived while the rest are still coming. Refreshes are
+ * gathered up and applied once they're complete, as they rearrange what's
+ * already there.
+ *
+ * The direntries from each fetch, and their ref counts, are allocated together
+ * in an arena, which each of them holds. It goes when the last of them does,
+ * which is usually when their directory does.
+ *
+ * Names that were looked up in a directory and weren't there are remembered
+ * for timeouts/cache_negative seconds (if options/cache_negative is on), so that
+ * asking again doesn't even need the children. Only the last few are kept per
+ * directory, and they're forgotten whenever the children are fetched again.
  */
 
 #include "common.h"
 
 #include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
@@ -21,33 +53,116 @@
 
 #include "direntry.h"
 #include "listing_internal.h"
-#include "listing_list.h"
 
+#include "arena.h"
+#include "config_manager.h"
+#include "config_reader.h"
 #include "fetcher.h"
 #include "fs2_constants.h"
 #include "inode_map.h"
+#include "name_index.h"
 #include "ref_count.h"
 #include "string_buffer.h"
+#include "string_pool.h"
+#include "utils.h"
 
 
 TRACE_DEFINE(direntry)
 
 
+/* How many names that aren't there each directory remembers */
+#define NEGATIVES_MAX 32
+/* Initial size of the array a refresh gathers children in */
+#define GATHERED_SIZE_MIN 64
+
+
+typedef struct
+{
+    char *name;
+    double expires;
+} negative_t;
+
+typedef struct _children_waiter_t
+{
+    direntry_children_cb_t cb;
+    void *ctxt;
+    struct _children_waiter_t *next;
+} children_waiter_t;
+
 struct _direntry_t
 {
     listing_t           li;
 
     ino_t               inode;
+    uint64_t            generation;
     struct _direntry_t *next;
-    struct _direntry_t *parent;
+    struct _direntry_t *parent; /* a copy: children keep their parents */
     struct _direntry_t *children;
+    name_index_t       *children_index; /* the children, by name */
     int                 looked_for_children;
+    double              children_fetched_at;
+    int                 children_fetching;
+    int                 children_live; /* the first fetch, being published as
+                                          it arrives */
+    children_waiter_t  *children_waiters; /* waiting for the fetch */
+    int                 kept; /* still a child after a refresh of its parent */
+    int                 detached; /* no longer one of its parent's children */
+    arena_t            *arena; /* that it lives in, if it's not the root */
+    negative_t         *negatives; /* NEGATIVES_MAX of them, once a lookup's
+                                      missed */
+    unsigned            negatives_next; /* the one to replace next */
 };
 
 
+/* Protects every direntry's next, children, children_index,
+ * looked_for_children, children_fetched_at, children_fetching, children_live,
+ * children_waiters, kept, detached, negatives and negatives_next */
+static pthread_mutex_t s_children_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double s_children_ttl;
+static int s_children_serve_stale;
+static double s_negative_ttl; /* 0 if they're not remembered */
+static double s_attr_ttl_file, s_attr_ttl_dir;
+static double s_entry_ttl_file, s_entry_ttl_dir;
+static int s_keep_cache;
+static direntry_changed_cb_t s_changed_cb = NULL;
+
+/* Serialises moving direntries to new inodes when theirs are taken */
+static pthread_mutex_t s_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
 static direntry_t *direntry_new_root (CALLER_DECL_ONLY);
-static direntry_t *direntry_from_listing (CALLER_DECL listing_t *li);
-static direntry_t *direntries_from_listing_list (listing_list_t *lis, direntry_t *parent);
+static direntry_t *direntry_new (
+    CALLER_DECL
+    arena_t *arena,
+    indexnode_t *in,
+    const char *hash,
+    const char *name,
+    const char *type,
+    off_t size,
+    unsigned long link_count,
+    const char *href,
+    const char *client,
+    uint64_t path_hash
+);
+static int direntry_still_matches (direntry_t *old, const char *type, const char *hash);
+static direntry_t *direntries_link (
+    direntry_t **children,
+    unsigned count,
+    name_index_t **index_out
+);
+static void children_refresh (
+    direntry_t *de,
+    direntry_t **children,
+    unsigned count,
+    ino_t **changed_out,
+    unsigned *changed_count_out
+);
+static void children_discard (direntry_t *de);
+static void child_drop (direntry_t *child);
+static const char *children_index_name (void *de);
+static uint64_t children_path_hash (indexnode_t *in, const char *path);
+static void negatives_clear (direntry_t *de);
 
 
 #define BASE_CLASS(de) ((listing_t *)de)
@@ -58,8 +173,24 @@ static direntry_t *direntries_from_listing_list (listing_list_t *lis, direntry_t
 /* TODO: wtf. At startup just call get_root_direntry or somethign */
 int direntry_init (void)
 {
+    config_reader_t *config = config_get_reader();
+
+
     direntry_trace("direntry_init()\n");
 
+    inode_map_init();
+
+    s_children_serve_stale = config_option_cache(config);
+    s_children_ttl = s_children_serve_stale ? MAX(config_timeout_cache(config), 0) : 0;
+    s_negative_ttl = config_option_cache_negative(config) ?
+                     MAX(config_timeout_cache_negative(config), 0) : 0;
+    s_attr_ttl_file  = MAX(config_timeout_attr_file(config), 0);
+    s_attr_ttl_dir   = MAX(config_timeout_attr_dir(config), 0);
+    s_entry_ttl_file = MAX(config_timeout_entry_file(config), 0);
+    s_entry_ttl_dir  = MAX(config_timeout_entry_dir(config), 0);
+    s_keep_cache = config_option_keep_cache(config);
+    config_reader_delete(config);
+
 
     /* TODO: horrid way to get this in the inode map (which takes a copy) */
     direntry_delete(CALLER_INFO direntry_new_root(CALLER_INFO_ONLY));
@@ -70,6 +201,19 @@ int direntry_init (void)
 
 void direntry_finalise (void)
 {
+    direntry_t *root;
+
+
+    /* They hold it, so let them go first */
+    if (!direntry_get_by_inode(FSFUSE_ROOT_INODE, &root))
+    {
+        pthread_mutex_lock(&s_children_lock);
+        children_discard(root);
+        pthread_mutex_unlock(&s_children_lock);
+
+        direntry_delete(CALLER_INFO root);
+    }
+
     inode_map_clear();
 }
 
@@ -87,7 +231,7 @@ static void direntry_get_path_inner (direntry_t *de, string_buffer_t *path)
         direntry_delete(CALLER_INFO parent);
     }
 
-    string_buffer_append(path, direntry_get_name(de));
+    string_buffer_append(path, strdup(BASE_CLASS(de)->name));
     string_buffer_append(path, strdup("/"));
 }
 static char *direntry_get_path (direntry_t *de)
@@ -104,11 +248,20 @@ static char *direntry_get_path (direntry_t *de)
 
 typedef struct
 {
+    direntry_t *de;
+    const char *path;
     indexnode_t *in;
-    listing_list_t *lis;
-    unsigned i;
-} entry_found_ctxt_t;
-
+    uint64_t path_hash; /* of where the children are */
+    arena_t *arena;     /* that they're made in */
+    int live;           /* publishing them into de as they arrive */
+    direntry_t *last;   /* live: the last one published */
+    direntry_t **gathered; /* otherwise: new ones, and old ones that are still
+                              there, for the refresh */
+    unsigned size;
+    unsigned count;
+} children_ctxt_t;
+
+/* EXECUTES IN THREAD: fetcher engine loop */
 static void entry_found(
     void *ctxt_void,
     const char *hash,
@@ -120,91 +273,526 @@ static void entry_found(
     const char *client
 )
 {
-    entry_found_ctxt_t *ctxt = (entry_found_ctxt_t *)ctxt_void;
-    listing_t *li;
+    children_ctxt_t *ctxt = (children_ctxt_t *)ctxt_void;
+    direntry_t *de = ctxt->de, *child = NULL;
+
+
+    ctxt->count++;
+
+    if (!ctxt->live)
+    {
+        /* Anything that's still there stays as it is, so there's no need to
+         * make a new one */
+        pthread_mutex_lock(&s_children_lock);
+
+        child = de->children_index ? name_index_get(de->children_index, name) : NULL;
+        if (child && direntry_still_matches(child, type, hash))
+        {
+            /* Only what a directory says about itself can have changed */
+            BASE_CLASS(child)->size = size;
+            BASE_CLASS(child)->link_count = link_count;
+            child->kept = 1;
+        }
+        else
+        {
+            child = NULL;
+        }
+
+        pthread_mutex_unlock(&s_children_lock);
+
+        if (child)
+        {
+            free_const(hash); free_const(name); free_const(type);
+            free_const(href); free_const(client);
+        }
+    }
+
+    if (!child)
+    {
+        /* Nothing else has it yet, so it can be made outside the lock */
+        child = direntry_new(CALLER_INFO ctxt->arena, indexnode_copy(CALLER_INFO ctxt->in),
+                             hash, name, type, size, link_count, href, client,
+                             ctxt->path_hash);
+        child->parent = direntry_copy(CALLER_INFO de);
+    }
+
+    if (ctxt->live)
+    {
+        pthread_mutex_lock(&s_children_lock);
+
+        if (ctxt->last) ctxt->last->next = child;
+        else            de->children = child;
+        ctxt->last = child;
+
+        name_index_add(de->children_index, child);
+
+        pthread_mutex_unlock(&s_children_lock);
+    }
+    else
+    {
+        if (ctxt->count > ctxt->size)
+        {
+            ctxt->size = ctxt->size ? ctxt->size * 2 : GATHERED_SIZE_MIN;
+            ctxt->gathered = realloc(ctxt->gathered, ctxt->size * sizeof(*ctxt->gathered));
+        }
+        ctxt->gathered[ctxt->count - 1] = child;
+    }
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void children_fetched (void *ctxt_void, int rc)
+{
+    children_ctxt_t *ctxt = (children_ctxt_t *)ctxt_void;
+    direntry_t *de = ctxt->de;
+    children_waiter_t *waiters, *next;
+    ino_t *changed = NULL;
+    unsigned changed_count = 0, i;
+
+
+    direntry_trace("direntry children of %s fetched: %d (%u of them)\n",
+                   ctxt->path, rc, ctxt->count);
+
+    pthread_mutex_lock(&s_children_lock);
+
+    if (ctxt->live)
+    {
+        /* Half a listing would say things aren't there that are */
+        if (rc) children_discard(de);
+        de->children_live = 0;
+    }
+    else if (!rc)
+    {
+        /* Usurps the new ones */
+        children_refresh(de, ctxt->gathered, ctxt->count, &changed, &changed_count);
+    }
+    else
+    {
+        /* The old ones that were still there are as they were; the new ones
+         * were never seen */
+        for (i = 0; i < ctxt->count; i++)
+        {
+            if (ctxt->gathered[i]->kept) ctxt->gathered[i]->kept = 0;
+            else                         child_drop(ctxt->gathered[i]);
+        }
+    }
+    /* If a refresh failed, what we've got will do for another while */
+    if (!rc) negatives_clear(de);
+    de->looked_for_children = 1;
+    de->children_fetched_at = fsfuse_get_time();
+    de->children_fetching = 0;
+
+    waiters = de->children_waiters;
+    de->children_waiters = NULL;
+
+    pthread_mutex_unlock(&s_children_lock);
+
+
+    /* Not under the lock, as the kernel might want things from us before it's
+     * done */
+    for (i = 0; i < changed_count; i++)
+    {
+        direntry_trace("inode %lu has changed\n", changed[i]);
+        if (s_changed_cb) s_changed_cb(changed[i]);
+    }
+    free(changed);
+
+    for (; waiters; waiters = next)
+    {
+        next = waiters->next;
+        waiters->cb(waiters->ctxt, rc);
+        free(waiters);
+    }
+
+    /* It was dropped from its parent while this was going on. Its children
+     * can go now that the waiters have seen them, unless another fetch has
+     * started */
+    pthread_mutex_lock(&s_children_lock);
+    if (de->detached && !de->children_fetching)
+    {
+        children_discard(de);
+        de->looked_for_children = 0;
+    }
+    pthread_mutex_unlock(&s_children_lock);
+
+    free(ctxt->gathered);
+    arena_release(ctxt->arena);
+    indexnode_delete(CALLER_INFO ctxt->in);
+    free_const(ctxt->path);
+    direntry_delete(CALLER_INFO de);
+    free(ctxt);
+}
+
+void direntry_ensure_children_async (
+    direntry_t *de,
+    direntry_children_cb_t cb,
+    void *cb_ctxt
+)
+{
+    children_waiter_t *waiter;
+    children_ctxt_t *ctxt;
+    int start = 0, live = 0, done, stale;
+
+
+    pthread_mutex_lock(&s_children_lock);
 
+    stale = !de->looked_for_children ||
+            fsfuse_get_time() >= de->children_fetched_at + s_children_ttl;
+    done = de->looked_for_children && (!stale || s_children_serve_stale);
 
-    li = listing_new( CALLER_INFO indexnode_copy( CALLER_INFO ctxt->in ), hash, name, type, size, link_count, href, client );
-    listing_list_resize( ctxt->lis, ctxt->i + 1 ); //FIXME!
-    listing_list_set_item( ctxt->lis, ctxt->i++, li );
+    if (!done)
+    {
+        /* Join the fetch that's already going, if there is one */
+        waiter = malloc(sizeof(*waiter));
+        waiter->cb = cb;
+        waiter->ctxt = cb_ctxt;
+        waiter->next = de->children_waiters;
+        de->children_waiters = waiter;
+    }
+    if (stale && !de->children_fetching)
+    {
+        de->children_fetching = 1;
+        start = 1;
+
+        /* There's nothing there yet, so nothing to rearrange; they can go
+         * straight in */
+        if (!de->looked_for_children)
+        {
+            de->children_live = live = 1;
+            de->children_index = name_index_new(0, &children_index_name);
+        }
+    }
+
+    pthread_mutex_unlock(&s_children_lock);
+
+
+    if (done)
+    {
+        cb(cb_ctxt, 0);
+    }
+    if (start)
+    {
+        ctxt = malloc(sizeof(*ctxt));
+        ctxt->de = direntry_copy(CALLER_INFO de);
+        ctxt->path = direntry_get_path(de);
+        ctxt->in = indexnode_copy(CALLER_INFO BASE_CLASS(de)->in);
+        ctxt->path_hash = children_path_hash(ctxt->in, ctxt->path);
+        ctxt->arena = arena_new();
+        ctxt->live = live;
+        ctxt->last = NULL;
+        ctxt->gathered = NULL;
+        ctxt->size = 0;
+        ctxt->count = 0;
+
+        direntry_trace("direntry_ensure_children_async(%s)%s\n",
+                       ctxt->path, done ? ": stale, refreshing" : "");
+
+        /* skip the leading '/' from the path that fuse gives us */
+        indexnode_get_listing_async(
+            BASE_CLASS(de)->in,
+            strdup(ctxt->path + 1),
+            &entry_found,
+            &children_fetched,
+            ctxt
+        );
+    }
+}
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int rc;
+} children_sync_ctxt_t;
+
+/* EXECUTES IN THREAD: fetcher engine loop, or the caller's */
+static void children_sync_cb (void *ctxt, int rc)
+{
+    children_sync_ctxt_t *sync = (children_sync_ctxt_t *)ctxt;
+
+
+    pthread_mutex_lock(&sync->lock);
+    sync->rc = rc;
+    sync->done = 1;
+    pthread_cond_signal(&sync->cond);
+    pthread_mutex_unlock(&sync->lock);
 }
 
 int direntry_ensure_children (
     direntry_t *de
 )
 {
-    int rc = EIO;
-    const char *path;
-    direntry_t *dirents = NULL;
-    entry_found_ctxt_t *ctxt;
+    children_sync_ctxt_t sync;
 
 
-    if (!de->looked_for_children)
+    pthread_mutex_init(&sync.lock, NULL);
+    pthread_cond_init(&sync.cond, NULL);
+    sync.done = 0;
+
+    direntry_ensure_children_async(de, &children_sync_cb, &sync);
+
+    pthread_mutex_lock(&sync.lock);
+    while (!sync.done)
     {
-        path = direntry_get_path(de);
-        direntry_trace("direntry_get_children(%s)\n", path);
+        pthread_cond_wait(&sync.cond, &sync.lock);
+    }
+    pthread_mutex_unlock(&sync.lock);
 
-        ctxt = malloc( sizeof(*ctxt) );
-        ctxt->in = BASE_CLASS(de)->in;
-        ctxt->lis = listing_list_new( 0 );
-        ctxt->i = 0;
+    pthread_cond_destroy(&sync.cond);
+    pthread_mutex_destroy(&sync.lock);
 
-        /* skip the leading '/' from the path that fuse gives us */
-        if (indexnode_tryget_listing(indexnode_copy(CALLER_INFO BASE_CLASS(de)->in), path + 1, &entry_found, ctxt))
-        {
-            dirents = direntries_from_listing_list (ctxt->lis, de);
-            rc = 0;
 
-            listing_list_delete(CALLER_INFO ctxt->lis);
-        }
+    return sync.rc;
+}
+
+static const char *children_index_name (void *de)
+{
+    return BASE_CLASS(de)->name;
+}
+
+/* Whether <old> can stand for a newly-listed child of the same name, <type> and
+ * <hash>. A directory stays the same one, so that its own children aren't
+ * thrown away with it.
+ * Call with the children lock held */
+static int direntry_still_matches (direntry_t *old, const char *type, const char *hash)
+{
+    listing_type_t new_type = listing_type_from_string(type);
+    const char *old_hash = BASE_CLASS(old)->hash;
+
+
+    return !old->kept &&
+           BASE_CLASS(old)->type == new_type &&
+           (new_type == listing_type_DIRECTORY ||
+            (old_hash && hash && !strcmp(old_hash, hash)));
+}
+
+/* FNV-1a, 64 bit */
+#define PATH_HASH_INIT UINT64_C(0xcbf29ce484222325)
 
-        de->children = dirents;
-        de->looked_for_children = 1;
+static uint64_t path_hash_update (uint64_t hash, const char *s)
+{
+    while (*s)
+    {
+        hash ^= (unsigned char)*s++;
+        hash *= UINT64_C(0x100000001b3);
     }
 
 
-    return rc;
+    return hash;
 }
 
-static direntry_t *direntries_from_listing_list (listing_list_t *lis, direntry_t *parent)
+/* The hash of where the children at <path> on <in> are; each child's inode
+ * carries on from this with its name */
+static uint64_t children_path_hash (indexnode_t *in, const char *path)
 {
-    direntry_t *de = NULL, *prev = NULL;
-    listing_t *li;
+    char *id = indexnode_get_id(in);
+    uint64_t hash = PATH_HASH_INIT;
+
+
+    hash = path_hash_update(hash, id);
+    hash = path_hash_update(hash, ":");
+    hash = path_hash_update(hash, path);
+
+    free(id);
+
+
+    return hash;
+}
+
+/* Links <children> into a list, in the same order, and indexes them.
+ * Call with the children lock held */
+static direntry_t *direntries_link (
+    direntry_t **children,
+    unsigned count,
+    name_index_t **index_out
+)
+{
+    direntry_t *first = NULL, *prev = NULL;
+    name_index_t *index;
     unsigned i;
 
 
-    assert(lis);
+    index = name_index_new(count, &children_index_name);
+
+    /* Lookups find the last of any children with the same name */
+    for (i = 0; i < count; ++i)
+    {
+        children[i]->next = NULL;
+        if (prev) prev->next = children[i];
+        else      first = children[i];
+        prev = children[i];
+
+        name_index_add(index, children[i]);
+    }
+
+    *index_out = index;
+
+
+    return first;
+}
+
+/* If <old> is a file the kernel knows about, and the new children have a
+ * different file in its place, that takes over its inode. Returns whether it
+ * did.
+ * Call with the children lock held, and the new children indexed */
+static int child_changed (direntry_t *parent, direntry_t *old)
+{
+    direntry_t *new;
+    ino_t inode;
+
+
+    if (BASE_CLASS(old)->type != listing_type_FILE) return 0;
 
-    /* turn array of li's into linked list of de's */
-    for (i = 0; i < listing_list_get_count(lis); ++i)
+    new = name_index_get(parent->children_index, BASE_CLASS(old)->name);
+    if (!new || new == old ||
+        BASE_CLASS(new)->type != listing_type_FILE ||
+        BASE_CLASS(new)->hash == BASE_CLASS(old)->hash)
     {
-        li = listing_list_get_item(lis, i);
-        de = direntry_from_listing(CALLER_INFO li);
-        listing_delete(CALLER_INFO li);
+        return 0;
+    }
+
+    inode = new->inode;
+    new->inode = old->inode;
+    if (inode_map_replace(old, new)) return 1;
+    new->inode = inode;
+
 
+    return 0;
+}
+
+/* Brings the children up to date with a new listing of them (usurped: the old
+ * ones in it are marked as kept, the rest are new). Those that aren't there any
+ * more are dropped (though they live on for as long as anyone's using them).
+ * The inodes of any files that have changed under the kernel are returned in
+ * <changed_out>, to be freed.
+ * Call with the children lock held */
+static void children_refresh (
+    direntry_t *de,
+    direntry_t **children,
+    unsigned count,
+    ino_t **changed_out,
+    unsigned *changed_count_out
+)
+{
+    direntry_t **old_children, *old;
+    name_index_t *old_index = de->children_index;
+    unsigned old_count = 0, i, kept = 0, gone = 0;
+    ino_t *changed;
+    unsigned changed_count = 0;
+
+
+    /* Note down the old list first, as linking the new one changes it */
+    for (old = de->children; old; old = old->next) old_count++;
+    old_children = malloc(old_count * sizeof(*old_children));
+    for (old = de->children, i = 0; old; old = old->next) old_children[i++] = old;
+
+    de->children = direntries_link(children, count, &de->children_index);
+    changed = malloc(old_count * sizeof(*changed));
+
+    for (i = 0; i < old_count; i++)
+    {
+        old = old_children[i];
 
-        de->parent = parent;
-        de->next = prev;
-        prev = de;
+        if (old->kept)
+        {
+            old->kept = 0;
+            direntry_still_exists(old);
+            kept++;
+        }
+        else
+        {
+            if (child_changed(de, old)) changed[changed_count++] = old->inode;
+
+            child_drop(old);
+            gone++;
+        }
     }
 
+    free(old_children);
+    if (old_index) name_index_delete(old_index);
 
-    return de;
+    *changed_out = changed;
+    *changed_count_out = changed_count;
+
+    direntry_trace("children refreshed: %u kept, %u gone (%u changed), %u in all\n",
+                   kept, gone, changed_count, count);
+}
+
+/* Drops all the children, leaving it as though it had never been listed.
+ * Call with the children lock held */
+static void children_discard (direntry_t *de)
+{
+    direntry_t *child, *next;
+
+
+    for (child = de->children; child; child = next)
+    {
+        next = child->next;
+        child_drop(child);
+    }
+    de->children = NULL;
+
+    if (de->children_index) name_index_delete(de->children_index);
+    de->children_index = NULL;
+}
+
+/* Takes <child> out of its parent's children (which the caller unlinks it
+ * from). Children hold their parent, so it drops its own children too, or
+ * they'd keep each other forever; any that the kernel still knows about keep
+ * it, and their paths, for as long as it does. If it's being fetched, its
+ * children are still wanted (and it's still filling them in), so they go when
+ * the fetch is done.
+ * Call with the children lock held */
+static void child_drop (direntry_t *child)
+{
+    direntry_no_longer_exists(child);
+    child->next = NULL;
+    child->detached = 1;
+
+    if (!child->children_fetching)
+    {
+        children_discard(child);
+        child->looked_for_children = 0;
+    }
+
+    direntry_delete(CALLER_INFO child);
 }
 
 
 /* direntry lifecycle ======================================================= */
 
-static direntry_t *direntry_from_listing (CALLER_DECL listing_t *li)
+/* Usurps the strings, like listing_new() */
+static direntry_t *direntry_new (
+    CALLER_DECL
+    arena_t *arena,
+    indexnode_t *in,
+    const char *hash,
+    const char *name,
+    const char *type,
+    off_t size,
+    unsigned long link_count,
+    const char *href,
+    const char *client,
+    uint64_t path_hash
+)
 {
-    /* TODO: stop being lazy and have listing_init */
-    direntry_t *de = realloc(li, sizeof(direntry_t));
+    direntry_t *de = arena_alloc(arena, sizeof(direntry_t));
 
 
-    bzero(de + sizeof(listing_t), sizeof(direntry_t) - sizeof(listing_t));
+    memset(de, 0, sizeof(direntry_t));
 
-    de->inode = inode_next();
-    inode_map_add(de);
+    listing_init(BASE_CLASS(de), in, hash, name, type, size, link_count, href, client);
+
+    de->arena = arena;
+    arena_hold(arena);
+
+    de->inode = path_hash_update(path_hash, BASE_CLASS(de)->name);
+    if (de->inode <= FSFUSE_ROOT_INODE) de->inode += FSFUSE_ROOT_INODE + 1;
+
+    if (BASE_CLASS(de)->type != listing_type_DIRECTORY && BASE_CLASS(de)->hash)
+    {
+        de->generation = path_hash_update(PATH_HASH_INIT, BASE_CLASS(de)->hash);
+    }
 
     direntry_trace(
         "[direntry %p inode %lu] new (" CALLER_FORMAT ") ref %u\n",
@@ -228,12 +816,13 @@ direntry_t *direntry_new_root (CALLER_DECL_ONLY)
     //know, else 1)
     //FIXME: this is going to break. How do you list this direntry with a null
     //indexnode? There must be special-case code.
-    BASE_CLASS(de)->name = strdup( "" );
+    ref_count_init(&BASE_CLASS(de)->ref_count);
+    BASE_CLASS(de)->name = string_pool_intern( "" );
     BASE_CLASS(de)->type = listing_type_DIRECTORY;
     BASE_CLASS(de)->link_count = 1;
 
     de->inode = FSFUSE_ROOT_INODE;
-    inode_map_add(de);
+    inode_map_tryadd(de);
 
     direntry_trace(
         "[direntry %p inode %lu] new (" CALLER_FORMAT ") ref %u\n",
@@ -246,7 +835,7 @@ direntry_t *direntry_new_root (CALLER_DECL_ONLY)
 
 direntry_t *direntry_copy (CALLER_DECL direntry_t *de)
 {
-    unsigned refc = ref_count_inc( BASE_CLASS(de)->ref_count );
+    unsigned refc = ref_count_inc( &BASE_CLASS(de)->ref_count );
 
 
     NOT_USED(refc);
@@ -259,7 +848,8 @@ direntry_t *direntry_copy (CALLER_DECL direntry_t *de)
 
 void direntry_delete (CALLER_DECL direntry_t *de)
 {
-    unsigned refc = ref_count_dec( BASE_CLASS(de)->ref_count );
+    unsigned refc = ref_count_dec( &BASE_CLASS(de)->ref_count );
+    direntry_t *parent;
 
     direntry_trace("[direntry %p inode %lu] delete (" CALLER_FORMAT ") ref %u\n",
                    de, de->inode, CALLER_PASS refc);
@@ -271,7 +861,17 @@ void direntry_delete (CALLER_DECL direntry_t *de)
 
         listing_teardown(BASE_CLASS(de));
 
-        free(de);
+        /* Our children hold us, so they've all been dropped by now */
+        if (de->children_index) name_index_delete(de->children_index);
+        negatives_clear(de);
+        free(de->negatives);
+
+        parent = de->parent;
+
+        if (de->arena) arena_release(de->arena);
+        else           free(de);
+
+        if (parent) direntry_delete(CALLER_INFO parent);
     }
 
     direntry_trace_dedent();
@@ -309,12 +909,28 @@ direntry_t *direntry_get_parent       (direntry_t *de)
 
 direntry_t *direntry_get_first_child  (direntry_t *de)
 {
-    return de->children ? direntry_copy(CALLER_INFO de->children) : NULL;
+    direntry_t *child;
+
+
+    pthread_mutex_lock(&s_children_lock);
+    child = de->children ? direntry_copy(CALLER_INFO de->children) : NULL;
+    pthread_mutex_unlock(&s_children_lock);
+
+
+    return child;
 }
 
 direntry_t *direntry_get_next_sibling (direntry_t *de)
 {
-    return de->next ? direntry_copy(CALLER_INFO de->next) : NULL;
+    direntry_t *next;
+
+
+    pthread_mutex_lock(&s_children_lock);
+    next = de->next ? direntry_copy(CALLER_INFO de->next) : NULL;
+    pthread_mutex_unlock(&s_children_lock);
+
+
+    return next;
 }
 
 
@@ -325,12 +941,12 @@ ino_t direntry_get_inode (direntry_t *de)
     return de->inode;
 }
 
-char *direntry_get_name (direntry_t *de)
+const char *direntry_get_name (direntry_t *de)
 {
     return listing_get_name(BASE_CLASS(de));
 }
 
-char *direntry_get_hash (direntry_t *de)
+const char *direntry_get_hash (direntry_t *de)
 {
     return listing_get_hash(BASE_CLASS(de));
 }
@@ -381,8 +997,8 @@ void direntry_de2stat (direntry_t *de, struct stat *st)
  * struct stat */
 void direntry_de2fuse_entry (direntry_t *de, struct fuse_entry_param *entry)
 {
-    entry->ino = de->inode;;
-    entry->generation = 0;
+    entry->ino = de->inode;
+    entry->generation = de->generation;
     direntry_de2stat(de, &(entry->attr));
 }
 
@@ -398,6 +1014,68 @@ void direntry_no_longer_exists (direntry_t *de)
 }
 
 
+/* inodes ================================================================== */
+
+int direntry_same_path (direntry_t *de, direntry_t *other)
+{
+    while (de != other)
+    {
+        /* Names are pooled */
+        if (!de || !other ||
+            BASE_CLASS(de)->name != BASE_CLASS(other)->name)
+        {
+            return 0;
+        }
+
+        de = de->parent;
+        other = other->parent;
+    }
+
+
+    return 1;
+}
+
+void direntry_looked_up (direntry_t *de)
+{
+    if (inode_map_tryadd(de)) return;
+
+    /* Another file we've told the kernel about has its inode. Rare, but they
+     * can't both have it, so this one takes the next one that's free. */
+    pthread_mutex_lock(&s_inode_lock);
+
+    while (!inode_map_tryadd(de))
+    {
+        direntry_trace("inode %lu is taken; moving along\n", de->inode);
+
+        de->inode++;
+        if (de->inode <= FSFUSE_ROOT_INODE) de->inode = FSFUSE_ROOT_INODE + 1;
+    }
+
+    pthread_mutex_unlock(&s_inode_lock);
+}
+
+void direntry_forget (ino_t ino, unsigned long nlookup)
+{
+    direntry_trace("direntry_forget(ino %lu, nlookup %lu)\n", ino, nlookup);
+
+    inode_map_forget(ino, nlookup);
+}
+
+int direntry_opened (direntry_t *de)
+{
+    /* Noted either way, for next time */
+    int same = inode_map_opened(de);
+
+
+    return same && s_keep_cache;
+}
+
+void direntry_set_changed_cb (direntry_changed_cb_t cb)
+{
+    s_changed_cb = cb;
+}
+
+
 /* stubs etc ===================================================== */
 
 /* FIXME: stubs */
@@ -411,39 +1089,137 @@ int direntry_get_by_inode (ino_t ino, direntry_t **de)
     return *de ? 0 : ENOENT;
 }
 
+/* Call with the children lock held */
+static void negatives_clear (direntry_t *de)
+{
+    unsigned i;
+
+
+    if (!de->negatives) return;
+
+    for (i = 0; i < NEGATIVES_MAX; i++)
+    {
+        free(de->negatives[i].name);
+        de->negatives[i].name = NULL;
+    }
+}
+
+/* Call with the children lock held */
+static int negative_find (direntry_t *de, const char *name)
+{
+    double now;
+    unsigned i;
+
+
+    if (!de->negatives) return 0;
+
+    now = fsfuse_get_time();
+    for (i = 0; i < NEGATIVES_MAX; i++)
+    {
+        if (de->negatives[i].name &&
+            de->negatives[i].expires > now &&
+            !strcmp(de->negatives[i].name, name))
+        {
+            return 1;
+        }
+    }
+
+
+    return 0;
+}
+
+/* Remembers that <name> isn't in <de>, in place of the oldest one if they're
+ * all in use.
+ * Call with the children lock held */
+static void negative_add (direntry_t *de, const char *name)
+{
+    negative_t *negative;
+
+
+    if (!s_negative_ttl) return;
+
+    if (!de->negatives) de->negatives = calloc(NEGATIVES_MAX, sizeof(*de->negatives));
+
+    negative = &de->negatives[de->negatives_next];
+    de->negatives_next = (de->negatives_next + 1) % NEGATIVES_MAX;
+
+    free(negative->name);
+    negative->name = strdup(name);
+    negative->expires = fsfuse_get_time() + s_negative_ttl;
+}
+
+double direntry_get_negative_timeout (void)
+{
+    return s_negative_ttl;
+}
+
+double direntry_get_attr_timeout (direntry_t *de)
+{
+    return BASE_CLASS(de)->type == listing_type_DIRECTORY ? s_attr_ttl_dir : s_attr_ttl_file;
+}
+
+double direntry_get_entry_timeout (direntry_t *de)
+{
+    return BASE_CLASS(de)->type == listing_type_DIRECTORY ? s_entry_ttl_dir : s_entry_ttl_file;
+}
+
 int direntry_get_child_by_name (
     ino_t parent,
     const char *name,
     direntry_t **de_out
 )
 {
-    direntry_t *de, *child = NULL, *old_child;
-    int rc;
+    direntry_t *de, *child = NULL;
+    int rc, negative;
 
 
     rc = direntry_get_by_inode(parent, &de);
 
     if (!rc)
     {
-        direntry_ensure_children(de);
+        pthread_mutex_lock(&s_children_lock);
+
+        negative = negative_find(de, name);
 
-        /* FIXME: this (will) bypasses cache. Also, probably want to factor to
-         * direntry_find_child(de, name).
-         * If it's to stay like this, it need to take a lock, as it doesn't own
-         * any copies of the children! */
-        rc = ENOENT;
-        child = direntry_get_first_child(de);
-        while (child)
+        /* While the first listing's arriving, what's arrived can be answered
+         * for */
+        if (!negative && de->children_live &&
+            (child = name_index_get(de->children_index, name)))
         {
-            if (!strcmp(direntry_get_name(child), name))
+            child = direntry_copy(CALLER_INFO child);
+        }
+
+        pthread_mutex_unlock(&s_children_lock);
+
+        if (negative)
+        {
+            direntry_trace("%s is known not to be there\n", name);
+            rc = ENOENT;
+        }
+        else if (!child)
+        {
+            direntry_ensure_children(de);
+
+            /* FIXME: this (will) bypasses cache. */
+            pthread_mutex_lock(&s_children_lock);
+
+            if (!de->children_index)
+            {
+                /* We've never managed to list it, so can't say what isn't
+                 * there */
+                rc = EIO;
+            }
+            else if ((child = name_index_get(de->children_index, name)))
+            {
+                child = direntry_copy(CALLER_INFO child);
+            }
+            else
             {
-                rc = 0;
-                break;
+                negative_add(de, name);
+                rc = ENOENT;
             }
 
-            old_child = child;
-            child = direntry_get_next_sibling(child);
-            direntry_delete(CALLER_INFO old_child);
+            pthread_mutex_unlock(&s_children_lock);
         }
 
         direntry_delete(CALLER_INFO de);
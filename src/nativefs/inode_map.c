@@ -8,73 +8,301 @@
  *
  *
  * The inode -> direntry map code.
+ * Holds the direntries the kernel knows the inodes of - those it's had from
+ * lookup() and not yet forget()ten - so that it tracks the working set rather
+ * than everything we've ever listed. It's a hash table split into shards, each
+ * with its own read/write lock, so that lookups by inode (which is most of
+ * what happens to it) don't contend with each other, and only contend with
+ * changes to the same shard.
+ * Each inode also remembers the content it was last opened with, so that the
+ * kernel can be told to keep what it's cached of it when that's the same.
  */
 
+#include "common.h"
+
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "common.h"
 #include "direntry.h"
+#include "inode_map.h"
+#include "string_pool.h"
 
 
-static direntry_t **s_inode_map = NULL;
-static size_t s_inode_map_size = 0;
-static size_t s_inode_map_used = 0;
+/* Power of two */
+#define SHARDS 64
+#define BUCKETS_MIN 16
+
+
+typedef struct _inode_entry_t
+{
+    ino_t inode;
+    direntry_t *de;
+    unsigned long nlookup;
+    const char *opened_hash; /* pooled */
+    struct _inode_entry_t *next;
+} inode_entry_t;
 
+typedef struct
+{
+    pthread_rwlock_t lock;
+    inode_entry_t **buckets;
+    unsigned size;  /* power of two */
+    unsigned count;
+} shard_t;
 
-static ino_t s_inode_next = 2;
 
-static const size_t INODE_MAP_MOD = 32;
+static shard_t s_shards[SHARDS];
 
 
-void inode_map_add (ino_t inode, direntry_t *de)
+void inode_map_init (void)
 {
-    assert(de);
+    unsigned i;
 
-    if (inode >= s_inode_map_size)
+
+    for (i = 0; i < SHARDS; i++)
     {
-        s_inode_map_size += INODE_MAP_MOD;
-        s_inode_map = realloc(s_inode_map,
-            s_inode_map_size * sizeof(direntry_t *));
+        pthread_rwlock_init(&s_shards[i].lock, NULL);
+        s_shards[i].size = BUCKETS_MIN;
+        s_shards[i].buckets = calloc(BUCKETS_MIN, sizeof(*s_shards[i].buckets));
+        s_shards[i].count = 0;
     }
+}
+
+/* Inodes are hashes already, but the root's isn't */
+static uint64_t inode_hash (ino_t inode)
+{
+    return (uint64_t)inode * UINT64_C(0x9e3779b97f4a7c15);
+}
 
-    s_inode_map[inode] = direntry_copy(CALLER_INFO de);
+static shard_t *shard_get (ino_t inode)
+{
+    return &s_shards[(inode_hash(inode) >> 32) & (SHARDS - 1)];
+}
 
-    s_inode_map_used = inode + 1; /* TODO: assumption */
+static inode_entry_t **bucket_get (shard_t *shard, ino_t inode)
+{
+    return &shard->buckets[(inode_hash(inode) >> 40) & (shard->size - 1)];
 }
 
-direntry_t *inode_map_get (ino_t inode)
+/* Call with the shard locked */
+static inode_entry_t **entry_find (shard_t *shard, ino_t inode)
 {
-    direntry_t *de;
+    inode_entry_t **link = bucket_get(shard, inode);
+
+
+    while (*link && (*link)->inode != inode) link = &(*link)->next;
 
 
-    if (inode < s_inode_map_used)
+    return link;
+}
+
+/* Call with the shard write-locked */
+static void shard_grow (shard_t *shard)
+{
+    inode_entry_t **old_buckets = shard->buckets, *entry, *next, **bucket;
+    unsigned old_size = shard->size, i;
+
+
+    shard->size *= 2;
+    shard->buckets = calloc(shard->size, sizeof(*shard->buckets));
+
+    for (i = 0; i < old_size; i++)
+    {
+        for (entry = old_buckets[i]; entry; entry = next)
+        {
+            next = entry->next;
+            bucket = bucket_get(shard, entry->inode);
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+
+    free(old_buckets);
+}
+
+int inode_map_tryadd (direntry_t *de)
+{
+    ino_t inode = direntry_get_inode(de);
+    shard_t *shard = shard_get(inode);
+    inode_entry_t **link, *entry;
+    direntry_t *replaced = NULL;
+    int rc = 1;
+
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    link = entry_find(shard, inode);
+    if (*link && (*link)->de == de)
     {
-        de = direntry_copy(CALLER_INFO s_inode_map[inode]);
+        (*link)->nlookup++;
+    }
+    else if (*link && direntry_same_path((*link)->de, de))
+    {
+        /* The file's changed since the kernel last looked it up, but it's
+         * still the same inode */
+        replaced = (*link)->de;
+        (*link)->de = direntry_copy(CALLER_INFO de);
+        (*link)->nlookup++;
+    }
+    else if (*link)
+    {
+        rc = 0;
     }
     else
     {
-        de = NULL;
+        entry = malloc(sizeof(*entry));
+        entry->inode = inode;
+        entry->de = direntry_copy(CALLER_INFO de);
+        entry->nlookup = 1;
+        entry->opened_hash = NULL;
+        entry->next = NULL;
+        *link = entry;
+
+        if (++shard->count > shard->size) shard_grow(shard);
     }
 
+    pthread_rwlock_unlock(&shard->lock);
+
+
+    if (replaced) direntry_delete(CALLER_INFO replaced);
+
+
+    return rc;
+}
+
+direntry_t *inode_map_get (ino_t inode)
+{
+    shard_t *shard = shard_get(inode);
+    inode_entry_t *entry;
+    direntry_t *de = NULL;
+
+
+    pthread_rwlock_rdlock(&shard->lock);
+
+    entry = *entry_find(shard, inode);
+    if (entry) de = direntry_copy(CALLER_INFO entry->de);
+
+    pthread_rwlock_unlock(&shard->lock);
+
 
     return de;
 }
 
-ino_t inode_next (void)
+int inode_map_replace (direntry_t *old, direntry_t *de)
 {
-    return s_inode_next++;
+    ino_t inode = direntry_get_inode(old);
+    shard_t *shard = shard_get(inode);
+    inode_entry_t *entry;
+    int rc = 0;
+
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    entry = *entry_find(shard, inode);
+    if (entry && entry->de == old)
+    {
+        entry->de = direntry_copy(CALLER_INFO de);
+        rc = 1;
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+
+    /* The map's copy */
+    if (rc) direntry_delete(CALLER_INFO old);
+
+
+    return rc;
 }
 
-void inode_map_clear (void)
+int inode_map_opened (direntry_t *de)
 {
-    unsigned i;
+    ino_t inode = direntry_get_inode(de);
+    shard_t *shard = shard_get(inode);
+    const char *hash = direntry_get_hash(de), *old_hash = NULL;
+    inode_entry_t *entry;
+    int same = 0;
+
 
+    pthread_rwlock_wrlock(&shard->lock);
 
-    for (i = 1; i < s_inode_map_used; ++i)
+    entry = *entry_find(shard, inode);
+    if (entry)
     {
-        direntry_delete(CALLER_INFO s_inode_map[i]);
+        /* Pooled, so equal strings are the same pointer */
+        same = hash && entry->opened_hash == hash;
+        old_hash = entry->opened_hash;
+        entry->opened_hash = hash;
+        hash = NULL;
     }
 
-    free(s_inode_map);
+    pthread_rwlock_unlock(&shard->lock);
+
+
+    string_pool_release(old_hash);
+    string_pool_release(hash);
+
+
+    return same;
+}
+
+void inode_map_forget (ino_t inode, unsigned long nlookup)
+{
+    shard_t *shard = shard_get(inode);
+    inode_entry_t **link, *entry = NULL;
+
+
+    /* The root's always there */
+    if (inode == FSFUSE_ROOT_INODE) return;
+
+    pthread_rwlock_wrlock(&shard->lock);
+
+    link = entry_find(shard, inode);
+    if (*link)
+    {
+        (*link)->nlookup -= MIN(nlookup, (*link)->nlookup);
+        if (!(*link)->nlookup)
+        {
+            entry = *link;
+            *link = entry->next;
+            shard->count--;
+        }
+    }
+
+    pthread_rwlock_unlock(&shard->lock);
+
+
+    if (entry)
+    {
+        direntry_delete(CALLER_INFO entry->de);
+        string_pool_release(entry->opened_hash);
+        free(entry);
+    }
+}
+
+void inode_map_clear (void)
+{
+    inode_entry_t *entry, *next;
+    unsigned i, j;
+
+
+    for (i = 0; i < SHARDS; i++)
+    {
+        for (j = 0; j < s_shards[i].size; j++)
+        {
+            for (entry = s_shards[i].buckets[j]; entry; entry = next)
+            {
+                next = entry->next;
+                direntry_delete(CALLER_INFO entry->de);
+                string_pool_release(entry->opened_hash);
+                free(entry);
+            }
+        }
+
+        free(s_shards[i].buckets);
+        s_shards[i].buckets = NULL;
+        pthread_rwlock_destroy(&s_shards[i].lock);
+    }
 }
@@ -11,9 +11,19 @@
 #include "direntry.h"
 
 
-extern void inode_map_add (direntry_t *de);
+extern void inode_map_init (void);
+/* Counts one lookup() of the direntry's inode. The map holds a copy of it until
+ * they've all been forgotten. Fails if a direntry at a different path already
+ * has that inode. */
+extern int inode_map_tryadd (direntry_t *de);
 extern direntry_t *inode_map_get (ino_t inode);
-extern ino_t inode_next (void);
+/* If the kernel knows <old> by its inode, it's <de> from now on (which must
+ * already have that inode). Returns whether it was. */
+extern int inode_map_replace (direntry_t *old, direntry_t *de);
+/* Notes that <de>'s inode has been opened with <de>'s content. Returns whether
+ * it was last opened with the same content. */
+extern int inode_map_opened (direntry_t *de);
+extern void inode_map_forget (ino_t inode, unsigned long nlookup);
 extern void inode_map_clear (void);
 
 #endif /* _INCLUDED_INODE_MAP_H */
@@ -12,6 +12,7 @@
 
 #include "common.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -27,6 +28,7 @@
 #include "indexnode.h"
 #include "peerstats.h"
 #include "ref_count.h"
+#include "string_pool.h"
 #include "utils.h"
 
 
@@ -35,7 +37,7 @@ TRACE_DEFINE(listing)
 
 /* static helpers =========================================================== */
 
-static listing_type_t listing_type_from_string (const char * const s)
+listing_type_t listing_type_from_string (const char * const s)
 {
     listing_type_t type;
 
@@ -75,27 +77,49 @@ listing_t *listing_new (
     listing_t *li = malloc(sizeof(listing_t));
 
 
-    li->ref_count = ref_count_new();
+    listing_init(li, in, hash, name, type, size, link_count, href, client);
 
+    listing_trace("[listing %p] new (" CALLER_FORMAT ") ref %u\n",
+                   li, CALLER_PASS 1);
+
+
+    return li;
+}
+
+void listing_init (
+    listing_t *li,
+    indexnode_t *in,
+    const char *hash,
+    const char *name,
+    const char *type,
+    off_t size,
+    unsigned long link_count,
+    const char *href,
+    const char *client
+)
+{
+    ref_count_init(&li->ref_count);
+
+    /* Plenty of these are the same between listings (hashes of files that are
+     * in several places, names like "Thumbs.db", and clients above all) */
     li->in = in;
-    li->name = name;
-    li->hash = hash;
+    li->name = string_pool_intern(name);
+    li->hash = string_pool_intern(hash);
     li->type = listing_type_from_string(type);
     li->size = size;
     li->link_count = link_count;
     li->href = href;
-    li->client = client;
-
-    listing_trace("[listing %p] new (" CALLER_FORMAT ") ref %u\n",
-                   li, CALLER_PASS 1);
+    li->client = string_pool_intern(client);
 
-
-    return li;
+    free_const(name);
+    free_const(hash);
+    free_const(type);
+    free_const(client);
 }
 
 listing_t *listing_copy (CALLER_DECL listing_t *li)
 {
-    unsigned refc = ref_count_inc( li->ref_count );
+    unsigned refc = ref_count_inc( &li->ref_count );
 
 
     NOT_USED(refc);
@@ -108,19 +132,17 @@ listing_t *listing_copy (CALLER_DECL listing_t *li)
 
 void listing_teardown (listing_t *li)
 {
-    ref_count_delete( li->ref_count );
-
     /* TODO: be explicti about whic of these are mandatory (e.g. name) and
      * assert on the way in and don't check here */
-    if (li->name)   free_const(li->name);
-    if (li->hash)   free_const(li->hash);
+    string_pool_release(li->name);
+    string_pool_release(li->hash);
     if (li->href)   free_const(li->href);
-    if (li->client) free_const(li->client);
+    string_pool_release(li->client);
 }
 
 void listing_delete (CALLER_DECL listing_t *li)
 {
-    unsigned refc = ref_count_dec( li->ref_count );
+    unsigned refc = ref_count_dec( &li->ref_count );
 
     listing_trace("[listing %p] delete (" CALLER_FORMAT ") ref %u\n",
                    li, CALLER_PASS refc);
@@ -142,20 +164,21 @@ void listing_delete (CALLER_DECL listing_t *li)
 
 int listing_equal (listing_t *li, listing_t *other)
 {
-    return hash_equal(li->hash, other->hash);
+    /* Both pooled */
+    return li->hash == other->hash;
 }
 
 
 /* listing attribute getters ================================================ */
 
-char *listing_get_name (listing_t *li)
+const char *listing_get_name (listing_t *li)
 {
-    return strdup( li->name );
+    return string_pool_copy( li->name );
 }
 
-char *listing_get_hash (listing_t *li)
+const char *listing_get_hash (listing_t *li)
 {
-    return strdup( li->hash );
+    return string_pool_copy( li->hash );
 }
 
 listing_type_t listing_get_type (listing_t *li)
@@ -178,9 +201,14 @@ char *listing_get_href (listing_t *li)
     return strdup( li->href );
 }
 
-char *listing_get_client (listing_t *li)
+const char *listing_get_client (listing_t *li)
+{
+    return string_pool_copy( li->client );
+}
+
+int listing_is_from_client (listing_t *li, const char *client)
 {
-    return strdup( li->client );
+    return li->client == client;
 }
 
 void listing_li2stat (listing_t *li, struct stat *st)
@@ -245,27 +273,96 @@ static void entry_found(
     listing_list_set_item( ctxt->lis, ctxt->i++, li );
 }
 
-int listing_tryget_best_alternative( listing_t *li_reference, listing_t **li_best )
+typedef struct
+{
+    entry_found_ctxt_t found; /* first, so this can be passed to entry_found() */
+    listing_alternative_cb_t cb;
+    listing_alternatives_cb_t cb_many;
+    unsigned max;
+    void *cb_ctxt;
+} alternatives_ctxt_t;
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void alternatives_done( void *ctxt_void, int rc )
+{
+    alternatives_ctxt_t *ctxt = (alternatives_ctxt_t *)ctxt_void;
+    listing_t *li_best = NULL;
+
+
+    if( !rc )
+    {
+        li_best = peerstats_chose_alternative( ctxt->found.lis );
+        if( !li_best ) rc = EBUSY;
+    }
+
+    listing_list_delete( CALLER_INFO ctxt->found.lis );
+    indexnode_delete( CALLER_INFO ctxt->found.in );
+
+    ctxt->cb( ctxt->cb_ctxt, rc, li_best );
+
+    free( ctxt );
+}
+
+/* EXECUTES IN THREAD: fetcher engine loop */
+static void alternatives_many_done( void *ctxt_void, int rc )
 {
-    entry_found_ctxt_t *ctxt = malloc( sizeof(*ctxt) );
-    int rc;
+    alternatives_ctxt_t *ctxt = (alternatives_ctxt_t *)ctxt_void;
+    listing_list_t *lis = NULL;
 
 
-    ctxt->in = indexnode_copy( CALLER_INFO li_reference->in );
-    ctxt->lis = listing_list_new( 0 );
-    ctxt->i = 0;
+    if( !rc )
+    {
+        lis = peerstats_chose_alternatives( ctxt->found.lis, ctxt->max );
+        if( !listing_list_get_count( lis ) )
+        {
+            listing_list_delete( CALLER_INFO lis );
+            lis = NULL;
+            rc = EBUSY;
+        }
+    }
 
-    rc = indexnode_tryget_alternatives(
-        indexnode_copy( CALLER_INFO li_reference->in ),
-        listing_get_hash( li_reference ),
-        entry_found,
+    listing_list_delete( CALLER_INFO ctxt->found.lis );
+    indexnode_delete( CALLER_INFO ctxt->found.in );
+
+    ctxt->cb_many( ctxt->cb_ctxt, rc, lis );
+
+    free( ctxt );
+}
+
+static void alternatives_find( listing_t *li_reference, indexnode_done_cb_t done_cb, alternatives_ctxt_t *ctxt )
+{
+    ctxt->found.in = indexnode_copy( CALLER_INFO li_reference->in );
+    ctxt->found.lis = listing_list_new( 0 );
+    ctxt->found.i = 0;
+
+    indexnode_get_alternatives_async(
+        li_reference->in,
+        strdup( li_reference->hash ),
+        &entry_found,
+        done_cb,
         ctxt
     );
+}
 
+void listing_get_best_alternative_async( listing_t *li_reference, listing_alternative_cb_t cb, void *cb_ctxt )
+{
+    alternatives_ctxt_t *ctxt = calloc( 1, sizeof(*ctxt) );
+
+
+    ctxt->cb = cb;
+    ctxt->cb_ctxt = cb_ctxt;
+
+    alternatives_find( li_reference, &alternatives_done, ctxt );
+}
+
+void listing_get_alternatives_async( listing_t *li_reference, unsigned max, listing_alternatives_cb_t cb, void *cb_ctxt )
+{
+    alternatives_ctxt_t *ctxt = calloc( 1, sizeof(*ctxt) );
 
-    *li_best = peerstats_chose_alternative( ctxt->lis );
-    listing_list_delete( CALLER_INFO ctxt->lis );
 
+    ctxt->cb_many = cb;
+    ctxt->max = max;
+    ctxt->cb_ctxt = cb_ctxt;
 
-    return rc;
+    alternatives_find( li_reference, &alternatives_many_done, ctxt );
 }
@@ -17,7 +17,7 @@
 
 struct _listing_t
 {
-    ref_count_t               *ref_count;
+    ref_count_t                ref_count;
 
     indexnode_t               *in;
     const char                *name;
@@ -42,6 +42,21 @@ extern listing_t *listing_new (
     const char *href,
     const char *client
 );
+/* Fills in a listing that's somewhere other than its own allocation. Like
+ * listing_new(), usurps the strings. */
+extern void listing_init (
+    listing_t *li,
+    indexnode_t *in,
+    const char *hash,
+    const char *name,
+    const char *type,
+    off_t size,
+    unsigned long link_count,
+    const char *href,
+    const char *client
+);
+/* Drops what a listing holds, but not the listing itself */
 void listing_teardown (listing_t *li);
+extern listing_type_t listing_type_from_string (const char * const s);
 
 #endif /* _INCLUDED_LISTING_INTERNAL_H */
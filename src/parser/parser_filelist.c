@@ -133,6 +133,12 @@ void filelist_xml_cb( void *ctxt, parser_xml_event_t event, char *name, char *va
                     parser->client
                 );
 
+                /* The listing made from them takes them over; an entry that
+                 * lacks any mustn't get the last one's */
+                parser->name = parser->hash = parser->type = NULL;
+                parser->href = parser->client = NULL;
+                parser->size = 0; parser->link_count = 0;
+
                 parser->state = state_WAITING_FOR_A;
             }
             break;
@@ -21,6 +21,7 @@
 #include "direntry.h"
 #include "listing_list.h"
 #include "peerstats.h"
+#include "string_pool.h"
 
 
 TRACE_DEFINE(peerstats)
@@ -126,8 +127,93 @@ listing_t *peerstats_chose_alternative (listing_list_t *alts)
     return ret;
 }
 
+/* Up to <max> alternatives, favourites first and then the others in a random
+ * order, never blocked ones. The list can be empty. */
+listing_list_t *peerstats_chose_alternatives (listing_list_t *alts, unsigned max)
+{
+    config_reader_t *config = config_get_reader();
+    listing_list_t *fav_list, *normal_list, *block_list, *ret;
+    listing_list_t *from[2];
+    listing_t *li;
+    unsigned count = 0, i, j, k, n;
+    char *picked;
+
+
+    assert(alts);
+
+
+    srandom(time(NULL));
+
+
+    split_list(alts,
+               config_peers_favourites(config), config_peers_blocked(config),
+               &fav_list, &normal_list, &block_list);
+
+    ret = listing_list_new(MIN(max, listing_list_get_count(fav_list) +
+                                    listing_list_get_count(normal_list)));
+    from[0] = fav_list;
+    from[1] = normal_list;
+
+    for (i = 0; i < 2; ++i)
+    {
+        /* Pick the n'th of the ones not picked yet, n at random */
+        picked = calloc(1, listing_list_get_count(from[i]) + 1);
+        for (n = listing_list_get_count(from[i]); n && count < max; --n)
+        {
+            k = random() % n;
+            for (j = 0; picked[j] || k--; ++j);
+            picked[j] = 1;
+
+            li = listing_list_get_item(from[i], j);
+            listing_list_set_item(ret, count++, li);
+            listing_delete(CALLER_INFO li);
+        }
+        free(picked);
+    }
+
+    peerstats_trace("chose %u alternatives\n", count);
+
+
+    listing_list_delete(CALLER_INFO fav_list   );
+    listing_list_delete(CALLER_INFO normal_list);
+    listing_list_delete(CALLER_INFO block_list );
+
+    config_reader_delete(config);
 
-/* TODO: this looks a bit O(n^2) */
+
+    return ret;
+}
+
+
+/* Pooled copies of the strings in a NULL-terminated array, likewise
+ * terminated */
+static const char **strings_pool (char **strings)
+{
+    const char **pooled;
+    unsigned count = 0, i;
+
+
+    while (strings && strings[count]) count++;
+
+    pooled = malloc((count + 1) * sizeof(*pooled));
+    for (i = 0; i < count; ++i) pooled[i] = string_pool_intern(strings[i]);
+    pooled[count] = NULL;
+
+
+    return pooled;
+}
+
+static void strings_release (const char **pooled)
+{
+    unsigned i;
+
+
+    for (i = 0; pooled[i]; ++i) string_pool_release(pooled[i]);
+    free(pooled);
+}
+
+/* TODO: this looks a bit O(n^2), though with the clients pooled each step's
+ * just a pointer comparison */
 static void split_list (
     listing_list_t *alts,
     char **favs,
@@ -141,6 +227,8 @@ static void split_list (
     int found;
     listing_t *li;
     listing_list_t *fav_list, *block_list, *normal_list;
+    const char **fav_clients = strings_pool(favs),
+               **block_clients = strings_pool(blocks);
 
 
     fav_list    = listing_list_new(listing_list_get_count(alts));
@@ -153,36 +241,30 @@ static void split_list (
         li = listing_list_get_item(alts, i);
         found = 0;
 
-        if (favs)
+        j = 0;
+        while (fav_clients[j])
         {
-            j = 0;
-            while (favs[j])
+            if (listing_is_from_client(li, fav_clients[j]))
             {
-                if (!strcmp(listing_get_client(li), favs[j]))
-                {
-                    listing_list_set_item(fav_list, fav_count++, li);
-                    found = 1;
-                    break;
-                }
-                j++;
+                listing_list_set_item(fav_list, fav_count++, li);
+                found = 1;
+                break;
             }
+            j++;
         }
 
         if (!found)
         {
-            if (blocks)
+            j = 0;
+            while (block_clients[j])
             {
-                j = 0;
-                while (blocks[j])
+                if (listing_is_from_client(li, block_clients[j]))
                 {
-                    if (!strcmp(listing_get_client(li), blocks[j]))
-                    {
-                        listing_list_set_item(block_list, block_count++, li);
-                        found = 1;
-                        break;
-                    }
-                    j++;
+                    listing_list_set_item(block_list, block_count++, li);
+                    found = 1;
+                    break;
                 }
+                j++;
             }
         }
 
@@ -200,6 +282,8 @@ static void split_list (
     listing_list_resize(block_list,  block_count );
     listing_list_resize(normal_list, normal_count);
 
+    strings_release(fav_clients);
+    strings_release(block_clients);
 
     *fav_list_out = fav_list;
     *block_list_out = block_list;
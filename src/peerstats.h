@@ -19,5 +19,6 @@ TRACE_DECLARE(peerstats)
 
 
 extern listing_t *peerstats_chose_alternative (listing_list_t *lis);
+extern listing_list_t *peerstats_chose_alternatives (listing_list_t *lis, unsigned max);
 
 #endif /* _INCLUDED_PEERSTATS_H */
@@ -2,19 +2,49 @@
  * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
  *
  * Reference-counting class.
- *
+ * Embedded in the object it counts, and lock-free. Taking a reference needs no
+ * ordering (whoever's copying already has one, so the object can't go away),
+ * but dropping one has to release everything this thread did to the object,
+ * and the last drop has to acquire what everyone else did, before it's freed.
  */
 
 #ifndef _INCLUDED_REF_COUNT_H
 #define _INCLUDED_REF_COUNT_H
 
-typedef struct _ref_count_t ref_count_t;
+#include <assert.h>
+
+typedef struct
+{
+    unsigned count;
+} ref_count_t;
+
+
+static inline void ref_count_init( ref_count_t *refc )
+{
+    __atomic_store_n( &refc->count, 1, __ATOMIC_RELAXED );
+}
+
+static inline unsigned ref_count_inc( ref_count_t *refc )
+{
+    unsigned count = __atomic_add_fetch( &refc->count, 1, __ATOMIC_RELAXED );
+
+
+    assert( count > 1 );
+
+
+    return count;
+}
+
+/* Returns the count left; once it's 0 the caller can free the object */
+static inline unsigned ref_count_dec( ref_count_t *refc )
+{
+    unsigned count = __atomic_fetch_sub( &refc->count, 1, __ATOMIC_ACQ_REL );
+
 
+    assert( count );
 
-extern ref_count_t *ref_count_new( );
-extern void ref_count_delete( ref_count_t *refc );
 
-extern unsigned ref_count_inc( ref_count_t *refc /* logger, maybe null */ );
-extern unsigned ref_count_dec( ref_count_t *refc );
+    return count - 1;
+}
 
 #endif /* _INCLUDED_REF_COUNT_H */
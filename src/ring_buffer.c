@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Fixed-size byte FIFO. Data is written at the tail and read from the head,
+ * wrapping around the end of the array.
+ */
+
+#include "common.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring_buffer.h"
+
+
+struct _ring_buffer_t
+{
+    size_t size;
+    size_t head; /* index of the first byte */
+    size_t len;
+    char *data;
+};
+
+
+ring_buffer_t *ring_buffer_new( size_t size )
+{
+    ring_buffer_t *rb = calloc( 1, sizeof(*rb) );
+
+
+    assert( size );
+
+    rb->size = size;
+    rb->data = malloc( size );
+
+
+    return rb;
+}
+
+void ring_buffer_delete( ring_buffer_t *rb )
+{
+    free( rb->data );
+    free( rb );
+}
+
+size_t ring_buffer_get_len( ring_buffer_t *rb )
+{
+    return rb->len;
+}
+
+size_t ring_buffer_get_space( ring_buffer_t *rb )
+{
+    return rb->size - rb->len;
+}
+
+size_t ring_buffer_write( ring_buffer_t *rb, const void *data, size_t len )
+{
+    size_t tail, first;
+
+
+    len = MIN( len, ring_buffer_get_space( rb ) );
+    tail = (rb->head + rb->len) % rb->size;
+    first = MIN( len, rb->size - tail );
+
+    memcpy( rb->data + tail, data, first );
+    memcpy( rb->data, (const char *)data + first, len - first );
+    rb->len += len;
+
+
+    return len;
+}
+
+size_t ring_buffer_read( ring_buffer_t *rb, void *buf, size_t len )
+{
+    size_t first;
+
+
+    len = MIN( len, rb->len );
+    first = MIN( len, rb->size - rb->head );
+
+    memcpy( buf, rb->data + rb->head, first );
+    memcpy( (char *)buf + first, rb->data, len - first );
+
+
+    return ring_buffer_drop( rb, len );
+}
+
+size_t ring_buffer_drop( ring_buffer_t *rb, size_t len )
+{
+    len = MIN( len, rb->len );
+
+    rb->head = (rb->head + len) % rb->size;
+    rb->len -= len;
+
+
+    return len;
+}
+
+void ring_buffer_clear( ring_buffer_t *rb )
+{
+    rb->head = 0;
+    rb->len = 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Fixed-size byte FIFO. Not thread-safe.
+ */
+
+#ifndef _INCLUDED_RING_BUFFER_H
+#define _INCLUDED_RING_BUFFER_H
+
+#include "common.h"
+
+#include <stddef.h>
+
+
+typedef struct _ring_buffer_t ring_buffer_t;
+
+
+extern ring_buffer_t *ring_buffer_new( size_t size );
+extern void ring_buffer_delete( ring_buffer_t *rb );
+
+extern size_t ring_buffer_get_len( ring_buffer_t *rb );
+extern size_t ring_buffer_get_space( ring_buffer_t *rb );
+
+/* These return how many bytes they actually wrote / read / dropped, which is
+ * less than <len> if the ring's full / empty */
+extern size_t ring_buffer_write( ring_buffer_t *rb, const void *data, size_t len );
+extern size_t ring_buffer_read( ring_buffer_t *rb, void *buf, size_t len );
+extern size_t ring_buffer_drop( ring_buffer_t *rb, size_t len );
+extern void ring_buffer_clear( ring_buffer_t *rb );
+
+#endif /* _INCLUDED_RING_BUFFER_H */
@@ -0,0 +1,697 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Scheduler implementation.
+ * Each worker has a queue of tasks, protected by its own lock. A worker takes
+ * tasks from the front of its own queue and, when that's empty, steals from the
+ * back of the others'. Workers with nothing to do sleep on a single condition
+ * variable, counting the tasks queued anywhere.
+ * New tasks are spread across the workers' queues in turn, and go back to the
+ * same one (their "home") whenever they're woken, so a file's work tends to
+ * stay on one worker.
+ * Tasks that want waking later go on a list ordered by when; sleeping workers
+ * only sleep until the first of those is due, and whichever gets there first
+ * wakes it.
+ *
+ * Like the fetcher engine, the threads are started on first use, so that they
+ * survive fuse_daemonize().
+ */
+
+#include "common.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scheduler.h"
+
+#include "config_manager.h"
+#include "config_reader.h"
+#include "queue.h"
+
+
+TRACE_DEFINE(scheduler)
+
+
+typedef enum
+{
+    task_state_IDLE,
+    task_state_QUEUED,
+    task_state_RUNNING
+} task_state_t;
+
+typedef enum
+{
+    slot_state_NONE,
+    slot_state_WAITING,
+    slot_state_HELD
+} slot_state_t;
+
+typedef struct _worker_t worker_t;
+
+struct _scheduler_task_t
+{
+    scheduler_run_cb_t run;
+    void *ctxt;
+    worker_t *home;
+
+    pthread_mutex_t lock; /* protects state, rerun and deleted */
+    task_state_t state;
+    int rerun;
+    int deleted;
+    TAILQ_ENTRY(_scheduler_task_t) queue;
+
+    /* Protected by s_lock */
+    int timer_set;
+    struct timespec timer_due;
+    TAILQ_ENTRY(_scheduler_task_t) timer_list;
+
+    /* Protected by s_slots_lock */
+    slot_state_t slot_state;
+    const char *slot_peer;
+    int idle;
+    int yield;
+    TAILQ_ENTRY(_scheduler_task_t) slot_list; /* waiting or idle */
+};
+
+typedef TAILQ_HEAD(_task_list_t,_scheduler_task_t) task_list_t;
+
+struct _worker_t
+{
+    pthread_t thread;
+    pthread_mutex_t lock; /* protects tasks */
+    task_list_t tasks;
+};
+
+typedef struct _peer_count_t
+{
+    const char *peer;
+    unsigned count;
+    TAILQ_ENTRY(_peer_count_t) next;
+} peer_count_t;
+
+
+static worker_t *s_workers = NULL;
+static unsigned s_worker_count = 0;
+static unsigned s_next_home = 0;
+
+/* Protects s_started, s_pending, s_quit, s_next_home and s_timers */
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_cond = PTHREAD_COND_INITIALIZER;
+static int s_started = 0;
+static unsigned s_pending = 0;
+static int s_quit = 0;
+static task_list_t s_timers = TAILQ_HEAD_INITIALIZER(s_timers);
+
+static pthread_mutex_t s_slots_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned s_slots_max_total;
+static unsigned s_slots_max_per_peer;
+static unsigned s_slots_in_use = 0;
+static TAILQ_HEAD(_peer_count_list_t,_peer_count_t) s_peer_counts = TAILQ_HEAD_INITIALIZER(s_peer_counts);
+static task_list_t s_slot_waiters = TAILQ_HEAD_INITIALIZER(s_slot_waiters);
+static task_list_t s_slot_idlers = TAILQ_HEAD_INITIALIZER(s_slot_idlers);
+
+
+static void *worker_main( void *arg );
+static void slot_release( scheduler_task_t *task );
+
+
+static int timespec_before( const struct timespec *a, const struct timespec *b )
+{
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+
+/* ========================================================================== */
+/*      Init & Teardown                                                       */
+/* ========================================================================== */
+
+int scheduler_init( void )
+{
+    config_reader_t *config = config_get_reader( );
+    long cores;
+    unsigned i;
+
+
+    s_worker_count = config_scheduler_threads( config );
+    if( !s_worker_count )
+    {
+        cores = sysconf( _SC_NPROCESSORS_ONLN );
+        s_worker_count = cores > 0 ? cores : 1;
+    }
+
+    s_workers = calloc( s_worker_count, sizeof(*s_workers) );
+    for( i = 0; i < s_worker_count; i++ )
+    {
+        pthread_mutex_init( &s_workers[ i ].lock, NULL );
+        TAILQ_INIT( &s_workers[ i ].tasks );
+    }
+
+    s_slots_max_total    = MAX( config_scheduler_transfers_max_total( config ), 1 );
+    s_slots_max_per_peer = MAX( config_scheduler_transfers_max_per_peer( config ), 1 );
+
+    config_reader_delete( config );
+
+
+    return 0;
+}
+
+static void scheduler_start( void )
+{
+    unsigned i;
+
+
+    pthread_mutex_lock( &s_lock );
+
+    if( !s_started )
+    {
+        scheduler_trace( "starting %u scheduler workers\n", s_worker_count );
+
+        for( i = 0; i < s_worker_count; i++ )
+        {
+            assert( !pthread_create( &s_workers[ i ].thread, NULL, &worker_main, &s_workers[ i ] ) );
+        }
+
+        s_started = 1;
+    }
+
+    pthread_mutex_unlock( &s_lock );
+}
+
+void scheduler_finalise( void )
+{
+    unsigned i;
+
+
+    pthread_mutex_lock( &s_lock );
+    s_quit = 1;
+    pthread_cond_broadcast( &s_cond );
+    pthread_mutex_unlock( &s_lock );
+
+    for( i = 0; i < s_worker_count; i++ )
+    {
+        if( s_started ) pthread_join( s_workers[ i ].thread, NULL );
+        pthread_mutex_destroy( &s_workers[ i ].lock );
+    }
+
+    free( s_workers );
+    s_workers = NULL;
+    s_worker_count = 0;
+    s_started = 0;
+    s_quit = 0;
+}
+
+
+/* ========================================================================== */
+/*      Tasks                                                                 */
+/* ========================================================================== */
+
+scheduler_task_t *scheduler_task_new( scheduler_run_cb_t run, void *ctxt )
+{
+    scheduler_task_t *task = calloc( 1, sizeof(*task) );
+
+
+    task->run = run;
+    task->ctxt = ctxt;
+    pthread_mutex_init( &task->lock, NULL );
+
+    pthread_mutex_lock( &s_lock );
+    task->home = &s_workers[ s_next_home++ % s_worker_count ];
+    pthread_mutex_unlock( &s_lock );
+
+
+    return task;
+}
+
+void scheduler_task_delete( scheduler_task_t *task )
+{
+    pthread_mutex_lock( &task->lock );
+    assert( task->state == task_state_RUNNING );
+    task->deleted = 1;
+    pthread_mutex_unlock( &task->lock );
+}
+
+static void task_free( scheduler_task_t *task )
+{
+    slot_release( task );
+
+    pthread_mutex_lock( &s_lock );
+    if( task->timer_set ) TAILQ_REMOVE( &s_timers, task, timer_list );
+    pthread_mutex_unlock( &s_lock );
+
+    pthread_mutex_destroy( &task->lock );
+    free( task );
+}
+
+static void worker_enqueue( worker_t *worker, scheduler_task_t *task )
+{
+    pthread_mutex_lock( &worker->lock );
+    TAILQ_INSERT_TAIL( &worker->tasks, task, queue );
+    pthread_mutex_unlock( &worker->lock );
+}
+
+/* Counts the task in before it's queued, as timers_fire() does, so a worker
+ * can't take it and count it out first */
+static void worker_push( worker_t *worker, scheduler_task_t *task )
+{
+    pthread_mutex_lock( &s_lock );
+    s_pending++;
+    worker_enqueue( worker, task );
+    pthread_cond_signal( &s_cond );
+    pthread_mutex_unlock( &s_lock );
+}
+
+/* Returns true if the task needs to go on a queue */
+static int task_mark_woken( scheduler_task_t *task )
+{
+    int push = 0;
+
+
+    pthread_mutex_lock( &task->lock );
+    switch( task->state )
+    {
+        case task_state_IDLE:
+            task->state = task_state_QUEUED;
+            push = 1;
+            break;
+        case task_state_QUEUED:
+            break;
+        case task_state_RUNNING:
+            task->rerun = 1;
+            break;
+    }
+    pthread_mutex_unlock( &task->lock );
+
+
+    return push;
+}
+
+void scheduler_task_wake( scheduler_task_t *task )
+{
+    scheduler_start( );
+
+    if( task_mark_woken( task ) ) worker_push( task->home, task );
+}
+
+void scheduler_task_wake_after( scheduler_task_t *task, unsigned ms )
+{
+    scheduler_task_t *t;
+
+
+    scheduler_start( );
+
+    pthread_mutex_lock( &s_lock );
+
+    if( task->timer_set ) TAILQ_REMOVE( &s_timers, task, timer_list );
+
+    clock_gettime( CLOCK_REALTIME, &task->timer_due );
+    task->timer_due.tv_sec  += ms / 1000;
+    task->timer_due.tv_nsec += (ms % 1000) * 1000000L;
+    if( task->timer_due.tv_nsec >= 1000000000L )
+    {
+        task->timer_due.tv_sec++;
+        task->timer_due.tv_nsec -= 1000000000L;
+    }
+    task->timer_set = 1;
+
+    TAILQ_FOREACH( t, &s_timers, timer_list )
+    {
+        if( timespec_before( &task->timer_due, &t->timer_due ) ) break;
+    }
+    if( t )
+    {
+        TAILQ_INSERT_BEFORE( t, task, timer_list );
+    }
+    else
+    {
+        TAILQ_INSERT_TAIL( &s_timers, task, timer_list );
+    }
+
+    /* The sleepers might need to get up sooner than they thought */
+    if( TAILQ_FIRST( &s_timers ) == task ) pthread_cond_broadcast( &s_cond );
+
+    pthread_mutex_unlock( &s_lock );
+}
+
+
+/* ========================================================================== */
+/*      Workers                                                               */
+/* ========================================================================== */
+
+static scheduler_task_t *worker_trypop( worker_t *worker, int steal )
+{
+    scheduler_task_t *task;
+
+
+    pthread_mutex_lock( &worker->lock );
+
+    task = steal ? TAILQ_LAST( &worker->tasks, _task_list_t ) :
+                   TAILQ_FIRST( &worker->tasks );
+    if( task ) TAILQ_REMOVE( &worker->tasks, task, queue );
+
+    pthread_mutex_unlock( &worker->lock );
+
+
+    return task;
+}
+
+/* Call with s_lock held */
+static int timer_is_due( void )
+{
+    struct timespec now;
+
+
+    if( TAILQ_EMPTY( &s_timers ) ) return 0;
+
+    clock_gettime( CLOCK_REALTIME, &now );
+
+
+    return !timespec_before( &now, &TAILQ_FIRST( &s_timers )->timer_due );
+}
+
+/* Wakes the tasks whose time has come. Everything's done under s_lock, as
+ * that's what stops them being freed under us.
+ * Call with s_lock held */
+static void timers_fire( void )
+{
+    scheduler_task_t *task;
+
+
+    while( timer_is_due( ) )
+    {
+        task = TAILQ_FIRST( &s_timers );
+        TAILQ_REMOVE( &s_timers, task, timer_list );
+        task->timer_set = 0;
+
+        if( task_mark_woken( task ) )
+        {
+            worker_enqueue( task->home, task );
+            s_pending++;
+            pthread_cond_signal( &s_cond );
+        }
+    }
+}
+
+static scheduler_task_t *task_get_next( worker_t *self )
+{
+    scheduler_task_t *task = NULL;
+    unsigned me = self - s_workers, i;
+    int quit;
+
+
+    while( !task )
+    {
+        pthread_mutex_lock( &s_lock );
+        timers_fire( );
+        while( !s_pending && !s_quit )
+        {
+            if( TAILQ_EMPTY( &s_timers ) )
+            {
+                pthread_cond_wait( &s_cond, &s_lock );
+            }
+            else
+            {
+                pthread_cond_timedwait( &s_cond, &s_lock, &TAILQ_FIRST( &s_timers )->timer_due );
+            }
+            timers_fire( );
+        }
+        quit = s_quit;
+        pthread_mutex_unlock( &s_lock );
+
+        if( quit ) break;
+
+        /* Our own first, then everyone else's, starting with our neighbour
+         * so that thieves spread out */
+        task = worker_trypop( self, 0 );
+        for( i = 1; !task && i < s_worker_count; i++ )
+        {
+            task = worker_trypop( &s_workers[ (me + i) % s_worker_count ], 1 );
+        }
+
+        if( task )
+        {
+            pthread_mutex_lock( &s_lock );
+            s_pending--;
+            pthread_mutex_unlock( &s_lock );
+        }
+    }
+
+
+    return task;
+}
+
+/* This is the entry point for scheduler worker threads. */
+static void *worker_main( void *arg )
+{
+    worker_t *self = (worker_t *)arg;
+    scheduler_task_t *task;
+    int deleted, again;
+
+
+    while( (task = task_get_next( self )) )
+    {
+        pthread_mutex_lock( &task->lock );
+        task->state = task_state_RUNNING;
+        task->rerun = 0;
+        pthread_mutex_unlock( &task->lock );
+
+        task->run( task->ctxt );
+
+        pthread_mutex_lock( &task->lock );
+        deleted = task->deleted;
+        again = task->rerun && !deleted;
+        task->state = again ? task_state_QUEUED : task_state_IDLE;
+        pthread_mutex_unlock( &task->lock );
+
+        if( deleted )
+        {
+            task_free( task );
+        }
+        else if( again )
+        {
+            /* It's hot, so it stays with us */
+            worker_push( self, task );
+        }
+    }
+
+
+    return NULL;
+}
+
+
+/* ========================================================================== */
+/*      Transfer slots                                                        */
+/* ========================================================================== */
+
+/* All of these are called with s_slots_lock held */
+
+static peer_count_t *peer_count_get( const char *peer, int create )
+{
+    peer_count_t *pc;
+
+
+    TAILQ_FOREACH( pc, &s_peer_counts, next )
+    {
+        if( !strcmp( pc->peer, peer ) ) break;
+    }
+
+    if( !pc && create )
+    {
+        pc = calloc( 1, sizeof(*pc) );
+        pc->peer = strdup( peer );
+        TAILQ_INSERT_TAIL( &s_peer_counts, pc, next );
+    }
+
+
+    return pc;
+}
+
+static int slot_available( const char *peer )
+{
+    peer_count_t *pc = peer_count_get( peer, 0 );
+
+
+    return s_slots_in_use < s_slots_max_total &&
+           (!pc || pc->count < s_slots_max_per_peer);
+}
+
+static void slot_take( scheduler_task_t *task )
+{
+    s_slots_in_use++;
+    peer_count_get( task->slot_peer, 1 )->count++;
+    task->slot_state = slot_state_HELD;
+}
+
+/* Someone's waiting; if an idle transfer is in the way, ask it to move */
+static void idler_nudge( const char *peer )
+{
+    scheduler_task_t *task;
+    int global_full = s_slots_in_use >= s_slots_max_total;
+
+
+    TAILQ_FOREACH( task, &s_slot_idlers, slot_list )
+    {
+        if( !task->yield &&
+            (global_full || !strcmp( task->slot_peer, peer )) )
+        {
+            task->yield = 1;
+            scheduler_task_wake( task );
+            break;
+        }
+    }
+}
+
+static void waiters_grant( void )
+{
+    scheduler_task_t *task, *next;
+
+
+    for( task = TAILQ_FIRST( &s_slot_waiters ); task; task = next )
+    {
+        next = TAILQ_NEXT( task, slot_list );
+
+        if( slot_available( task->slot_peer ) )
+        {
+            TAILQ_REMOVE( &s_slot_waiters, task, slot_list );
+            slot_take( task );
+
+            scheduler_task_wake( task );
+        }
+    }
+}
+
+static void slot_release( scheduler_task_t *task )
+{
+    peer_count_t *pc;
+
+
+    pthread_mutex_lock( &s_slots_lock );
+
+    switch( task->slot_state )
+    {
+        case slot_state_NONE:
+            break;
+
+        case slot_state_WAITING:
+            TAILQ_REMOVE( &s_slot_waiters, task, slot_list );
+            break;
+
+        case slot_state_HELD:
+            if( task->idle ) TAILQ_REMOVE( &s_slot_idlers, task, slot_list );
+
+            s_slots_in_use--;
+            pc = peer_count_get( task->slot_peer, 0 );
+            if( !--pc->count )
+            {
+                TAILQ_REMOVE( &s_peer_counts, pc, next );
+                free_const( pc->peer );
+                free( pc );
+            }
+
+            waiters_grant( );
+            break;
+    }
+
+    if( task->slot_peer ) free_const( task->slot_peer );
+    task->slot_peer = NULL;
+    task->slot_state = slot_state_NONE;
+    task->idle = 0;
+    task->yield = 0;
+
+    pthread_mutex_unlock( &s_slots_lock );
+}
+
+int scheduler_transfer_tryget( scheduler_task_t *task, const char *peer )
+{
+    int rc = 0;
+
+
+    pthread_mutex_lock( &s_slots_lock );
+
+    switch( task->slot_state )
+    {
+        case slot_state_HELD:
+            rc = 1;
+            break;
+
+        case slot_state_WAITING:
+            break;
+
+        case slot_state_NONE:
+            task->slot_peer = strdup( peer );
+
+            if( slot_available( peer ) )
+            {
+                slot_take( task );
+                rc = 1;
+            }
+            else
+            {
+                scheduler_trace( "no transfer slot for %s; waiting\n", peer );
+
+                task->slot_state = slot_state_WAITING;
+                TAILQ_INSERT_TAIL( &s_slot_waiters, task, slot_list );
+                idler_nudge( peer );
+            }
+            break;
+    }
+
+    pthread_mutex_unlock( &s_slots_lock );
+
+
+    return rc;
+}
+
+void scheduler_transfer_release( scheduler_task_t *task )
+{
+    slot_release( task );
+}
+
+void scheduler_transfer_set_idle( scheduler_task_t *task, int idle )
+{
+    pthread_mutex_lock( &s_slots_lock );
+
+    assert( task->slot_state == slot_state_HELD );
+
+    if( idle && !task->idle )
+    {
+        TAILQ_INSERT_TAIL( &s_slot_idlers, task, slot_list );
+
+        /* Might already be in the way */
+        if( !TAILQ_EMPTY( &s_slot_waiters ) )
+        {
+            idler_nudge( TAILQ_FIRST( &s_slot_waiters )->slot_peer );
+        }
+    }
+    else if( !idle && task->idle )
+    {
+        TAILQ_REMOVE( &s_slot_idlers, task, slot_list );
+        task->yield = 0;
+    }
+    task->idle = idle;
+
+    pthread_mutex_unlock( &s_slots_lock );
+}
+
+int scheduler_transfer_should_yield( scheduler_task_t *task )
+{
+    int rc;
+
+
+    pthread_mutex_lock( &s_slots_lock );
+    rc = task->yield;
+    pthread_mutex_unlock( &s_slots_lock );
+
+
+    return rc;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * Scheduler API.
+ * A fixed pool of worker threads (one per core by default) that run tasks. A
+ * task is a queue of work for one thing - an open file, say - and it's run on a
+ * worker whenever it's woken. Each task lives on one worker's queue, but idle
+ * workers steal from busy ones. A task is never run on two workers at once.
+ *
+ * The scheduler also hands out transfer slots, so that we never have more than
+ * so many transfers going at once, in total or to any one peer.
+ */
+
+#ifndef _INCLUDED_SCHEDULER_H
+#define _INCLUDED_SCHEDULER_H
+
+#include "common.h"
+
+#include "trace.h"
+
+
+TRACE_DECLARE(scheduler)
+#define scheduler_trace(...) TRACE(scheduler,__VA_ARGS__)
+#define scheduler_trace_indent() TRACE_INDENT(scheduler)
+#define scheduler_trace_dedent() TRACE_DEDENT(scheduler)
+
+
+typedef struct _scheduler_task_t scheduler_task_t;
+
+typedef void (*scheduler_run_cb_t)( void *ctxt );
+
+
+extern int scheduler_init( void );
+extern void scheduler_finalise( void );
+
+extern scheduler_task_t *scheduler_task_new( scheduler_run_cb_t run, void *ctxt );
+/* Must be called from the task's own run callback. It's freed (and any
+ * transfer slot it has released) when that returns. */
+extern void scheduler_task_delete( scheduler_task_t *task );
+/* Run the task soon. Waking a task that's already waiting to run does nothing;
+ * waking one that's running makes it run again afterwards. Any thread. */
+extern void scheduler_task_wake( scheduler_task_t *task );
+/* Wake the task once <ms> have passed. Asking again before then moves the time
+ * rather than adding another. Any thread. */
+extern void scheduler_task_wake_after( scheduler_task_t *task, unsigned ms );
+
+/* Returns 1 if the task has (or has now got) a transfer slot for <peer>.
+ * Otherwise it's queued for one, and woken when it's been given one. */
+extern int scheduler_transfer_tryget( scheduler_task_t *task, const char *peer );
+/* Gives up the task's slot, or its place in the queue for one */
+extern void scheduler_transfer_release( scheduler_task_t *task );
+/* A task with an idle transfer (e.g. a paused one) should say so. If someone
+ * else is waiting for its slot it'll be woken and asked to yield. */
+extern void scheduler_transfer_set_idle( scheduler_task_t *task, int idle );
+extern int scheduler_transfer_should_yield( scheduler_task_t *task );
+
+#endif /* _INCLUDED_SCHEDULER_H */
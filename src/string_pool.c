@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * String pool.
+ * A hash table of reference-counted strings, split into shards by hash, each
+ * with its own lock, so that threads interning and releasing different strings
+ * rarely contend. Each string lives in the same allocation as its entry, just
+ * after its reference count, which is how a pooled string finds its way back.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "string_pool.h"
+
+
+#define SHARD_BITS 6
+#define SHARDS (1 << SHARD_BITS)
+/* Power of two */
+#define BUCKETS_MIN 64
+
+
+typedef struct _entry_t
+{
+    struct _entry_t *next;
+    uint32_t hash;
+    unsigned refs;
+    char s[];
+} entry_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    entry_t **buckets;
+    unsigned size; /* power of two */
+    unsigned count;
+} shard_t;
+
+
+static shard_t s_shards[SHARDS];
+
+
+int string_pool_init( void )
+{
+    unsigned i;
+
+
+    for( i = 0; i < SHARDS; i++ )
+    {
+        pthread_mutex_init( &s_shards[ i ].lock, NULL );
+        s_shards[ i ].size = BUCKETS_MIN;
+        s_shards[ i ].buckets = calloc( BUCKETS_MIN, sizeof(*s_shards[ i ].buckets) );
+        s_shards[ i ].count = 0;
+    }
+
+
+    return 0;
+}
+
+void string_pool_finalise( void )
+{
+    entry_t *entry, *next;
+    unsigned i, j;
+
+
+    for( i = 0; i < SHARDS; i++ )
+    {
+        for( j = 0; j < s_shards[ i ].size; j++ )
+        {
+            for( entry = s_shards[ i ].buckets[ j ]; entry; entry = next )
+            {
+                next = entry->next;
+                free( entry );
+            }
+        }
+
+        free( s_shards[ i ].buckets );
+        s_shards[ i ].buckets = NULL;
+        pthread_mutex_destroy( &s_shards[ i ].lock );
+    }
+}
+
+/* FNV-1a */
+static uint32_t string_hash( const char *s )
+{
+    uint32_t hash = UINT32_C(2166136261);
+
+
+    while( *s )
+    {
+        hash ^= (unsigned char)*s++;
+        hash *= UINT32_C(16777619);
+    }
+
+
+    return hash;
+}
+
+static shard_t *shard_get( uint32_t hash )
+{
+    return &s_shards[ hash >> (32 - SHARD_BITS) ];
+}
+
+static entry_t **bucket_get( shard_t *shard, uint32_t hash )
+{
+    return &shard->buckets[ hash & (shard->size - 1) ];
+}
+
+static entry_t *entry_from_pooled( const char *pooled )
+{
+    return (entry_t *)(pooled - offsetof(entry_t, s));
+}
+
+/* Call with the shard locked */
+static void shard_grow( shard_t *shard )
+{
+    entry_t **old_buckets = shard->buckets, *entry, *next, **bucket;
+    unsigned old_size = shard->size, i;
+
+
+    shard->size *= 2;
+    shard->buckets = calloc( shard->size, sizeof(*shard->buckets) );
+
+    for( i = 0; i < old_size; i++ )
+    {
+        for( entry = old_buckets[ i ]; entry; entry = next )
+        {
+            next = entry->next;
+            bucket = bucket_get( shard, entry->hash );
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+
+    free( old_buckets );
+}
+
+const char *string_pool_intern( const char *s )
+{
+    uint32_t hash;
+    shard_t *shard;
+    entry_t **bucket, *entry;
+    size_t len;
+
+
+    if( !s ) return NULL;
+
+    hash = string_hash( s );
+    shard = shard_get( hash );
+
+    pthread_mutex_lock( &shard->lock );
+
+    bucket = bucket_get( shard, hash );
+    for( entry = *bucket; entry; entry = entry->next )
+    {
+        if( entry->hash == hash && !strcmp( entry->s, s ) ) break;
+    }
+
+    if( entry )
+    {
+        entry->refs++;
+    }
+    else
+    {
+        len = strlen( s );
+        entry = malloc( sizeof(*entry) + len + 1 );
+        entry->hash = hash;
+        entry->refs = 1;
+        memcpy( entry->s, s, len + 1 );
+
+        entry->next = *bucket;
+        *bucket = entry;
+
+        if( ++shard->count > shard->size ) shard_grow( shard );
+    }
+
+    pthread_mutex_unlock( &shard->lock );
+
+
+    return entry->s;
+}
+
+const char *string_pool_copy( const char *pooled )
+{
+    entry_t *entry;
+    shard_t *shard;
+
+
+    if( !pooled ) return NULL;
+
+    entry = entry_from_pooled( pooled );
+    shard = shard_get( entry->hash );
+
+    pthread_mutex_lock( &shard->lock );
+    entry->refs++;
+    pthread_mutex_unlock( &shard->lock );
+
+
+    return pooled;
+}
+
+void string_pool_release( const char *pooled )
+{
+    entry_t *entry, **link;
+    shard_t *shard;
+    int gone = 0;
+
+
+    if( !pooled ) return;
+
+    entry = entry_from_pooled( pooled );
+    shard = shard_get( entry->hash );
+
+    pthread_mutex_lock( &shard->lock );
+
+    assert( entry->refs );
+    if( !--entry->refs )
+    {
+        for( link = bucket_get( shard, entry->hash ); *link != entry; link = &(*link)->next );
+        *link = entry->next;
+        shard->count--;
+        gone = 1;
+    }
+
+    pthread_mutex_unlock( &shard->lock );
+
+
+    if( gone ) free( entry );
+}
+
+unsigned string_pool_get_count( void )
+{
+    unsigned i, count = 0;
+
+
+    for( i = 0; i < SHARDS; i++ )
+    {
+        pthread_mutex_lock( &s_shards[ i ].lock );
+        count += s_shards[ i ].count;
+        pthread_mutex_unlock( &s_shards[ i ].lock );
+    }
+
+
+    return count;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+ *
+ * String pool. Interns strings, so that however many things hold a string
+ * there's only one copy of it, and two pooled strings are equal exactly when
+ * they're the same pointer. Pooled strings are ordinary C strings that mustn't
+ * be changed; each one handed out is a reference, which goes back with
+ * string_pool_release() rather than free(). NULL is passed through throughout.
+ * Thread-safe.
+ */
+
+#ifndef _INCLUDED_STRING_POOL_H
+#define _INCLUDED_STRING_POOL_H
+
+#include "common.h"
+
+
+extern int string_pool_init( void );
+extern void string_pool_finalise( void );
+
+/* The pooled copy of <s>, which isn't usurped */
+extern const char *string_pool_intern( const char *s );
+extern const char *string_pool_copy( const char *pooled );
+extern void string_pool_release( const char *pooled );
+
+/* How many different strings are in the pool */
+extern unsigned string_pool_get_count( void );
+
+#endif /* _INCLUDED_STRING_POOL_H */
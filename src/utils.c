@@ -15,6 +15,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <assert.h>
 
 #include "utils.h"
@@ -144,7 +145,7 @@ unsigned fsfuse_get_thread_index (void)
     if (!i)
     {
         i = (unsigned *)malloc(sizeof(unsigned));
-        *i = next_thread_index++;
+        *i = __atomic_fetch_add(&next_thread_index, 1, __ATOMIC_RELAXED);
         pthread_setspecific(thread_index_key, (void *)i);
     }
 
@@ -152,6 +153,17 @@ unsigned fsfuse_get_thread_index (void)
     return *i;
 }
 
+double fsfuse_get_time (void)
+{
+    struct timespec ts;
+
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 static void thread_index_destroy (void *i)
 {
     free((unsigned *)i);
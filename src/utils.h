@@ -15,6 +15,8 @@ extern char *fsfuse_basename (const char *path);
 extern char *path_combine (const char *a, const char *b);
 
 extern unsigned fsfuse_get_thread_index (void);
+/* Seconds since some arbitrary point; only good for measuring intervals */
+extern double fsfuse_get_time (void);
 
 extern int compare_dotted_version (const char *ver, const char *cmp);
 
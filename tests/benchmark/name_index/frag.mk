@@ -0,0 +1,9 @@
+#
+# Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+#
+# Name index benchmark makefile fragment.
+#
+
+HERE := $(ROOT)/tests/benchmark/name_index
+
+vpath %.c $(HERE)
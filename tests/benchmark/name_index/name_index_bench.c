@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Name index benchmark "driver" - provides the main() symbol, which builds a
+ * synthetic directory and times looking children up in it by walking the list
+ * of them, as direntry_get_child_by_name() used to (a refcount round-trip and a
+ * copy of the name at each step), against the index, and prints the results.
+ * Usage: fsfuse [entries [lookups]]
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "name_index.h"
+#include "ref_count.h"
+#include "utils.h"
+
+
+#define DEFAULT_ENTRIES 100000
+#define DEFAULT_LOOKUPS 2000
+
+
+/* Stands in for a direntry: a name, a refcount, and the next sibling */
+typedef struct _entry_t
+{
+    char *name;
+    ref_count_t ref_count;
+    struct _entry_t *next;
+} entry_t;
+
+static const char *entry_name( void *value )
+{
+    return ((entry_t *)value)->name;
+}
+
+static entry_t *entries_new( unsigned count )
+{
+    entry_t *entries = calloc( count, sizeof(*entries) );
+    char name[ 64 ];
+    unsigned i;
+
+
+    for( i = 0; i < count; i++ )
+    {
+        snprintf( name, sizeof(name), "Some Show - s%02ue%03u - An Episode.avi", i / 1000, i % 1000 );
+        entries[ i ].name = strdup( name );
+        ref_count_init( &entries[ i ].ref_count );
+        entries[ i ].next = (i + 1 < count) ? &entries[ i + 1 ] : NULL;
+    }
+
+
+    return entries;
+}
+
+static void entries_delete( entry_t *entries, unsigned count )
+{
+    unsigned i;
+
+
+    for( i = 0; i < count; i++ )
+    {
+        free( entries[ i ].name );
+    }
+    free( entries );
+}
+
+/* Each copy of an entry the walk takes, then drops */
+static entry_t *entry_copy( entry_t *entry )
+{
+    ref_count_inc( &entry->ref_count );
+
+
+    return entry;
+}
+
+static void entry_delete( entry_t *entry )
+{
+    ref_count_dec( &entry->ref_count );
+}
+
+static entry_t *walk_find( entry_t *first, const char *name )
+{
+    entry_t *child = entry_copy( first ), *old_child;
+    char *child_name;
+    int found;
+
+
+    while( child )
+    {
+        child_name = strdup( child->name );
+        found = !strcmp( child_name, name );
+        free( child_name );
+        if( found ) break;
+
+        old_child = child;
+        child = child->next ? entry_copy( child->next ) : NULL;
+        entry_delete( old_child );
+    }
+
+
+    return child;
+}
+
+static entry_t *index_find( name_index_t *index, const char *name )
+{
+    entry_t *child = name_index_get( index, name );
+
+
+    return child ? entry_copy( child ) : NULL;
+}
+
+
+int main( int argc, char **argv )
+{
+    unsigned entries_count = (argc > 1) ? strtoul( argv[ 1 ], NULL, 10 ) : DEFAULT_ENTRIES;
+    unsigned lookups = (argc > 2) ? strtoul( argv[ 2 ], NULL, 10 ) : DEFAULT_LOOKUPS;
+    entry_t *entries, *found;
+    name_index_t *index;
+    unsigned *targets, i, walk_hits = 0, index_hits = 0;
+    double start, build_secs, walk_secs, index_secs;
+
+
+    srandom( 42 );
+    entries = entries_new( entries_count );
+    targets = malloc( lookups * sizeof(*targets) );
+    for( i = 0; i < lookups; i++ ) targets[ i ] = random( ) % entries_count;
+
+    start = fsfuse_get_time( );
+    index = name_index_new( entries_count, &entry_name );
+    for( i = 0; i < entries_count; i++ ) name_index_add( index, &entries[ i ] );
+    build_secs = fsfuse_get_time( ) - start;
+
+    start = fsfuse_get_time( );
+    for( i = 0; i < lookups; i++ )
+    {
+        if( (found = walk_find( entries, entries[ targets[ i ] ].name )) )
+        {
+            walk_hits += (found == &entries[ targets[ i ] ]);
+            entry_delete( found );
+        }
+    }
+    walk_secs = fsfuse_get_time( ) - start;
+
+    start = fsfuse_get_time( );
+    for( i = 0; i < lookups; i++ )
+    {
+        if( (found = index_find( index, entries[ targets[ i ] ].name )) )
+        {
+            index_hits += (found == &entries[ targets[ i ] ]);
+            entry_delete( found );
+        }
+    }
+    index_secs = fsfuse_get_time( ) - start;
+
+    printf( "%u entries, %u lookups\n", entries_count, lookups );
+    printf( "index build      %10.1f ms\n", build_secs * 1e3 );
+    printf( "list walk        %10.1f ns/lookup\n", walk_secs * 1e9 / lookups );
+    printf( "index            %10.1f ns/lookup   speedup %.0fx%s\n",
+            index_secs * 1e9 / lookups,
+            walk_secs / index_secs,
+            (walk_hits == lookups && index_hits == lookups) ? "" : "   (MISSES!)" );
+
+    name_index_delete( index );
+    free( targets );
+    entries_delete( entries, entries_count );
+
+
+    return 0;
+}
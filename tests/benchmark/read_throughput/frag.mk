@@ -0,0 +1,9 @@
+#
+# Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+#
+# Read throughput benchmark makefile fragment.
+#
+
+HERE := $(ROOT)/tests/benchmark/read_throughput
+
+vpath %.c $(HERE)
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Read throughput benchmark "driver" - provides the main() symbol, which reads
+ * a file on a mounted fsfuse from start to end, split between some readers,
+ * twice (cold, then again once it's cached), and prints how fast each pass
+ * went. Like the integration tests, it needs a real mount: remount with one of
+ * the fuse/ settings (threads, clone_fd, max_read, max_readahead,
+ * max_background, congestion_threshold) changed between runs to see what it
+ * does, or with options/keep_cache off to see what the second pass owes to the
+ * kernel's page cache.
+ * Usage: fsfuse file [readers [read size]]
+ */
+
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+
+#define DEFAULT_READERS 1
+#define DEFAULT_READ_SIZE (128 * 1024)
+
+
+typedef struct
+{
+    const char *path;
+    off_t start;
+    off_t end;
+    size_t read_size;
+    off_t done;
+    int error;
+    pthread_t thread;
+} reader_t;
+
+
+/* Each reader has its own fd, and reads its part of the file in order, as a
+ * cp or a media player would */
+static void *reader_main( void *r_void )
+{
+    reader_t *r = (reader_t *)r_void;
+    char *buf = malloc( r->read_size );
+    ssize_t got;
+    int fd = open( r->path, O_RDONLY );
+
+
+    r->done = 0;
+    r->error = 0;
+
+    if( fd == -1 )
+    {
+        r->error = errno;
+    }
+    else
+    {
+        while( r->start + r->done < r->end )
+        {
+            got = pread( fd, buf, MIN( r->read_size, (size_t)(r->end - r->start - r->done) ), r->start + r->done );
+            if( got <= 0 )
+            {
+                r->error = got ? errno : EIO;
+                break;
+            }
+            r->done += got;
+        }
+
+        close( fd );
+    }
+
+    free( buf );
+
+
+    return NULL;
+}
+
+static double pass_run( reader_t *readers, unsigned count, off_t *total )
+{
+    double start = fsfuse_get_time( );
+    unsigned i;
+
+
+    for( i = 0; i < count; i++ )
+    {
+        pthread_create( &readers[ i ].thread, NULL, &reader_main, &readers[ i ] );
+    }
+
+    *total = 0;
+    for( i = 0; i < count; i++ )
+    {
+        pthread_join( readers[ i ].thread, NULL );
+        if( readers[ i ].error )
+        {
+            fprintf( stderr, "reader %u: %s\n", i, strerror( readers[ i ].error ) );
+        }
+        *total += readers[ i ].done;
+    }
+
+
+    return fsfuse_get_time( ) - start;
+}
+
+
+int main( int argc, char **argv )
+{
+    unsigned readers_count = (argc > 2) ? strtoul( argv[ 2 ], NULL, 10 ) : DEFAULT_READERS;
+    size_t read_size = (argc > 3) ? strtoul( argv[ 3 ], NULL, 10 ) : DEFAULT_READ_SIZE;
+    reader_t *readers;
+    struct stat st;
+    off_t part, total;
+    double secs;
+    unsigned i, pass;
+
+
+    if( argc < 2 || !readers_count || !read_size )
+    {
+        fprintf( stderr, "usage: %s file [readers [read size]]\n", argv[ 0 ] );
+        return 1;
+    }
+
+    if( stat( argv[ 1 ], &st ) )
+    {
+        perror( argv[ 1 ] );
+        return 1;
+    }
+
+    readers = calloc( readers_count, sizeof(*readers) );
+    part = st.st_size / readers_count;
+    for( i = 0; i < readers_count; i++ )
+    {
+        readers[ i ].path = argv[ 1 ];
+        readers[ i ].start = i * part;
+        readers[ i ].end = (i + 1 == readers_count) ? st.st_size : (i + 1) * part;
+        readers[ i ].read_size = read_size;
+    }
+
+    printf( "%jd bytes, %u readers, %zu byte reads\n", (intmax_t)st.st_size, readers_count, read_size );
+
+    for( pass = 0; pass < 2; pass++ )
+    {
+        secs = pass_run( readers, readers_count, &total );
+        printf( "%-6s %10.1f MiB/s  (%jd bytes in %.2f s)%s\n",
+                pass ? "warm" : "cold",
+                total / secs / (1024 * 1024),
+                (intmax_t)total, secs,
+                total == st.st_size ? "" : "   (SHORT!)" );
+    }
+
+    free( readers );
+
+
+    return 0;
+}
@@ -0,0 +1,9 @@
+#
+# Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+#
+# Ref count benchmark makefile fragment.
+#
+
+HERE := $(ROOT)/tests/benchmark/ref_count
+
+vpath %.c $(HERE)
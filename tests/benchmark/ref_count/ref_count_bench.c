@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Ref count benchmark "driver" - provides the main() symbol, which has some
+ * threads copy and delete the root direntry as fast as they can, all at once,
+ * and times it against the same done to a mutex-guarded count, as ref_count_t
+ * used to be, and prints the results.
+ * Usage: fsfuse [threads [copies per thread]]
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "direntry.h"
+#include "string_pool.h"
+#include "trace.h"
+#include "utils.h"
+
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_COPIES 1000000
+
+
+/* The old ref_count_t */
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned ref_count;
+} locked_count_t;
+
+static unsigned locked_count_inc( locked_count_t *refc )
+{
+    unsigned count;
+
+
+    pthread_mutex_lock( &refc->lock );
+    count = ++refc->ref_count;
+    pthread_mutex_unlock( &refc->lock );
+
+
+    return count;
+}
+
+static unsigned locked_count_dec( locked_count_t *refc )
+{
+    unsigned count;
+
+
+    pthread_mutex_lock( &refc->lock );
+    count = --refc->ref_count;
+    pthread_mutex_unlock( &refc->lock );
+
+
+    return count;
+}
+
+
+typedef struct
+{
+    void *target;
+    unsigned copies;
+    pthread_t thread;
+} worker_t;
+
+static void *locked_main( void *w_void )
+{
+    worker_t *w = (worker_t *)w_void;
+    unsigned i;
+
+
+    for( i = 0; i < w->copies; i++ )
+    {
+        locked_count_inc( w->target );
+        locked_count_dec( w->target );
+    }
+
+
+    return NULL;
+}
+
+static void *direntry_main( void *w_void )
+{
+    worker_t *w = (worker_t *)w_void;
+    unsigned i;
+
+
+    for( i = 0; i < w->copies; i++ )
+    {
+        direntry_copy( CALLER_INFO w->target );
+        direntry_delete( CALLER_INFO w->target );
+    }
+
+
+    return NULL;
+}
+
+static double run( void *(*main_fn)( void * ), void *target, unsigned threads, unsigned copies )
+{
+    worker_t *workers = calloc( threads, sizeof(*workers) );
+    double start = fsfuse_get_time( ), secs;
+    unsigned i;
+
+
+    for( i = 0; i < threads; i++ )
+    {
+        workers[ i ].target = target;
+        workers[ i ].copies = copies;
+        pthread_create( &workers[ i ].thread, NULL, main_fn, &workers[ i ] );
+    }
+    for( i = 0; i < threads; i++ )
+    {
+        pthread_join( workers[ i ].thread, NULL );
+    }
+    secs = fsfuse_get_time( ) - start;
+
+    free( workers );
+
+
+    return secs;
+}
+
+
+int main( int argc, char **argv )
+{
+    unsigned threads = (argc > 1) ? strtoul( argv[ 1 ], NULL, 10 ) : DEFAULT_THREADS;
+    unsigned copies = (argc > 2) ? strtoul( argv[ 2 ], NULL, 10 ) : DEFAULT_COPIES;
+    locked_count_t locked;
+    direntry_t *root;
+    double ops, locked_secs, atomic_secs;
+    unsigned n;
+
+
+    if( !threads || !copies )
+    {
+        fprintf( stderr, "usage: %s [threads [copies per thread]]\n", argv[ 0 ] );
+        return 1;
+    }
+
+    if( trace_init( ) || utils_init( ) || string_pool_init( ) || direntry_init( ) ||
+        direntry_get_by_inode( FSFUSE_ROOT_INODE, &root ) )
+    {
+        fprintf( stderr, "initialisation failed\n" );
+        return 1;
+    }
+
+    pthread_mutex_init( &locked.lock, NULL );
+    locked.ref_count = 1;
+
+    printf( "%u copy/delete pairs per thread\n", copies );
+
+    /* Uncontended first, to show what's down to the contention */
+    for( n = 1; n; n = (n < threads) ? threads : 0 )
+    {
+        ops = (double)n * copies;
+
+        locked_secs = run( &locked_main, &locked, n, copies );
+        atomic_secs = run( &direntry_main, root, n, copies );
+
+        printf( "%3u threads  mutex %8.1f ns/pair   atomic %8.1f ns/pair   speedup %.1fx\n",
+                n,
+                locked_secs * 1e9 / ops,
+                atomic_secs * 1e9 / ops,
+                locked_secs / atomic_secs );
+    }
+
+    direntry_delete( CALLER_INFO root );
+
+    pthread_mutex_destroy( &locked.lock );
+
+    direntry_finalise( );
+    string_pool_finalise( );
+    utils_finalise( );
+    trace_finalise( );
+
+
+    return 0;
+}
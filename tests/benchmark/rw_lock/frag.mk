@@ -0,0 +1,9 @@
+#
+# Copyright (C) 2008-2013 Matthew Turner. Distributed under the GPL v3.
+#
+# Readers / writer lock benchmark makefile fragment.
+#
+
+HERE := $(ROOT)/tests/benchmark/rw_lock
+
+vpath %.c $(HERE)
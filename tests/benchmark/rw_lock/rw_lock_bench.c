@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Readers / writer lock benchmark "driver" - provides the main() symbol, which
+ * has lots of readers take and drop a lock around reading a little shared
+ * state, as indexnodes_get() does, while a writer changes it every millisecond
+ * or so, as adverts do. It does that with rw_lock_t, and with a lock that takes
+ * a mutex for every reader, as rw_lock_t used to, and prints how fast the
+ * readers went and how long the writer had to wait.
+ * Usage: fsfuse [readers [reads per reader]]
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "locks.h"
+#include "utils.h"
+
+
+#define DEFAULT_READERS 32
+#define DEFAULT_READS 200000
+
+#define WRITE_INTERVAL_USECS 1000
+#define STATE_SIZE 8
+
+
+/* The old rw_lock_t, less its recursion check (which concurrent readers break) */
+typedef struct
+{
+    int readers_reading;
+    int writer_writing;
+    pthread_mutex_t mutex;
+    pthread_cond_t lock_free;
+} mutex_lock_t;
+
+static void *mutex_lock_new( void )
+{
+    mutex_lock_t *l = calloc( 1, sizeof(*l) );
+
+
+    pthread_mutex_init( &l->mutex, NULL );
+    pthread_cond_init( &l->lock_free, NULL );
+
+
+    return l;
+}
+
+static void mutex_lock_delete( void *l_void )
+{
+    mutex_lock_t *l = (mutex_lock_t *)l_void;
+
+
+    pthread_cond_destroy( &l->lock_free );
+    pthread_mutex_destroy( &l->mutex );
+    free( l );
+}
+
+static void mutex_lock_rlock( void *l_void )
+{
+    mutex_lock_t *l = (mutex_lock_t *)l_void;
+
+
+    pthread_mutex_lock( &l->mutex );
+    while( l->writer_writing ) pthread_cond_wait( &l->lock_free, &l->mutex );
+    l->readers_reading++;
+    pthread_mutex_unlock( &l->mutex );
+}
+
+static void mutex_lock_runlock( void *l_void )
+{
+    mutex_lock_t *l = (mutex_lock_t *)l_void;
+
+
+    pthread_mutex_lock( &l->mutex );
+    if( !--l->readers_reading ) pthread_cond_signal( &l->lock_free );
+    pthread_mutex_unlock( &l->mutex );
+}
+
+static void mutex_lock_wlock( void *l_void )
+{
+    mutex_lock_t *l = (mutex_lock_t *)l_void;
+
+
+    pthread_mutex_lock( &l->mutex );
+    while( l->writer_writing || l->readers_reading ) pthread_cond_wait( &l->lock_free, &l->mutex );
+    l->writer_writing = 1;
+    pthread_mutex_unlock( &l->mutex );
+}
+
+static void mutex_lock_wunlock( void *l_void )
+{
+    mutex_lock_t *l = (mutex_lock_t *)l_void;
+
+
+    pthread_mutex_lock( &l->mutex );
+    l->writer_writing = 0;
+    pthread_cond_broadcast( &l->lock_free );
+    pthread_mutex_unlock( &l->mutex );
+}
+
+
+/* rw_lock_t's own, with void * to fit the table */
+static void *rw_lock_new_void( void )       { return rw_lock_new( ); }
+static void rw_lock_delete_void( void *l )  { rw_lock_delete( l ); }
+static void rw_lock_rlock_void( void *l )   { rw_lock_rlock( l ); }
+static void rw_lock_runlock_void( void *l ) { rw_lock_runlock( l ); }
+static void rw_lock_wlock_void( void *l )   { rw_lock_wlock( l ); }
+static void rw_lock_wunlock_void( void *l ) { rw_lock_wunlock( l ); }
+
+
+typedef struct
+{
+    const char *name;
+    void *(*new_fn)( void );
+    void (*delete_fn)( void * );
+    void (*rlock)( void * );
+    void (*runlock)( void * );
+    void (*wlock)( void * );
+    void (*wunlock)( void * );
+} lock_ops_t;
+
+static const lock_ops_t s_locks[] =
+{
+    { "mutex",     &mutex_lock_new,   &mutex_lock_delete,
+      &mutex_lock_rlock, &mutex_lock_runlock, &mutex_lock_wlock, &mutex_lock_wunlock },
+    { "rw_lock_t", &rw_lock_new_void, &rw_lock_delete_void,
+      &rw_lock_rlock_void, &rw_lock_runlock_void, &rw_lock_wlock_void, &rw_lock_wunlock_void }
+};
+
+
+typedef struct
+{
+    const lock_ops_t *ops;
+    void *lock;
+    unsigned state[ STATE_SIZE ];
+    unsigned reads;
+    int readers_done;
+    unsigned writes;
+    double worst_wait;
+    unsigned bad_reads;
+} run_t;
+
+static void *reader_main( void *r_void )
+{
+    run_t *r = (run_t *)r_void;
+    unsigned i, j, first;
+
+
+    for( i = 0; i < r->reads; i++ )
+    {
+        r->ops->rlock( r->lock );
+        /* The writer keeps them all the same */
+        first = r->state[ 0 ];
+        for( j = 1; j < STATE_SIZE; j++ )
+        {
+            if( r->state[ j ] != first ) __atomic_add_fetch( &r->bad_reads, 1, __ATOMIC_RELAXED );
+        }
+        r->ops->runlock( r->lock );
+    }
+
+
+    return NULL;
+}
+
+static void *writer_main( void *r_void )
+{
+    run_t *r = (run_t *)r_void;
+    double start, wait;
+    unsigned j;
+
+
+    while( !__atomic_load_n( &r->readers_done, __ATOMIC_SEQ_CST ) )
+    {
+        start = fsfuse_get_time( );
+        r->ops->wlock( r->lock );
+        wait = fsfuse_get_time( ) - start;
+
+        for( j = 0; j < STATE_SIZE; j++ ) r->state[ j ]++;
+        r->ops->wunlock( r->lock );
+
+        r->writes++;
+        r->worst_wait = MAX( r->worst_wait, wait );
+
+        usleep( WRITE_INTERVAL_USECS );
+    }
+
+
+    return NULL;
+}
+
+static double run( run_t *r, unsigned readers )
+{
+    pthread_t *threads = calloc( readers, sizeof(*threads) );
+    pthread_t writer;
+    double start = fsfuse_get_time( ), secs;
+    unsigned i;
+
+
+    r->lock = r->ops->new_fn( );
+
+    pthread_create( &writer, NULL, &writer_main, r );
+    for( i = 0; i < readers; i++ )
+    {
+        pthread_create( &threads[ i ], NULL, &reader_main, r );
+    }
+    for( i = 0; i < readers; i++ )
+    {
+        pthread_join( threads[ i ], NULL );
+    }
+    secs = fsfuse_get_time( ) - start;
+
+    __atomic_store_n( &r->readers_done, 1, __ATOMIC_SEQ_CST );
+    pthread_join( writer, NULL );
+
+    r->ops->delete_fn( r->lock );
+    free( threads );
+
+
+    return secs;
+}
+
+
+int main( int argc, char **argv )
+{
+    unsigned readers = (argc > 1) ? strtoul( argv[ 1 ], NULL, 10 ) : DEFAULT_READERS;
+    unsigned reads = (argc > 2) ? strtoul( argv[ 2 ], NULL, 10 ) : DEFAULT_READS;
+    double secs[ 2 ];
+    run_t r;
+    unsigned i;
+
+
+    if( !readers || !reads )
+    {
+        fprintf( stderr, "usage: %s [readers [reads per reader]]\n", argv[ 0 ] );
+        return 1;
+    }
+
+    utils_init( );
+
+    printf( "%u readers, %u reads each, a write every %u us\n", readers, reads, WRITE_INTERVAL_USECS );
+
+    for( i = 0; i < 2; i++ )
+    {
+        memset( &r, 0, sizeof(r) );
+        r.ops = &s_locks[ i ];
+        r.reads = reads;
+
+        secs[ i ] = run( &r, readers );
+
+        printf( "%-10s %8.1f ns/read   %6u writes, worst wait %8.3f ms%s",
+                r.ops->name,
+                secs[ i ] * 1e9 / ((double)readers * reads),
+                r.writes,
+                r.worst_wait * 1e3,
+                r.bad_reads ? "   (TORN READS!)" : "" );
+        if( i ) printf( "   speedup %.1fx", secs[ 0 ] / secs[ i ] );
+        printf( "\n" );
+    }
+
+    utils_finalise( );
+
+
+    return 0;
+}
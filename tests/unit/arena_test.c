@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Arena tests.
+ */
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "arena.h"
+
+
+#define MANY 5000
+
+
+START_TEST( allocations_are_separate )
+{
+    unsigned char **ps = malloc( MANY * sizeof(*ps) );
+    size_t size;
+    unsigned i;
+
+    /* Setup */
+    arena_t *arena = arena_new( );
+
+    /* Odd sizes, so that alignment matters, and enough to need many blocks */
+    for( i = 0; i < MANY; i++ )
+    {
+        size = 1 + i % 37;
+        ps[ i ] = arena_alloc( arena, size );
+        memset( ps[ i ], i & 0xff, size );
+    }
+
+    /* Assert */
+    for( i = 0; i < MANY; i++ )
+    {
+        fail_unless( (uintptr_t)ps[ i ] % sizeof(void *) == 0, "allocations should be aligned" );
+        ck_assert_int_eq( ps[ i ][ 0 ], i & 0xff );
+        ck_assert_int_eq( ps[ i ][ i % 37 ], i & 0xff );
+    }
+
+    /* Teardown */
+    arena_release( arena );
+    free( ps );
+}
+END_TEST
+
+START_TEST( big_allocation )
+{
+    size_t size = 1024 * 1024;
+    char *small, *big;
+
+    /* Setup */
+    arena_t *arena = arena_new( );
+
+    small = arena_alloc( arena, 16 );
+    big = arena_alloc( arena, size );
+    memset( small, 'a', 16 );
+    memset( big, 'b', size );
+
+    /* Assert */
+    fail_unless( small[ 15 ] == 'a', "small allocation should be intact" );
+    fail_unless( big[ 0 ] == 'b' && big[ size - 1 ] == 'b', "big allocation should be usable" );
+
+    /* Teardown */
+    arena_release( arena );
+}
+END_TEST
+
+/* It lasts as long as anything holds it */
+START_TEST( held )
+{
+    char *p;
+
+    /* Setup */
+    arena_t *arena = arena_new( );
+
+    p = arena_alloc( arena, 8 );
+    arena_hold( arena );
+    arena_hold( arena );
+    arena_release( arena );
+    arena_release( arena );
+
+    /* Assert */
+    strcpy( p, "still" );
+    ck_assert_str_eq( p, "still" );
+
+    /* Teardown */
+    arena_release( arena );
+}
+END_TEST
+
+
+Suite *arena_tests( void )
+{
+    Suite *s = suite_create( "arena" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, allocations_are_separate );
+    tcase_add_test( tc_simple, big_allocation );
+    tcase_add_test( tc_simple, held );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
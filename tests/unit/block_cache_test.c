@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Block cache tests.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "block_cache.h"
+#include "config_manager.h"
+
+
+#define BS BLOCK_CACHE_BLOCK_SIZE
+
+
+START_TEST( read_spans_blocks )
+{
+    char *data = malloc( 2 * BS ), *buf = malloc( 2 * BS );
+    size_t i;
+
+    /* Setup */
+    block_cache_init( );
+    for( i = 0; i < 2 * BS; i++ ) data[ i ] = (char)i;
+
+    /* Assert */
+    fail_unless( block_cache_is_enabled( ), "cache should be on by default" );
+    ck_assert_int_eq( block_cache_read( "hash", 0, 16, buf ), 0 );
+
+    block_cache_insert( "hash", 0, data, BS );
+    block_cache_insert( "hash", 1, data + BS, BS );
+
+    ck_assert_int_eq( block_cache_read( "hash", BS - 8, 16, buf ), 16 );
+    fail_unless( !memcmp( buf, data + BS - 8, 16 ), "should read across the block boundary" );
+
+    ck_assert_int_eq( block_cache_read( "other", 0, 16, buf ), 0 );
+
+    /* Teardown */
+    block_cache_finalise( );
+    config_singleton_delete( );
+    free( data );
+    free( buf );
+}
+END_TEST
+
+START_TEST( read_stops_at_gap )
+{
+    char *data = calloc( 1, BS ), *buf = malloc( 3 * BS );
+
+    /* Setup - blocks 0 and 2, but not 1 */
+    block_cache_init( );
+    block_cache_insert( "hash", 0, data, BS );
+    block_cache_insert( "hash", 2, data, BS );
+
+    /* Assert */
+    ck_assert_int_eq( block_cache_read( "hash", 100, 3 * BS - 100, buf ), BS - 100 );
+
+    /* Short last block */
+    block_cache_insert( "hash", 3, data, 10 );
+    ck_assert_int_eq( block_cache_read( "hash", 2 * BS, 2 * BS, buf ), BS + 10 );
+
+    /* Teardown */
+    block_cache_finalise( );
+    config_singleton_delete( );
+    free( data );
+    free( buf );
+}
+END_TEST
+
+START_TEST( stays_under_budget )
+{
+    char *data = calloc( 1, BS ), buf[ 1 ];
+    const unsigned count = 512; /* 128MiB; twice the default budget */
+    unsigned i, cached = 0;
+
+    /* Setup */
+    block_cache_init( );
+    for( i = 0; i < count; i++ )
+    {
+        block_cache_insert( "hash", i, data, BS );
+    }
+
+    /* Assert */
+    for( i = 0; i < count; i++ )
+    {
+        cached += block_cache_read( "hash", (off_t)i * BS, 1, buf );
+    }
+    fail_unless( cached <= 64 * 1024 * 1024 / BS, "should have evicted down to the budget" );
+    fail_unless( cached > 0, "shouldn't have evicted everything" );
+    ck_assert_int_eq( block_cache_read( "hash", (off_t)(count - 1) * BS, 1, buf ), 1 );
+
+    /* Teardown */
+    block_cache_finalise( );
+    config_singleton_delete( );
+    free( data );
+}
+END_TEST
+
+/* Spans point into the cache, and outlast their blocks being evicted */
+START_TEST( get_holds_blocks )
+{
+    char *data = malloc( BS ), *zeroes = calloc( 1, BS );
+    block_cache_span_t spans[ 4 ];
+    const unsigned count = 512;
+    unsigned i;
+
+    /* Setup */
+    block_cache_init( );
+    memset( data, 'x', BS );
+    block_cache_insert( "hash", 0, data, BS );
+    block_cache_insert( "hash", 1, data, 10 );
+
+    /* Assert */
+    ck_assert_int_eq( block_cache_get( "hash", BS - 8, 2 * BS, spans, 4 ), 2 );
+    ck_assert_int_eq( spans[ 0 ].len, 8 );
+    ck_assert_int_eq( spans[ 1 ].len, 10 );
+    ck_assert_int_eq( block_cache_get( "other", 0, 16, spans + 2, 2 ), 0 );
+
+    /* Push them out */
+    for( i = 0; i < count; i++ )
+    {
+        block_cache_insert( "filler", i, zeroes, BS );
+    }
+    fail_unless( spans[ 0 ].data[ 0 ] == 'x' && spans[ 1 ].data[ 9 ] == 'x',
+                 "held spans should survive eviction" );
+
+    /* Teardown */
+    block_cache_release( spans, 2 );
+    block_cache_finalise( );
+    config_singleton_delete( );
+    free( data );
+    free( zeroes );
+}
+END_TEST
+
+
+Suite *block_cache_tests( void )
+{
+    Suite *s = suite_create( "block_cache" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, read_spans_blocks );
+    tcase_add_test( tc_simple, read_stops_at_gap );
+    tcase_add_test( tc_simple, stays_under_budget );
+    tcase_add_test( tc_simple, get_holds_blocks );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Disk cache tests.
+ * Each test gets a fresh cache directory, and a config file pointing at it.
+ */
+
+#include "common.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "block_cache.h"
+#include "config_manager.h"
+#include "disk_cache.h"
+#include "utils.h"
+
+
+#define BS BLOCK_CACHE_BLOCK_SIZE
+
+
+static char s_dir[] = "/tmp/fsfuse_disk_cache_test_XXXXXX";
+
+
+/* Makes the cache directory, and a config file that uses it with a budget of
+ * <size_mb> */
+static void setup( int size_mb )
+{
+    char *path;
+    FILE *f;
+
+
+    fail_unless( mkdtemp( strcpy( s_dir, "/tmp/fsfuse_disk_cache_test_XXXXXX" ) ) != NULL,
+                 "couldn't make test directory" );
+
+    path = path_combine( strdup( s_dir ), strdup( "fsfuserc" ) );
+    f = fopen( path, "w" );
+    fprintf( f, "<config version=\"1.0\"><disk_cache><dir>%s/cache</dir><size_mb>%d</size_mb></disk_cache></config>\n",
+             s_dir, size_mb );
+    fclose( f );
+
+    config_manager_add_from_file( path );
+}
+
+static char *cache_file( const char *name )
+{
+    char *dir = path_combine( strdup( s_dir ), strdup( "cache" ) );
+
+
+    return path_combine( dir, strdup( name ) );
+}
+
+static void touch( const char *name, const char *contents )
+{
+    char *path = cache_file( name );
+    FILE *f = fopen( path, "w" );
+
+
+    fputs( contents, f );
+    fclose( f );
+    free( path );
+}
+
+static int exists( const char *name )
+{
+    char *path = cache_file( name );
+    int rc = !access( path, F_OK );
+
+
+    free( path );
+
+
+    return rc;
+}
+
+static void teardown( void )
+{
+    char *dir = path_combine( strdup( s_dir ), strdup( "cache" ) ), *path;
+    DIR *d = opendir( dir );
+    struct dirent *ent;
+
+
+    while( d && (ent = readdir( d )) )
+    {
+        if( ent->d_name[ 0 ] == '.' ) continue;
+
+        path = cache_file( ent->d_name );
+        unlink( path );
+        free( path );
+    }
+    if( d ) closedir( d );
+    rmdir( dir );
+    free( dir );
+
+    path = path_combine( strdup( s_dir ), strdup( "fsfuserc" ) );
+    unlink( path );
+    free( path );
+    rmdir( s_dir );
+
+    config_singleton_delete( );
+}
+
+
+START_TEST( survives_restart )
+{
+    char *data = malloc( BS ), *buf = malloc( BS );
+    size_t len, i;
+
+    /* Setup */
+    setup( 16 );
+    for( i = 0; i < BS; i++ ) data[ i ] = (char)i;
+
+    disk_cache_init( );
+    fail_unless( disk_cache_is_enabled( ), "cache should be on" );
+    disk_cache_insert_block( "abc", 0, data, BS );
+    disk_cache_insert_block( "abc", 1, data, 10 );
+    disk_cache_finalise( );
+
+    /* Assert - a new instance finds the blocks */
+    disk_cache_init( );
+
+    fail_unless( disk_cache_tryget_block( "abc", 0, buf, &len ), "first block should be there" );
+    ck_assert_int_eq( len, BS );
+    fail_unless( !memcmp( buf, data, BS ), "first block should be intact" );
+
+    fail_unless( disk_cache_tryget_block( "abc", 1, buf, &len ), "last block should be there" );
+    ck_assert_int_eq( len, 10 );
+    fail_unless( !memcmp( buf, data, 10 ), "last block should be intact" );
+
+    fail_if( disk_cache_tryget_block( "abc", 2, buf, &len ), "past the end shouldn't be there" );
+    fail_if( disk_cache_tryget_block( "def", 0, buf, &len ), "other hash shouldn't be there" );
+
+    /* Teardown */
+    disk_cache_finalise( );
+    teardown( );
+    free( data );
+    free( buf );
+}
+END_TEST
+
+START_TEST( evicts_least_recently_used )
+{
+    char *data = calloc( 1, BS ), *buf = malloc( BS );
+    size_t len;
+
+    /* Setup - 1MiB is four blocks */
+    setup( 1 );
+    disk_cache_init( );
+    disk_cache_insert_block( "aaa", 0, data, BS );
+    disk_cache_insert_block( "aaa", 1, data, BS );
+    disk_cache_insert_block( "bbb", 0, data, BS );
+    disk_cache_insert_block( "bbb", 1, data, BS );
+    disk_cache_finalise( );
+
+    /* Assert - use aaa, so that bbb goes to make room */
+    disk_cache_init( );
+    fail_unless( disk_cache_tryget_block( "aaa", 0, buf, &len ), "aaa should be there" );
+    disk_cache_insert_block( "ccc", 0, data, BS );
+    disk_cache_finalise( );
+
+    fail_unless( exists( "aaa.data" ), "aaa should have been kept" );
+    fail_if( exists( "bbb.data" ), "bbb should have been evicted" );
+    fail_if( exists( "bbb.meta" ), "bbb should have been evicted" );
+
+    disk_cache_init( );
+    fail_unless( disk_cache_tryget_block( "ccc", 0, buf, &len ), "ccc should be there" );
+    fail_if( disk_cache_tryget_block( "bbb", 0, buf, &len ), "bbb should be gone" );
+
+    /* Teardown */
+    disk_cache_finalise( );
+    teardown( );
+    free( data );
+    free( buf );
+}
+END_TEST
+
+START_TEST( tidies_up_after_crash )
+{
+    char *data = calloc( 1, BS ), *buf = malloc( BS );
+    size_t len;
+
+    /* Setup - a good file, a data file whose meta never got written, a
+     * half-written meta, and a nonsense one */
+    setup( 16 );
+    disk_cache_init( );
+    disk_cache_insert_block( "good", 0, data, BS );
+    disk_cache_finalise( );
+
+    touch( "orphan.data", "data" );
+    touch( "good.meta.tmp", "fsfuse-disk" );
+    touch( "bad.meta", "fsfuse-disk-cache 1\neof -1\nused 0\nbitmap 4\nzz" );
+    touch( "bad.data", "data" );
+
+    /* Assert */
+    disk_cache_init( );
+
+    fail_unless( disk_cache_tryget_block( "good", 0, buf, &len ), "good block should survive" );
+    fail_if( disk_cache_tryget_block( "bad", 0, buf, &len ), "bad meta should be ignored" );
+    fail_if( exists( "orphan.data" ), "orphaned data should be removed" );
+    fail_if( exists( "good.meta.tmp" ), "temporary meta should be removed" );
+    fail_if( exists( "bad.meta" ), "bad meta should be removed" );
+    fail_if( exists( "bad.data" ), "bad meta's data should be removed" );
+
+    /* Teardown */
+    disk_cache_finalise( );
+    teardown( );
+    free( data );
+    free( buf );
+}
+END_TEST
+
+
+Suite *disk_cache_tests( void )
+{
+    Suite *s = suite_create( "disk_cache" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, survives_restart );
+    tcase_add_test( tc_simple, evicts_least_recently_used );
+    tcase_add_test( tc_simple, tidies_up_after_crash );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
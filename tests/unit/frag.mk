@@ -9,16 +9,24 @@ TEST_HERE := $(ROOT)/tests/unit
 vpath %.c $(TEST_HERE)
 
 TEST_OBJS :=                        \
-             binary_heap_test.o     \
+             arena_test.o           \
+             block_cache_test.o     \
              config_test.o          \
+             disk_cache_test.o      \
              indexnode_test.o       \
              indexnodes_list_test.o \
+             interval_tree_test.o   \
+             locks_test.o           \
+             name_index_test.o      \
              parser_xml_test.o      \
              parser_test.o          \
              parser_stubs.o         \
              proto_indexnode_test.o \
              ref_count_test.o       \
+             ring_buffer_test.o     \
+             scheduler_test.o       \
              string_buffer_test.o   \
+             string_pool_test.o     \
              utils_test.o
 
 TEST_OBJS += indexnode_stubs.o
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Interval tree tests.
+ */
+
+#include "common.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "interval_tree.h"
+
+
+#define MANY 500
+
+
+START_TEST( empty_is_sane )
+{
+    /* Setup */
+    interval_tree_t *tree = interval_tree_new( );
+
+    /* Assert */
+    fail_unless( tree != NULL, "tree should be non-null" );
+    ck_assert_int_eq( interval_tree_get_count( tree ), 0 );
+    fail_unless( interval_tree_first( tree ) == NULL, "empty tree should have no first node" );
+    fail_unless( interval_tree_first_overlap( tree, 0, INT64_MAX ) == NULL, "empty tree should overlap nothing" );
+
+    /* Teardown */
+    interval_tree_delete( tree );
+}
+END_TEST
+
+START_TEST( in_order_of_start )
+{
+    const int64_t starts[] = { 30, 10, 50, 20, 40, 10 };
+    const int64_t sorted[] = { 10, 10, 20, 30, 40, 50 };
+    int values[ sizeof(starts) / sizeof(starts[0]) ];
+    interval_node_t *node;
+    unsigned i;
+
+    /* Setup */
+    interval_tree_t *tree = interval_tree_new( );
+
+    for( i = 0; i < sizeof(starts) / sizeof(starts[0]); i++ )
+    {
+        values[ i ] = i;
+        interval_tree_add( tree, starts[ i ], starts[ i ] + 5, &values[ i ] );
+    }
+
+    /* Assert - equal starts come out in the order they went in */
+    node = interval_tree_first( tree );
+    for( i = 0; i < sizeof(sorted) / sizeof(sorted[0]); i++ )
+    {
+        fail_unless( node != NULL, "should be more nodes" );
+        fail_unless( interval_node_get_start( node ) == sorted[ i ], "nodes should come out in order" );
+        node = interval_tree_next( node );
+    }
+    fail_unless( node == NULL, "should be no more nodes" );
+    ck_assert_int_eq( *(int *)interval_node_get_value( interval_tree_first( tree ) ), 1 );
+    ck_assert_int_eq( *(int *)interval_node_get_value( interval_tree_next( interval_tree_first( tree ) ) ), 5 );
+
+    /* Teardown */
+    while( (node = interval_tree_first( tree )) ) interval_tree_remove( tree, node );
+    interval_tree_delete( tree );
+}
+END_TEST
+
+START_TEST( overlaps )
+{
+    interval_node_t *node;
+
+    /* Setup */
+    interval_tree_t *tree = interval_tree_new( );
+
+    interval_tree_add( tree, 0, 100, NULL );
+    interval_tree_add( tree, 50, 150, NULL );
+    interval_tree_add( tree, 200, 300, NULL );
+    interval_tree_add( tree, 250, 250, NULL );
+
+    /* Assert - ranges are half-open */
+    node = interval_tree_first_overlap( tree, 100, 200 );
+    fail_unless( node && interval_node_get_start( node ) == 50, "[50,150) should overlap [100,200)" );
+    fail_unless( interval_tree_next_overlap( node, 100, 200 ) == NULL, "nothing else should overlap [100,200)" );
+
+    node = interval_tree_first_overlap( tree, 60, 70 );
+    fail_unless( node && interval_node_get_start( node ) == 0, "[0,100) should overlap [60,70)" );
+    node = interval_tree_next_overlap( node, 60, 70 );
+    fail_unless( node && interval_node_get_start( node ) == 50, "[50,150) should overlap [60,70)" );
+    fail_unless( interval_tree_next_overlap( node, 60, 70 ) == NULL, "nothing else should overlap [60,70)" );
+
+    fail_unless( interval_tree_first_overlap( tree, 150, 200 ) == NULL, "nothing should overlap [150,200)" );
+
+    /* An empty interval counts if it's within the range */
+    node = interval_tree_first_overlap( tree, 250, 251 );
+    fail_unless( node && interval_node_get_start( node ) == 200, "[200,300) should overlap [250,251)" );
+    node = interval_tree_next_overlap( node, 250, 251 );
+    fail_unless( node && interval_node_get_end( node ) == 250, "[250,250) should overlap [250,251)" );
+
+    /* Teardown */
+    while( (node = interval_tree_first( tree )) ) interval_tree_remove( tree, node );
+    interval_tree_delete( tree );
+}
+END_TEST
+
+/* Checks the overlap queries against looking at every interval, while adding
+ * and removing lots of them */
+START_TEST( many_random )
+{
+    int64_t starts[ MANY ], ends[ MANY ];
+    interval_node_t *nodes[ MANY ], *node;
+    int64_t q_start, q_end, last;
+    unsigned i, j, expected, found;
+
+    /* Setup */
+    interval_tree_t *tree = interval_tree_new( );
+
+    srandom( time( NULL ) );
+    for( i = 0; i < MANY; i++ )
+    {
+        starts[ i ] = random( ) % 10000;
+        ends[ i ] = starts[ i ] + random( ) % 200;
+        nodes[ i ] = interval_tree_add( tree, starts[ i ], ends[ i ], &starts[ i ] );
+    }
+    /* Take out every third one */
+    for( i = 0; i < MANY; i += 3 )
+    {
+        fail_unless( interval_tree_remove( tree, nodes[ i ] ) == &starts[ i ], "remove should give the value back" );
+        nodes[ i ] = NULL;
+    }
+
+    /* Assert */
+    ck_assert_int_eq( interval_tree_get_count( tree ), MANY - (MANY + 2) / 3 );
+
+    for( j = 0; j < 200; j++ )
+    {
+        q_start = random( ) % 10200;
+        q_end = q_start + random( ) % 300;
+
+        expected = 0;
+        for( i = 0; i < MANY; i++ )
+        {
+            if( nodes[ i ] && starts[ i ] < q_end &&
+                (ends[ i ] > q_start || starts[ i ] >= q_start) )
+            {
+                expected++;
+            }
+        }
+
+        found = 0;
+        last = INT64_MIN;
+        for( node = interval_tree_first_overlap( tree, q_start, q_end );
+             node;
+             node = interval_tree_next_overlap( node, q_start, q_end ) )
+        {
+            fail_unless( interval_node_get_start( node ) >= last, "overlaps should come out in order" );
+            last = interval_node_get_start( node );
+            found++;
+        }
+
+        ck_assert_int_eq( found, expected );
+    }
+
+    /* Teardown */
+    for( i = 0; i < MANY; i++ )
+    {
+        if( nodes[ i ] ) interval_tree_remove( tree, nodes[ i ] );
+    }
+    ck_assert_int_eq( interval_tree_get_count( tree ), 0 );
+    interval_tree_delete( tree );
+}
+END_TEST
+
+
+Suite *interval_tree_tests( void )
+{
+    Suite *s = suite_create( "interval_tree" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, empty_is_sane );
+    tcase_add_test( tc_simple, in_order_of_start );
+    tcase_add_test( tc_simple, overlaps );
+    tcase_add_test( tc_simple, many_random );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
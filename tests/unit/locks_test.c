@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Readers / writer lock tests.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "locks.h"
+
+
+/* Long enough for a thread that could get the lock to have got it */
+#define SETTLE_USECS (50 * 1000)
+
+
+typedef struct
+{
+    rw_lock_t *lock;
+    int write;
+    int got;
+} locker_t;
+
+static void *locker_main( void *l_void )
+{
+    locker_t *l = (locker_t *)l_void;
+
+
+    if( l->write ) rw_lock_wlock( l->lock );
+    else           rw_lock_rlock( l->lock );
+
+    __atomic_store_n( &l->got, 1, __ATOMIC_SEQ_CST );
+
+    if( l->write ) rw_lock_wunlock( l->lock );
+    else           rw_lock_runlock( l->lock );
+
+
+    return NULL;
+}
+
+/* Starts a thread that takes the lock and drops it again, and says whether it
+ * got it straight away. If not, the thread's left waiting in <thread> */
+static int locker_try( locker_t *l, pthread_t *thread, rw_lock_t *lock, int write )
+{
+    l->lock = lock;
+    l->write = write;
+    l->got = 0;
+
+    pthread_create( thread, NULL, &locker_main, l );
+    usleep( SETTLE_USECS );
+
+
+    return __atomic_load_n( &l->got, __ATOMIC_SEQ_CST );
+}
+
+
+START_TEST( recursive_read )
+{
+    /* Setup */
+    rw_lock_t *lock = rw_lock_new( );
+
+    /* Action */
+    ck_assert_int_eq( rw_lock_rlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_rlock( lock ), 0 );
+
+    /* Assert */
+    ck_assert_int_eq( rw_lock_runlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_runlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_runlock( lock ), -1 );
+    ck_assert_int_eq( rw_lock_wunlock( lock ), -1 );
+
+    /* Teardown */
+    rw_lock_delete( lock );
+}
+END_TEST
+
+START_TEST( readers_share )
+{
+    locker_t l;
+    pthread_t thread;
+
+    /* Setup */
+    rw_lock_t *lock = rw_lock_new( );
+    rw_lock_rlock( lock );
+
+    /* Action / Assert */
+    fail_unless( locker_try( &l, &thread, lock, 0 ), "another reader should get it" );
+
+    /* Teardown */
+    pthread_join( thread, NULL );
+    rw_lock_runlock( lock );
+    rw_lock_delete( lock );
+}
+END_TEST
+
+START_TEST( reader_excludes_writer )
+{
+    locker_t l;
+    pthread_t thread;
+
+    /* Setup */
+    rw_lock_t *lock = rw_lock_new( );
+    rw_lock_rlock( lock );
+
+    /* Action / Assert */
+    fail_if( locker_try( &l, &thread, lock, 1 ), "a writer shouldn't get it while it's being read" );
+    rw_lock_runlock( lock );
+    pthread_join( thread, NULL );
+    fail_unless( l.got, "the writer should get it once the reader's gone" );
+
+    /* Teardown */
+    rw_lock_delete( lock );
+}
+END_TEST
+
+START_TEST( writer_excludes_reader )
+{
+    locker_t l;
+    pthread_t thread;
+
+    /* Setup */
+    rw_lock_t *lock = rw_lock_new( );
+    rw_lock_wlock( lock );
+
+    /* Action / Assert */
+    fail_if( locker_try( &l, &thread, lock, 0 ), "a reader shouldn't get it while it's being written" );
+    rw_lock_wunlock( lock );
+    pthread_join( thread, NULL );
+    fail_unless( l.got, "the reader should get it once the writer's gone" );
+
+    /* Teardown */
+    rw_lock_delete( lock );
+}
+END_TEST
+
+START_TEST( read_while_writing )
+{
+    locker_t l;
+    pthread_t thread;
+
+    /* Setup */
+    rw_lock_t *lock = rw_lock_new( );
+
+    /* Action */
+    ck_assert_int_eq( rw_lock_wlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_wlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_rlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_wunlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_wunlock( lock ), 0 );
+
+    /* Assert: still reading, but not writing */
+    fail_unless( locker_try( &l, &thread, lock, 0 ), "a reader should get it" );
+    pthread_join( thread, NULL );
+    fail_if( locker_try( &l, &thread, lock, 1 ), "a writer shouldn't get it" );
+    ck_assert_int_eq( rw_lock_runlock( lock ), 0 );
+    pthread_join( thread, NULL );
+
+    /* Teardown */
+    rw_lock_delete( lock );
+}
+END_TEST
+
+START_TEST( no_upgrade )
+{
+    /* Setup */
+    rw_lock_t *lock = rw_lock_new( );
+    rw_lock_rlock( lock );
+
+    /* Action / Assert */
+    ck_assert_int_eq( rw_lock_wlock( lock ), -1 );
+    ck_assert_int_eq( rw_lock_runlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_wlock( lock ), 0 );
+    ck_assert_int_eq( rw_lock_wunlock( lock ), 0 );
+
+    /* Teardown */
+    rw_lock_delete( lock );
+}
+END_TEST
+
+
+Suite *locks_tests( void )
+{
+    Suite *s = suite_create( "locks" );
+
+    TCase *tc_rw_lock = tcase_create( "rw_lock" );
+    tcase_add_test( tc_rw_lock, recursive_read );
+    tcase_add_test( tc_rw_lock, readers_share );
+    tcase_add_test( tc_rw_lock, reader_excludes_writer );
+    tcase_add_test( tc_rw_lock, writer_excludes_reader );
+    tcase_add_test( tc_rw_lock, read_while_writing );
+    tcase_add_test( tc_rw_lock, no_upgrade );
+
+    suite_add_tcase( s, tc_rw_lock );
+
+    return s;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Name index tests.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "name_index.h"
+
+
+#define MANY 5000
+
+
+typedef struct
+{
+    char name[ 16 ];
+    unsigned n;
+} thing_t;
+
+static const char *thing_name( void *value )
+{
+    return ((thing_t *)value)->name;
+}
+
+
+START_TEST( empty_is_sane )
+{
+    /* Setup */
+    name_index_t *index = name_index_new( 0, &thing_name );
+
+    /* Assert */
+    fail_unless( index != NULL, "index should be non-null" );
+    ck_assert_int_eq( name_index_get_count( index ), 0 );
+    fail_unless( name_index_get( index, "foo" ) == NULL, "empty index should find nothing" );
+
+    /* Teardown */
+    name_index_delete( index );
+}
+END_TEST
+
+START_TEST( replaces_duplicates )
+{
+    thing_t a = { "foo", 1 }, b = { "bar", 2 }, c = { "foo", 3 };
+
+    /* Setup */
+    name_index_t *index = name_index_new( 2, &thing_name );
+
+    name_index_add( index, &a );
+    name_index_add( index, &b );
+    name_index_add( index, &c );
+
+    /* Assert */
+    ck_assert_int_eq( name_index_get_count( index ), 2 );
+    fail_unless( name_index_get( index, "foo" ) == &c, "later value should replace earlier one" );
+    fail_unless( name_index_get( index, "bar" ) == &b, "should find bar" );
+    fail_unless( name_index_get( index, "baz" ) == NULL, "shouldn't find baz" );
+    fail_unless( name_index_get( index, "" ) == NULL, "shouldn't find the empty name" );
+
+    /* Teardown */
+    name_index_delete( index );
+}
+END_TEST
+
+/* Starts small, so that it has to grow several times */
+START_TEST( many_grows )
+{
+    thing_t *things = malloc( MANY * sizeof(*things) );
+    thing_t *found;
+    char name[ 16 ];
+    unsigned i;
+
+    /* Setup */
+    name_index_t *index = name_index_new( 1, &thing_name );
+
+    for( i = 0; i < MANY; i++ )
+    {
+        snprintf( things[ i ].name, sizeof(things[ i ].name), "file%u.txt", i );
+        things[ i ].n = i;
+        name_index_add( index, &things[ i ] );
+    }
+
+    /* Assert */
+    ck_assert_int_eq( name_index_get_count( index ), MANY );
+    for( i = 0; i < MANY; i++ )
+    {
+        snprintf( name, sizeof(name), "file%u.txt", i );
+        found = name_index_get( index, name );
+        fail_unless( found != NULL, "should find every name" );
+        ck_assert_int_eq( found->n, i );
+    }
+    snprintf( name, sizeof(name), "file%u.txt", MANY );
+    fail_unless( name_index_get( index, name ) == NULL, "shouldn't find a name that wasn't added" );
+
+    /* Teardown */
+    name_index_delete( index );
+    free( things );
+}
+END_TEST
+
+
+Suite *name_index_tests( void )
+{
+    Suite *s = suite_create( "name_index" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, empty_is_sane );
+    tcase_add_test( tc_simple, replaces_duplicates );
+    tcase_add_test( tc_simple, many_grows );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
@@ -7,11 +7,12 @@
  * (at your option) any later version.
  *
  *
- * Proto-indexnode class unit tests
+ * Reference-counting class unit tests
  */
 
 #include "common.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -19,40 +20,89 @@
 #include "ref_count.h"
 
 
-START_TEST( ref_count_can_be_created_and_destroyed )
+#define THREADS 4
+#define ROUNDS 100000
+
+
+START_TEST( ref_count_starts_at_one )
 {
+    ref_count_t refc;
+
     /* Setup */
 
     /* Action */
-    ref_count_t *refc = ref_count_new( );
+    ref_count_init( &refc );
 
     /* Assert */
-    fail_unless( refc != NULL, "new ref counter should be non-null" );
+    fail_unless( ref_count_dec( &refc ) == 0, "new ref count should be 1" );
 
     /* Teardown */
-    ref_count_dec( refc );
-    ref_count_delete( refc );
 }
 END_TEST
 
 START_TEST( ref_count_can_be_inc_and_dec )
 {
+    ref_count_t refc;
+
+    /* Setup */
+
+    /* Action */
+    ref_count_init( &refc );
+
+    /* Assert */
+    fail_unless( ref_count_inc( &refc ) == 2, "ref count should be correct" );
+    fail_unless( ref_count_inc( &refc ) == 3, "ref count should be correct");
+    fail_unless( ref_count_inc( &refc ) == 4, "ref count should be correct" );
+    fail_unless( ref_count_dec( &refc ) == 3, "ref count should be correct" );
+    fail_unless( ref_count_dec( &refc ) == 2, "ref count should be correct" );
+    fail_unless( ref_count_dec( &refc ) == 1, "ref count should be correct" );
+    fail_unless( ref_count_dec( &refc ) == 0, "ref count should be correct" );
+
+    /* Teardown */
+}
+END_TEST
+
+static void *copy_and_delete( void *refc_void )
+{
+    ref_count_t *refc = (ref_count_t *)refc_void;
+    unsigned i;
+
+
+    for( i = 0; i < ROUNDS; i++ )
+    {
+        ref_count_inc( refc );
+        ref_count_dec( refc );
+    }
+
+
+    return NULL;
+}
+
+/* No copies or deletes are lost when threads race on the one count */
+START_TEST( ref_count_is_thread_safe )
+{
+    pthread_t threads[ THREADS ];
+    unsigned i;
+
     /* Setup */
+    ref_count_t *refc = malloc( sizeof(*refc) );
+    ref_count_init( refc );
 
     /* Action */
-    ref_count_t *refc = ref_count_new( );
+    for( i = 0; i < THREADS; i++ )
+    {
+        pthread_create( &threads[ i ], NULL, &copy_and_delete, refc );
+    }
+    for( i = 0; i < THREADS; i++ )
+    {
+        pthread_join( threads[ i ], NULL );
+    }
 
     /* Assert */
-    fail_unless( ref_count_inc( refc ) == 2, "ref count should be correct" );
-    fail_unless( ref_count_inc( refc ) == 3, "ref count should be correct");
-    fail_unless( ref_count_inc( refc ) == 4, "ref count should be correct" );
-    fail_unless( ref_count_dec( refc ) == 3, "ref count should be correct" );
-    fail_unless( ref_count_dec( refc ) == 2, "ref count should be correct" );
-    fail_unless( ref_count_dec( refc ) == 1, "ref count should be correct" );
-    fail_unless( ref_count_dec( refc ) == 0, "ref count should be correct" );
+    fail_unless( ref_count_dec( refc ) == 0, "ref count should be back to 1" );
 
     /* Teardown */
-    ref_count_delete( refc );
+    free( refc );
 }
 END_TEST
 
@@ -61,8 +111,9 @@ Suite *ref_count_tests( void )
     Suite *s = suite_create( "ref_count" );
 
     TCase *tc_core = tcase_create( "core" );
-    tcase_add_test( tc_core, ref_count_can_be_created_and_destroyed );
+    tcase_add_test( tc_core, ref_count_starts_at_one );
     tcase_add_test( tc_core, ref_count_can_be_inc_and_dec );
+    tcase_add_test( tc_core, ref_count_is_thread_safe );
 
     suite_add_tcase( s, tc_core );
 
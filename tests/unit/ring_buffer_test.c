@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Ring buffer tests.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "ring_buffer.h"
+
+
+START_TEST( empty_is_sane )
+{
+    char buf[ 4 ];
+
+    /* Setup */
+    ring_buffer_t *rb = ring_buffer_new( 8 );
+
+    /* Assert */
+    ck_assert_int_eq( ring_buffer_get_len( rb ), 0 );
+    ck_assert_int_eq( ring_buffer_get_space( rb ), 8 );
+    ck_assert_int_eq( ring_buffer_read( rb, buf, sizeof(buf) ), 0 );
+
+    /* Teardown */
+    ring_buffer_delete( rb );
+}
+END_TEST
+
+START_TEST( write_stops_when_full )
+{
+    char buf[ 8 ];
+
+    /* Setup */
+    ring_buffer_t *rb = ring_buffer_new( 8 );
+
+    /* Assert */
+    ck_assert_int_eq( ring_buffer_write( rb, "abcdef", 6 ), 6 );
+    ck_assert_int_eq( ring_buffer_write( rb, "ghijkl", 6 ), 2 );
+    ck_assert_int_eq( ring_buffer_get_space( rb ), 0 );
+
+    ck_assert_int_eq( ring_buffer_read( rb, buf, sizeof(buf) ), 8 );
+    fail_unless( !memcmp( buf, "abcdefgh", 8 ), "should read back what was written" );
+
+    /* Teardown */
+    ring_buffer_delete( rb );
+}
+END_TEST
+
+START_TEST( wraps_around )
+{
+    char buf[ 8 ];
+
+    /* Setup - leave the head near the end */
+    ring_buffer_t *rb = ring_buffer_new( 8 );
+    ring_buffer_write( rb, "xxxxxx", 6 );
+    ck_assert_int_eq( ring_buffer_drop( rb, 5 ), 5 );
+
+    /* Assert */
+    ck_assert_int_eq( ring_buffer_write( rb, "abcdefg", 7 ), 7 );
+    ck_assert_int_eq( ring_buffer_get_len( rb ), 8 );
+
+    ck_assert_int_eq( ring_buffer_read( rb, buf, 3 ), 3 );
+    fail_unless( !memcmp( buf, "xab", 3 ), "should read across the wrap" );
+    ck_assert_int_eq( ring_buffer_read( rb, buf, sizeof(buf) ), 5 );
+    fail_unless( !memcmp( buf, "cdefg", 5 ), "should read the rest" );
+
+    ring_buffer_write( rb, "abc", 3 );
+    ring_buffer_clear( rb );
+    ck_assert_int_eq( ring_buffer_get_len( rb ), 0 );
+
+    /* Teardown */
+    ring_buffer_delete( rb );
+}
+END_TEST
+
+
+Suite *ring_buffer_tests( void )
+{
+    Suite *s = suite_create( "ring_buffer" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, empty_is_sane );
+    tcase_add_test( tc_simple, write_stops_when_full );
+    tcase_add_test( tc_simple, wraps_around );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
@@ -0,0 +1,289 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * Scheduler tests.
+ */
+
+#include "common.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "config_manager.h"
+#include "scheduler.h"
+
+
+typedef struct
+{
+    scheduler_task_t *task;
+    pthread_mutex_t *lock;
+    pthread_cond_t *cond;
+    unsigned runs;
+    int block;   /* first run waits until this is cleared */
+    int finish;  /* next run deletes the task */
+} test_task_t;
+
+
+static void test_run( void *ctxt )
+{
+    test_task_t *t = (test_task_t *)ctxt;
+
+
+    pthread_mutex_lock( t->lock );
+
+    t->runs++;
+    pthread_cond_broadcast( t->cond );
+    while( t->block ) pthread_cond_wait( t->cond, t->lock );
+    if( t->finish ) scheduler_task_delete( t->task );
+
+    pthread_mutex_unlock( t->lock );
+}
+
+static void test_task_init( test_task_t *t, pthread_mutex_t *lock, pthread_cond_t *cond )
+{
+    t->lock = lock;
+    t->cond = cond;
+    t->runs = 0;
+    t->block = 0;
+    t->finish = 0;
+    t->task = scheduler_task_new( &test_run, t );
+}
+
+static void test_task_finish( test_task_t *t )
+{
+    pthread_mutex_lock( t->lock );
+    t->finish = 1;
+    scheduler_task_wake( t->task );
+    pthread_mutex_unlock( t->lock );
+}
+
+/* Waits for the task to have run at least <runs> times */
+static void test_task_wait( test_task_t *t, unsigned runs )
+{
+    pthread_mutex_lock( t->lock );
+    while( t->runs < runs ) pthread_cond_wait( t->cond, t->lock );
+    pthread_mutex_unlock( t->lock );
+}
+
+
+START_TEST( tasks_all_run )
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    test_task_t tasks[ 64 ];
+    unsigned i;
+
+    /* Setup */
+    scheduler_init( );
+
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        test_task_init( &tasks[ i ], &lock, &cond );
+    }
+
+    /* Assert */
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        scheduler_task_wake( tasks[ i ].task );
+    }
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        test_task_wait( &tasks[ i ], 1 );
+    }
+
+    /* Teardown */
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        test_task_finish( &tasks[ i ] );
+        test_task_wait( &tasks[ i ], 2 );
+    }
+    scheduler_finalise( );
+    config_singleton_delete( );
+}
+END_TEST
+
+START_TEST( wakes_coalesce )
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    test_task_t t;
+    unsigned i;
+
+    /* Setup */
+    scheduler_init( );
+    test_task_init( &t, &lock, &cond );
+    t.block = 1;
+
+    scheduler_task_wake( t.task );
+    test_task_wait( &t, 1 );
+
+    /* Assert - lots of wakes while it's running make it run once more */
+    for( i = 0; i < 10; i++ )
+    {
+        scheduler_task_wake( t.task );
+    }
+
+    pthread_mutex_lock( &lock );
+    t.block = 0;
+    pthread_cond_broadcast( &cond );
+    pthread_mutex_unlock( &lock );
+
+    test_task_wait( &t, 2 );
+    usleep( 50 * 1000 );
+    ck_assert_int_eq( t.runs, 2 );
+
+    /* Teardown */
+    test_task_finish( &t );
+    test_task_wait( &t, 3 );
+    scheduler_finalise( );
+    config_singleton_delete( );
+}
+END_TEST
+
+START_TEST( wake_after_waits )
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    test_task_t early, late;
+
+    /* Setup */
+    scheduler_init( );
+    test_task_init( &early, &lock, &cond );
+    test_task_init( &late, &lock, &cond );
+
+    /* Assert - asked in the "wrong" order, they still go off in time order */
+    scheduler_task_wake_after( late.task, 200 );
+    scheduler_task_wake_after( early.task, 50 );
+
+    usleep( 20 * 1000 );
+    ck_assert_int_eq( early.runs, 0 );
+    ck_assert_int_eq( late.runs, 0 );
+
+    test_task_wait( &early, 1 );
+    ck_assert_int_eq( late.runs, 0 );
+
+    test_task_wait( &late, 1 );
+    ck_assert_int_eq( early.runs, 1 );
+
+    /* Teardown */
+    test_task_finish( &early );
+    test_task_finish( &late );
+    test_task_wait( &early, 2 );
+    test_task_wait( &late, 2 );
+    scheduler_finalise( );
+    config_singleton_delete( );
+}
+END_TEST
+
+START_TEST( per_peer_slots_are_limited )
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    test_task_t tasks[ 3 ];
+    unsigned i;
+
+    /* Setup - default limit is two per peer */
+    scheduler_init( );
+
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        test_task_init( &tasks[ i ], &lock, &cond );
+    }
+
+    /* Assert */
+    fail_unless( scheduler_transfer_tryget( tasks[ 0 ].task, "peer" ), "first slot should be free" );
+    fail_unless( scheduler_transfer_tryget( tasks[ 1 ].task, "peer" ), "second slot should be free" );
+    fail_unless( !scheduler_transfer_tryget( tasks[ 2 ].task, "peer" ), "third slot should be refused" );
+    fail_unless( scheduler_transfer_tryget( tasks[ 0 ].task, "peer" ), "asking again should be fine" );
+
+    /* Releasing one should grant the waiter and wake it */
+    scheduler_transfer_release( tasks[ 0 ].task );
+    test_task_wait( &tasks[ 2 ], 1 );
+    fail_unless( scheduler_transfer_tryget( tasks[ 2 ].task, "peer" ), "waiter should have been given a slot" );
+
+    /* Teardown */
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        scheduler_transfer_release( tasks[ i ].task );
+        test_task_finish( &tasks[ i ] );
+    }
+    scheduler_finalise( );
+    config_singleton_delete( );
+}
+END_TEST
+
+START_TEST( total_slots_are_limited )
+{
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    test_task_t tasks[ 17 ];
+    char peer[ 16 ];
+    unsigned i;
+
+    /* Setup - default limit is sixteen in total */
+    scheduler_init( );
+
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        test_task_init( &tasks[ i ], &lock, &cond );
+    }
+
+    /* Assert - all different peers, so only the total limit applies */
+    for( i = 0; i < 16; i++ )
+    {
+        sprintf( peer, "peer%u", i );
+        fail_unless( scheduler_transfer_tryget( tasks[ i ].task, peer ), "slot should be free" );
+    }
+    fail_unless( !scheduler_transfer_tryget( tasks[ 16 ].task, "another" ), "slot should be refused" );
+
+    /* An idle transfer gets asked to yield */
+    fail_if( scheduler_transfer_should_yield( tasks[ 3 ].task ), "shouldn't have to yield yet" );
+    scheduler_transfer_set_idle( tasks[ 3 ].task, 1 );
+    test_task_wait( &tasks[ 3 ], 1 );
+    fail_unless( scheduler_transfer_should_yield( tasks[ 3 ].task ), "idle transfer should yield" );
+
+    scheduler_transfer_release( tasks[ 3 ].task );
+    test_task_wait( &tasks[ 16 ], 1 );
+    fail_unless( scheduler_transfer_tryget( tasks[ 16 ].task, "another" ), "waiter should have been given a slot" );
+
+    /* Teardown */
+    for( i = 0; i < (sizeof(tasks) / sizeof(tasks[ 0 ])); i++ )
+    {
+        scheduler_transfer_release( tasks[ i ].task );
+        test_task_finish( &tasks[ i ] );
+    }
+    scheduler_finalise( );
+    config_singleton_delete( );
+}
+END_TEST
+
+
+Suite *scheduler_tests( void )
+{
+    Suite *s = suite_create( "scheduler" );
+
+    TCase *tc_tasks = tcase_create( "tasks" );
+    tcase_add_test( tc_tasks, tasks_all_run );
+    tcase_add_test( tc_tasks, wakes_coalesce );
+    tcase_add_test( tc_tasks, wake_after_waits );
+
+    TCase *tc_slots = tcase_create( "transfer_slots" );
+    tcase_add_test( tc_slots, per_peer_slots_are_limited );
+    tcase_add_test( tc_slots, total_slots_are_limited );
+
+    suite_add_tcase( s, tc_tasks );
+    suite_add_tcase( s, tc_slots );
+
+    return s;
+}
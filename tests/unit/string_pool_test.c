@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2008-2013 Matthew Turner.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *
+ * String pool tests.
+ */
+
+#include "common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <check.h>
+#include "tests.h"
+
+#include "string_pool.h"
+
+
+#define MANY 5000
+
+
+START_TEST( null_is_sane )
+{
+    /* Setup */
+    unsigned count = string_pool_get_count( );
+
+    /* Assert */
+    fail_unless( string_pool_intern( NULL ) == NULL, "interning NULL should give NULL" );
+    fail_unless( string_pool_copy( NULL ) == NULL, "copying NULL should give NULL" );
+    string_pool_release( NULL );
+    ck_assert_int_eq( string_pool_get_count( ), count );
+}
+END_TEST
+
+START_TEST( same_string_same_pointer )
+{
+    char foo[] = "foo";
+    const char *a, *b, *c, *d;
+
+    /* Setup */
+    unsigned count = string_pool_get_count( );
+
+    a = string_pool_intern( "foo" );
+    b = string_pool_intern( foo );
+    c = string_pool_intern( "bar" );
+    d = string_pool_copy( a );
+
+    /* Assert */
+    fail_unless( a != foo, "should be a copy" );
+    fail_unless( a == b, "equal strings should be the same pointer" );
+    fail_unless( a == d, "a copy should be the same pointer" );
+    fail_unless( a != c, "different strings should be different pointers" );
+    ck_assert_str_eq( a, "foo" );
+    ck_assert_str_eq( c, "bar" );
+    ck_assert_int_eq( string_pool_get_count( ), count + 2 );
+
+    /* Teardown */
+    string_pool_release( a );
+    string_pool_release( b );
+    ck_assert_int_eq( string_pool_get_count( ), count + 2 );
+    string_pool_release( d );
+    ck_assert_int_eq( string_pool_get_count( ), count + 1 );
+    string_pool_release( c );
+    ck_assert_int_eq( string_pool_get_count( ), count );
+}
+END_TEST
+
+/* Enough to make the shards grow */
+START_TEST( many_grows )
+{
+    const char **pooled = malloc( MANY * sizeof(*pooled) );
+    char s[ 32 ];
+    unsigned i;
+
+    /* Setup */
+    unsigned count = string_pool_get_count( );
+
+    for( i = 0; i < MANY; i++ )
+    {
+        snprintf( s, sizeof(s), "client%u", i );
+        pooled[ i ] = string_pool_intern( s );
+    }
+
+    /* Assert */
+    ck_assert_int_eq( string_pool_get_count( ), count + MANY );
+    for( i = 0; i < MANY; i++ )
+    {
+        snprintf( s, sizeof(s), "client%u", i );
+        fail_unless( string_pool_intern( s ) == pooled[ i ], "should find every string again" );
+        string_pool_release( pooled[ i ] );
+    }
+
+    /* Teardown */
+    for( i = 0; i < MANY; i++ ) string_pool_release( pooled[ i ] );
+    ck_assert_int_eq( string_pool_get_count( ), count );
+    free( pooled );
+}
+END_TEST
+
+
+Suite *string_pool_tests( void )
+{
+    Suite *s = suite_create( "string_pool" );
+
+    TCase *tc_simple = tcase_create( "simple" );
+    tcase_add_test( tc_simple, null_is_sane );
+    tcase_add_test( tc_simple, same_string_same_pointer );
+    tcase_add_test( tc_simple, many_grows );
+
+    suite_add_tcase( s, tc_simple );
+
+    return s;
+}
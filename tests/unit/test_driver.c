@@ -18,6 +18,7 @@
 
 #include "tests.h"
 
+#include "string_pool.h"
 #include "utils.h"
 
 
@@ -28,17 +29,26 @@ int main (int argc, char **argv)
 
     utils_init( );
     trace_init( );
+    string_pool_init( );
 
     SRunner *r = srunner_create( NULL );
-    srunner_add_suite( r, binary_heap_tests( ) );
+    srunner_add_suite( r, arena_tests( ) );
+    srunner_add_suite( r, block_cache_tests( ) );
     srunner_add_suite( r, config_tests( ) );
+    srunner_add_suite( r, disk_cache_tests( ) );
     srunner_add_suite( r, indexnode_tests( ) );
     srunner_add_suite( r, indexnodes_list_tests( ) );
+    srunner_add_suite( r, interval_tree_tests( ) );
+    srunner_add_suite( r, locks_tests( ) );
+    srunner_add_suite( r, name_index_tests( ) );
     srunner_add_suite( r, parser_tests( ) );
     srunner_add_suite( r, parser_xml_tests( ) );
     srunner_add_suite( r, proto_indexnode_tests( ) );
     srunner_add_suite( r, ref_count_tests( ) );
+    srunner_add_suite( r, ring_buffer_tests( ) );
+    srunner_add_suite( r, scheduler_tests( ) );
     srunner_add_suite( r, string_buffer_tests( ) );
+    srunner_add_suite( r, string_pool_tests( ) );
 
     if( argc == 2 && !strcmp( argv[1], "-n" ) ) srunner_set_fork_status( r, CK_NOFORK );
 
@@ -48,6 +58,7 @@ int main (int argc, char **argv)
 
     srunner_free( r );
 
+    string_pool_finalise( );
     trace_finalise( );
     utils_finalise( );
 
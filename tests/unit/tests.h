@@ -7,15 +7,23 @@
 #include <check.h>
 
 
-extern Suite *binary_heap_tests( void );
+extern Suite *arena_tests( void );
+extern Suite *block_cache_tests( void );
 extern Suite *config_tests( void );
+extern Suite *disk_cache_tests( void );
 extern Suite *indexnode_tests( void );
 extern Suite *indexnodes_list_tests( void );
+extern Suite *interval_tree_tests( void );
+extern Suite *locks_tests( void );
+extern Suite *name_index_tests( void );
 extern Suite *parser_tests( void );
 extern Suite *parser_xml_tests( void );
 extern Suite *proto_indexnode_tests( void );
 extern Suite *ref_count_tests( void );
+extern Suite *ring_buffer_tests( void );
+extern Suite *scheduler_tests( void );
 extern Suite *string_buffer_tests( void );
+extern Suite *string_pool_tests( void );
 
 extern char *test_isolate_file( const char *name );
 